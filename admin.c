@@ -0,0 +1,159 @@
+/*
+ * admin.c - a local-only control socket for tuning a running tiny (-M)
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <sys/stat.h>
+#include "admin.h"
+
+#define ADMIN_TIMEOUT 1     /* seconds a client may take to send its request */
+
+struct admin {
+    int listenfd;
+    struct admin_setting *settings;
+    int n;
+};
+
+/* find - the setting called name, or NULL */
+static struct admin_setting *find(struct admin *a, char *name) {
+    int i;
+
+    for (i = 0; i < a->n; i++)
+        if (!strcmp(a->settings[i].name, name))
+            return &a->settings[i];
+    return NULL;
+}
+
+/* reply - a whole response; the connection is closed after it */
+static void reply(int fd, char *status, char *body) {
+    char hdr[MAXLINE];
+
+    sprintf(hdr, "HTTP/1.0 %s\r\nContent-type: text/plain\r\n"
+            "Content-length: %d\r\n\r\n", status, (int)strlen(body));
+    if (rio_writen(fd, hdr, strlen(hdr)) >= 0)
+        rio_writen(fd, body, strlen(body));
+}
+
+/* list - every setting and its value, one per line */
+static void list(struct admin *a, char *buf) {
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < a->n; i++)
+        sprintf(buf + strlen(buf), "%s %d\n", a->settings[i].name,
+                a->settings[i].get());
+}
+
+/*
+ * apply - change each name=value of query in turn. On the first bad one,
+ *     returns -1 with the reason in err.
+ */
+static int apply(struct admin *a, char *query, char *err) {
+    struct admin_setting *s;
+    char *pair, *eq, *end, *save;
+    int old;
+    long v;
+
+    for (pair = strtok_r(query, "&", &save); pair != NULL;
+            pair = strtok_r(NULL, "&", &save)) {
+        if ((eq = strchr(pair, '=')) == NULL) {
+            sprintf(err, "expected name=value: %.200s\n", pair);
+            return -1;
+        }
+        *eq = '\0';
+        if ((s = find(a, pair)) == NULL) {
+            sprintf(err, "no setting %.200s\n", pair);
+            return -1;
+        }
+        v = strtol(eq + 1, &end, 10);
+        old = s->get();
+        if (end == eq + 1 || *end != '\0' || v < INT_MIN || v > INT_MAX ||
+                s->set((int)v) < 0) {
+            sprintf(err, "bad value for %s: %.200s\n", pair, eq + 1);
+            return -1;
+        }
+        printf("admin: %s %d -> %d\n", pair, old, s->get());
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* serve - answer one request on fd */
+static void serve(struct admin *a, int fd) {
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], body[MAXBUF];
+    rio_t rio;
+
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+            sscanf(buf, "%s %s", method, uri) != 2) {
+        reply(fd, "400 Bad Request", "bad request line\n");
+        return;
+    }
+    do {
+        if (rio_readlineb(&rio, buf, MAXLINE) <= 0)
+            return;
+    } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+
+    if (strcasecmp(method, "GET")) {
+        reply(fd, "501 Not Implemented", "only GET\n");
+        return;
+    }
+    if (!strncmp(uri, "/set?", 5)) {
+        if (apply(a, uri + 5, body) < 0) {
+            reply(fd, "400 Bad Request", body);
+            return;
+        }
+    }
+    else if (strcmp(uri, "/")) {
+        reply(fd, "404 Not Found", "GET / or /set?name=value&...\n");
+        return;
+    }
+    list(a, body);
+    reply(fd, "200 OK", body);
+}
+
+/* same_user - whether the peer on fd runs as tiny's user, or as root */
+static int same_user(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == getuid() || cred.uid == 0;
+}
+
+static void *admin_thread(void *arg) {
+    struct admin *a = arg;
+    struct timeval tv = { ADMIN_TIMEOUT, 0 };
+    int fd;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        if ((fd = accept(a->listenfd, NULL, NULL)) < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "admin accept error: %s\n", strerror(errno));
+            continue;
+        }
+        /* One client at a time, so a silent one must not hold the rest */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (same_user(fd))
+            serve(a, fd);
+        else
+            reply(fd, "403 Forbidden", "not tiny's user\n");
+        Close(fd);
+    }
+    return NULL;
+}
+
+void admin_serve(char *path, struct admin_setting *settings, int n) {
+    struct admin *a = Malloc(sizeof(struct admin));
+    pthread_t tid;
+
+    a->listenfd = Open_unix_listenfd(path);
+    /* Anyone who got in before the chmod still meets same_user */
+    if (chmod(path, S_IRUSR | S_IWUSR) < 0)
+        unix_error("chmod error");
+    a->settings = settings;
+    a->n = n;
+    Pthread_create(&tid, NULL, admin_thread, a);
+}
@@ -0,0 +1,31 @@
+/*
+ * admin.h - a local-only control socket for tuning a running tiny (-M)
+ *
+ * A tiny started with -M path answers plain HTTP/1.0 on an AF_UNIX
+ * socket at path, so nothing on the network can reach it; the socket
+ * file is private to tiny's user, and a peer running as anyone else but
+ * root is refused with a 403. GET / lists every setting, one "name value"
+ * line each; GET /set?name=value&... changes settings in order and then
+ * lists them all, e.g.
+ *
+ *     curl --unix-socket /tmp/tiny.admin 'http://tiny/set?cache_size=65536'
+ *
+ * Each setting's setter applies the new value to the live structures
+ * itself. A value it refuses, or an unknown name, stops the query with
+ * a 400; the settings before it in the query stay changed.
+ */
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "csapp.h"
+
+struct admin_setting {
+    char *name;
+    int (*get)(void);
+    int (*set)(int value);  /* -1 if value is refused */
+};
+
+/* Serves the n settings at path on a thread of its own */
+void admin_serve(char *path, struct admin_setting *settings, int n);
+
+#endif /* __ADMIN_H__ */
@@ -0,0 +1,79 @@
+/*
+ * admit.c - admission control for an executor, with CoDel-style shedding
+ */
+#include "admit.h"
+#include "timer.h"
+
+#define INTERVAL_FACTOR 10  /* interval_ms = INTERVAL_FACTOR * target_ms */
+
+void admit_init(struct admit *a, int max_queued, int target_ms, int shared) {
+    memset(a, 0, sizeof(struct admit));
+    a->max_queued = max_queued;
+    a->target_ms = target_ms;
+    a->interval_ms = INTERVAL_FACTOR * target_ms;
+    a->shared = shared;
+    pthread_mutex_init(&a->lock, NULL);
+}
+
+void admit_configure(struct admit *a, int max_queued, int target_ms) {
+    if (a->shared)
+        pthread_mutex_lock(&a->lock);
+    a->max_queued = max_queued;
+    a->target_ms = target_ms;
+    a->interval_ms = INTERVAL_FACTOR * target_ms;
+    if (a->shared)
+        pthread_mutex_unlock(&a->lock);
+}
+
+int admit_join(struct admit *a) {
+    int rc = 0;
+
+    if (a->shared)
+        pthread_mutex_lock(&a->lock);
+    if (a->max_queued > 0 && a->queued >= a->max_queued)
+        rc = -1;
+    else
+        a->queued++;
+    if (a->shared)
+        pthread_mutex_unlock(&a->lock);
+    return rc;
+}
+
+/*
+ * admit_start - track the minimum sojourn of each interval; a request
+ *     waiting longer than the current timeout is shed. The timeout is
+ *     the whole interval normally and target_ms while overloaded.
+ */
+int admit_start(struct admit *a, long queued) {
+    long now, sojourn;
+    int rc = 0;
+
+    if (a->target_ms <= 0)
+        return 0;
+    now = clock_ms();
+    sojourn = now - queued;
+    if (a->shared)
+        pthread_mutex_lock(&a->lock);
+    if (now >= a->interval_end) {
+        /* A queue that saw no requests for a whole interval has drained */
+        a->overloaded = now < a->interval_end + a->interval_ms &&
+            a->min_sojourn > a->target_ms;
+        a->min_sojourn = sojourn;
+        a->interval_end = now + a->interval_ms;
+    }
+    else if (sojourn < a->min_sojourn)
+        a->min_sojourn = sojourn;
+    if (sojourn > (a->overloaded ? a->target_ms : a->interval_ms))
+        rc = -1;
+    if (a->shared)
+        pthread_mutex_unlock(&a->lock);
+    return rc;
+}
+
+void admit_leave(struct admit *a) {
+    if (a->shared)
+        pthread_mutex_lock(&a->lock);
+    a->queued--;
+    if (a->shared)
+        pthread_mutex_unlock(&a->lock);
+}
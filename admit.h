@@ -0,0 +1,60 @@
+/*
+ * admit.h - admission control for an executor, with CoDel-style shedding
+ *
+ * Requests that need an executor (for tiny, a function cache shard and
+ * the dynamic functions it runs) join its admission queue, wait their
+ * turn and then start.
+ * Two checks keep the queue from turning a burst into a latency spike
+ * for everyone in it:
+ *
+ *  - The queue is bounded: past max_queued waiting or running requests,
+ *    a new one is refused at once.
+ *  - When a request starts, its sojourn time (since it joined) is
+ *    compared against a timeout. As in CoDel, a queue is only judged
+ *    overloaded if even its shortest sojourn over an interval exceeded
+ *    target_ms; a standing queue then drops the timeout from the whole
+ *    interval to target_ms, shedding stale requests until it drains,
+ *    while a short burst that clears within an interval is left alone.
+ *
+ * A refused or shed request should get a cheap error (503) and never
+ * reach the executor.
+ */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include "csapp.h"
+
+struct admit {
+    int max_queued;         /* bound on waiting plus running; 0 = none */
+    int target_ms;          /* acceptable standing delay; 0 = no shedding */
+    int interval_ms;        /* window over which the minimum is taken */
+    int queued;             /* joined and not yet left */
+    int overloaded;         /* the last interval's minimum exceeded target */
+    long min_sojourn;       /* shortest sojourn so far this interval */
+    long interval_end;      /* ms clock value at which the interval ends */
+    int shared;             /* used by several threads: take the lock */
+    pthread_mutex_t lock;
+};
+
+void admit_init(struct admit *a, int max_queued, int target_ms, int shared);
+
+/*
+ * Changes the bound and target of a queue in use. An unshared queue's
+ * own thread picks the new values up on its next call.
+ */
+void admit_configure(struct admit *a, int max_queued, int target_ms);
+
+/* Takes a place in the queue; -1 if it is full */
+int admit_join(struct admit *a);
+
+/*
+ * Called at the head of the queue, as the request is about to run.
+ * Returns -1 if the request, which joined at ms clock value queued,
+ * should be shed instead; it still has to admit_leave.
+ */
+int admit_start(struct admit *a, long queued);
+
+/* Gives up the place taken by admit_join */
+void admit_leave(struct admit *a);
+
+#endif /* __ADMIT_H__ */
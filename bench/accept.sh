@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# accept.sh - connections/sec through tiny as the number of SO_REUSEPORT
+#     acceptors grows. Every request is a fresh connection, so the accept
+#     path is on the critical path. Run from the top of the tree after make.
+#
+#     usage: bench/accept.sh [acceptor counts...]   (default: 1 2 4 8)
+#
+PORT=${PORT:-15213}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-64}
+WORKERS=${WORKERS:-32}
+URI=${URI:-/home.html}
+
+[ $# -gt 0 ] || set -- 1 2 4 8
+
+echo "acceptors: $*  clients: $CLIENTS  workers: $WORKERS  uri: $URI"
+for n in "$@"; do
+    ./tiny -a $n -w $WORKERS $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%3d acceptors  " $n
+    ./loadgen -t $CLIENTS -d $SECS localhost $PORT $URI
+    kill $pid
+    wait $pid 2> /dev/null
+done
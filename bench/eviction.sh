@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# eviction.sh - hit rates of the function cache's eviction policies on
+#     a mix of a few hot functions and periodic scans across every lib/
+#     function, the pattern that makes LRU thrash. The trace (or TRACE,
+#     one function name per line) is first replayed through each policy
+#     by cachebench, then sent to tiny itself (the default thread mode,
+#     with room for CAPACITY functions) over one keep-alive connection
+#     per policy, and tiny's SIGUSR1 report gives the hit rate it saw. Run
+#     from the top of the tree after make; the live part needs curl.
+#
+#     usage: bench/eviction.sh [policies...]   (default: all)
+#
+PORT=${PORT:-15213}
+CAPACITY=${CAPACITY:-8}         # functions the cache can hold
+ROUNDS=${ROUNDS:-40}
+HOT=${HOT:-60}                  # hot requests per round, before a scan
+
+[ $# -gt 0 ] || set -- lru clock lfu arc 2q
+
+dir=$(mktemp -d)
+trace=${TRACE:-$dir/trace}
+if [ -z "$TRACE" ]; then
+    # adder1-3 are hot; each round ends with a scan of adder, adder1-20
+    awk -v rounds=$ROUNDS -v hot=$HOT 'BEGIN {
+        srand(1)
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < hot; i++)
+                print "adder" int(1 + rand() * 3)
+            print "adder"
+            for (i = 1; i <= 20; i++)
+                print "adder" i
+        }
+    }' > $trace
+fi
+
+./cachebench -r $trace -c $CAPACITY
+
+# tiny evicts while a shard holds more bytes than its capacity, so room
+# for CAPACITY - 1 of the largest library holds CAPACITY functions
+size=$(wc -c lib/*.so | sort -n | tail -2 | head -1 | awk '{print $1}')
+echo "tiny: room for $CAPACITY functions of up to $size bytes"
+for policy in "$@"; do
+    ./tiny -q -E $policy -M $dir/admin $PORT > $dir/log 2>&1 &
+    pid=$!
+    sleep 0.5
+    curl -s --unix-socket $dir/admin \
+        "http://localhost/set?cache_size=$(( (CAPACITY - 1) * size ))" \
+        > /dev/null
+    sed "s|.*|http://localhost:$PORT/cgi-bin/&?1\&2|" $trace |
+        xargs curl -s > /dev/null
+    kill -USR1 $pid
+    sleep 0.2
+    kill $pid
+    wait $pid 2> /dev/null
+    grep "^cache:" $dir/log
+done
+rm -rf $dir
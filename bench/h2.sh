@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# h2.sh - fetch a page, home.html and godzilla.gif, PAGES times from
+#     tiny: over HTTP/1.0 with a connection per request, then as h2c
+#     streams multiplexed on one connection. Prints the connections
+#     opened, the header bytes sent each way and the time taken. Needs
+#     curl and nghttp (from nghttp2). Run from the top of the tree after
+#     make.
+#
+#     usage: bench/h2.sh [modes...]   (default: thread epoll)
+#
+PORT=${PORT:-15213}
+PAGES=${PAGES:-200}
+PAGE="http://localhost:$PORT/home.html http://localhost:$PORT/godzilla.gif"
+
+[ $# -gt 0 ] || set -- thread epoll
+
+now() {
+    date +%s.%N
+}
+
+echo "pages: $PAGES  (home.html + godzilla.gif)"
+for mode in "$@"; do
+    ./tiny -q -m $mode $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    urls=
+    for i in $(seq $PAGES); do
+        for url in $PAGE; do
+            urls="$urls -o /dev/null $url"
+        done
+    done
+    start=$(now)
+    out=$(curl -s --http1.0 \
+        -w "%{num_connects} %{size_request} %{size_header}\n" $urls)
+    end=$(now)
+    echo "$out" | awk -v start=$start -v end=$end \
+            -v mode=$mode '
+        { conns += $1; req += $2; resp += $3 }
+        END { printf "%-7s http/1.0  %4d conns  %6d req hdr bytes  " \
+                "%6d resp hdr bytes  %.2f s\n", mode, conns, req, resp,
+                end - start }'
+
+    start=$(now)
+    out=$(nghttp -nv -m $PAGES $PAGE)
+    end=$(now)
+    echo "$out" | awk -v start=$start -v end=$end \
+            -v mode=$mode '
+        /HEADERS frame </ {
+            match($0, /length=[0-9]+/)
+            n = substr($0, RSTART + 7, RLENGTH - 7) + 9
+            if ($3 == "send") req += n; else resp += n
+        }
+        END { printf "%-7s h2c       %4d conns  %6d req hdr bytes  " \
+                "%6d resp hdr bytes  %.2f s\n", mode, 1, req, resp,
+                end - start }'
+
+    kill $pid
+    wait $pid 2> /dev/null
+done
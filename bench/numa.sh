@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# numa.sh - throughput and latency of tiny with its threads unpinned,
+#     pinned to one node, and split so that the acceptor allocates every
+#     connection on one node and the workers serve it from another. The
+#     keep-alive clients ask for a cached dynamic function, which touches
+#     the connection buffers, the capture buffer and the function cache.
+#     On a single-node host only the first two rows run. Run from the top
+#     of the tree after make. Bulkheads are off so that every client
+#     request runs.
+#
+#     usage: bench/numa.sh ["tiny options"...]
+#
+PORT=${PORT:-15213}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-32}
+URI=${URI:-/cgi-bin/adder?1&20}
+
+NODE0=$(cat /sys/devices/system/node/node0/cpulist 2> /dev/null)
+NODE1=$(cat /sys/devices/system/node/node1/cpulist 2> /dev/null)
+if [ $# -eq 0 ]; then
+    if [ -z "$NODE0" ]; then
+        set -- ""
+    elif [ -z "$NODE1" ]; then
+        set -- "" "-c $NODE0 -A $NODE0"
+    else
+        set -- "" "-c $NODE0 -A $NODE0" "-c $NODE1 -A $NODE0"
+    fi
+fi
+
+set -f      # keep the "*" of -F literal
+echo "clients: $CLIENTS  uri: $URI"
+for opts in "$@"; do
+    ./tiny -q -F "*=0" $opts $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%-24s " "${opts:-unpinned}"
+    ./loadgen -k -t $CLIENTS -d $SECS localhost $PORT "$URI"
+    kill $pid
+    wait $pid 2> /dev/null
+done
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# scaling.sh - dynamic request throughput as tiny gets more cores. Every
+#     request runs a function that computes a Fibonacci number, so the
+#     CPU spent in functions dominates. tiny is confined to the first N
+#     CPUs with N function workers (or, with MODE=core, N cores), so
+#     throughput should grow with N until the CPUs run out. Run from the
+#     top of the tree after make.
+#
+#     usage: bench/scaling.sh [core counts...]   (default: 1 2 4 ... CPUs)
+#
+PORT=${PORT:-15213}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-64}
+URI=${URI:-/cgi-bin/adder?1&27}
+MODE=${MODE:-thread}
+set -f      # opts holds a literal "*"
+NCPU=$(getconf _NPROCESSORS_ONLN)
+
+if [ $# -eq 0 ]; then
+    n=1
+    while [ $n -lt $NCPU ]; do
+        set -- "$@" $n
+        n=$((n * 2))
+    done
+    set -- "$@" $NCPU
+fi
+
+echo "mode: $MODE  clients: $CLIENTS  uri: $URI  cpus: $NCPU"
+for n in "$@"; do
+    if [ "$MODE" = core ]; then
+        opts="-m core -n $n -c 0-$((n - 1)) -Q 0 -D 0"
+    else
+        opts="-W $n -Q 0 -D 0 -F *=0"
+    fi
+    taskset -c 0-$((n - 1)) ./tiny -q $opts $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%3d cores  " $n
+    ./loadgen -t $CLIENTS -d $SECS localhost $PORT "$URI"
+    kill $pid
+    wait $pid 2> /dev/null
+done
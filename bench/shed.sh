@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# shed.sh - a burst of slow dynamic requests against tiny, with admission
+#     control off and on. Every client asks for a function that computes
+#     a Fibonacci number, so the function workers are the bottleneck;
+#     loadgen reports the goodput and the latency of the requests that
+#     were not shed.
+#     Run from the top of the tree after make.
+#
+#     usage: bench/shed.sh ["tiny options"...]   (default: "-Q 0 -D 0" "")
+#
+PORT=${PORT:-15213}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-100}
+URI=${URI:-/cgi-bin/adder?1&33}
+
+[ $# -gt 0 ] || set -- "-Q 0 -D 0" ""
+
+echo "clients: $CLIENTS  uri: $URI"
+for opts in "$@"; do
+    ./tiny -q $opts $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%-16s " "${opts:-defaults}"
+    ./loadgen -t $CLIENTS -d $SECS localhost $PORT "$URI"
+    kill $pid
+    wait $pid 2> /dev/null
+done
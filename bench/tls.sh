@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# tls.sh - tiny over plain TCP and over TLS, in each serving mode given:
+#     new connections with a full handshake each, new connections that
+#     resume the previous session, and keep-alive transfers of a large
+#     file, where kernel TLS (if the kernel has it) keeps sendfile. A
+#     throwaway self-signed certificate is made with openssl first. Run
+#     from the top of the tree after make.
+#
+#     usage: bench/tls.sh [modes...]   (default: thread epoll)
+#
+PORT=${PORT:-15213}
+TLSPORT=${TLSPORT:-15214}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-8}
+URI=${URI:-/home.html}
+BIG=${BIG:-1024}                # KB in the keep-alive file
+
+[ $# -gt 0 ] || set -- thread epoll
+
+dir=$(mktemp -d)
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+    -days 1 -subj /CN=localhost -keyout $dir/key.pem -out $dir/cert.pem \
+    > /dev/null 2>&1 || { echo "openssl req failed"; exit 1; }
+head -c ${BIG}K /dev/urandom > tls-bench.bin
+
+# run label loadgen-args... - one loadgen run on one line
+run() {
+    printf "%-7s %-14s" $mode "$1"
+    shift
+    ./loadgen -t $CLIENTS -d $SECS "$@" | paste -sd' '
+}
+
+echo "clients: $CLIENTS  uri: $URI  keep-alive file: ${BIG}KB"
+for mode in "$@"; do
+    ./tiny -q -m $mode -s $TLSPORT -C $dir/cert.pem -K $dir/key.pem $PORT \
+        > $dir/log 2>&1 &
+    pid=$!
+    sleep 0.5
+    run plain localhost $PORT "$URI"
+    run tls-full -s localhost $TLSPORT "$URI"
+    run tls-resumed -s -R localhost $TLSPORT "$URI"
+    run plain-ka -k localhost $PORT /tls-bench.bin
+    run tls-ka -k -s localhost $TLSPORT /tls-bench.bin
+    kill $pid
+    wait $pid 2> /dev/null
+    grep "^tls:" $dir/log
+done
+rm -rf $dir tls-bench.bin
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# unix.sh - the same keep-alive load against tiny over TCP and over its
+#     AF_UNIX listener, in each serving mode given. Run from the top of
+#     the tree after make.
+#
+#     usage: bench/unix.sh [modes...]   (default: thread epoll coro core)
+#
+PORT=${PORT:-15213}
+SOCK=${SOCK:-/tmp/tiny-bench.sock}
+SECS=${SECS:-5}
+CLIENTS=${CLIENTS:-8}
+URI=${URI:-/home.html}
+
+[ $# -gt 0 ] || set -- thread epoll coro core
+
+echo "clients: $CLIENTS  uri: $URI"
+for mode in "$@"; do
+    ./tiny -q -m $mode -u $SOCK $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    printf "%-7s tcp   " $mode
+    ./loadgen -k -t $CLIENTS -d $SECS localhost $PORT "$URI"
+    printf "%-7s unix  " $mode
+    ./loadgen -k -u $SOCK -t $CLIENTS -d $SECS localhost $PORT "$URI"
+    kill $pid
+    wait $pid 2> /dev/null
+done
+rm -f $SOCK
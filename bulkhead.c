@@ -0,0 +1,174 @@
+/*
+ * bulkhead.c - per-function concurrency limits for dynamic requests
+ */
+#include "bulkhead.h"
+
+#define MAX_SPECS 64
+#define TABLE_SLOTS 64
+
+struct spec {
+    char name[MAXLINE];
+    int limit;
+    int max_waiting;
+};
+
+struct bulkhead {
+    char *name;
+    int limit;
+    int max_waiting;
+    int running;
+    void **waiting;         /* ring of parked calls */
+    int head;               /* oldest parked call */
+    int nwaiting;
+    int shared;
+    pthread_mutex_t lock;
+    struct bulkhead *next;  /* hash chain */
+};
+
+struct bulkheads {
+    struct bulkhead *slots[TABLE_SLOTS];
+    int shared;
+    pthread_rwlock_t lock;  /* guards the chains, not the bulkheads */
+};
+
+/* Set up by the main thread before serving, then only read */
+static struct spec specs[MAX_SPECS];
+static int nspecs;
+static struct spec fallback;
+
+int bulkhead_configure(const char *spec) {
+    struct spec *s;
+    const char *eq = strchr(spec, '=');
+
+    if (eq == NULL || eq == spec || eq - spec >= MAXLINE || nspecs == MAX_SPECS)
+        return -1;
+    s = &specs[nspecs];
+    memcpy(s->name, spec, eq - spec);
+    s->name[eq - spec] = '\0';
+    s->max_waiting = 0;
+    if (sscanf(eq + 1, "%d:%d", &s->limit, &s->max_waiting) < 1 ||
+            s->limit < 0 || s->max_waiting < 0)
+        return -1;
+    nspecs++;
+    return 0;
+}
+
+void bulkhead_default(int limit, int max_waiting) {
+    fallback.limit = limit;
+    fallback.max_waiting = max_waiting;
+}
+
+/* lookup_spec - the limits for name: its own spec, else "*", else fallback */
+static struct spec *lookup_spec(const char *name) {
+    struct spec *star = &fallback;
+    int i;
+
+    /* Later specs override earlier ones */
+    for (i = nspecs - 1; i >= 0; i--) {
+        if (!strcmp(specs[i].name, name))
+            return &specs[i];
+        if (star == &fallback && !strcmp(specs[i].name, "*"))
+            star = &specs[i];
+    }
+    return star;
+}
+
+static unsigned hash(const char *name) {
+    unsigned h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % TABLE_SLOTS;
+}
+
+struct bulkheads *bulkheads_create(int shared) {
+    struct bulkheads *t = Calloc(1, sizeof(struct bulkheads));
+
+    t->shared = shared;
+    pthread_rwlock_init(&t->lock, NULL);
+    return t;
+}
+
+static struct bulkhead *chain_find(struct bulkheads *t, const char *name) {
+    struct bulkhead *b;
+
+    for (b = t->slots[hash(name)]; b != NULL; b = b->next)
+        if (!strcmp(b->name, name))
+            return b;
+    return NULL;
+}
+
+struct bulkhead *bulkhead_find(struct bulkheads *t, const char *name) {
+    struct bulkhead *b;
+
+    if (t->shared)
+        pthread_rwlock_rdlock(&t->lock);
+    b = chain_find(t, name);
+    if (t->shared)
+        pthread_rwlock_unlock(&t->lock);
+    return b;
+}
+
+/* bulkhead_add - bulkheads live as long as the table, like their names */
+struct bulkhead *bulkhead_add(struct bulkheads *t, const char *name) {
+    struct bulkhead *b;
+    struct spec *s;
+    unsigned slot = hash(name);
+
+    if (t->shared)
+        pthread_rwlock_wrlock(&t->lock);
+    if ((b = chain_find(t, name)) == NULL) {
+        s = lookup_spec(name);
+        b = Calloc(1, sizeof(struct bulkhead));
+        b->name = strdup(name);
+        b->limit = s->limit;
+        b->max_waiting = s->max_waiting;
+        if (b->max_waiting > 0)
+            b->waiting = Malloc(b->max_waiting * sizeof(void *));
+        b->shared = t->shared;
+        pthread_mutex_init(&b->lock, NULL);
+        b->next = t->slots[slot];
+        t->slots[slot] = b;
+    }
+    if (t->shared)
+        pthread_rwlock_unlock(&t->lock);
+    return b;
+}
+
+int bulkhead_enter(struct bulkhead *b, void *call) {
+    int rc;
+
+    if (b->shared)
+        pthread_mutex_lock(&b->lock);
+    if (b->limit == 0 || b->running < b->limit) {
+        b->running++;
+        rc = BULKHEAD_RUN;
+    }
+    else if (call != NULL && b->nwaiting < b->max_waiting) {
+        b->waiting[(b->head + b->nwaiting++) % b->max_waiting] = call;
+        rc = BULKHEAD_WAIT;
+    }
+    else
+        rc = BULKHEAD_FULL;
+    if (b->shared)
+        pthread_mutex_unlock(&b->lock);
+    return rc;
+}
+
+void *bulkhead_leave(struct bulkhead *b) {
+    void *call = NULL;
+
+    if (b->shared)
+        pthread_mutex_lock(&b->lock);
+    if (b->nwaiting > 0) {
+        /* The slot passes straight to the oldest parked call */
+        call = b->waiting[b->head];
+        b->head = (b->head + 1) % b->max_waiting;
+        b->nwaiting--;
+    }
+    else
+        b->running--;
+    if (b->shared)
+        pthread_mutex_unlock(&b->lock);
+    return call;
+}
@@ -0,0 +1,54 @@
+/*
+ * bulkhead.h - per-function concurrency limits for dynamic requests
+ *
+ * Each function gets a bulkhead: at most limit calls of it are in flight
+ * at once and at most max_waiting more wait for a slot. Past that, calls
+ * are refused at once, so a slow or hot function holds at most limit
+ * workers and cannot crowd out the other functions. Waiting calls are
+ * parked on the bulkhead, not on a thread: the call that gives up a slot
+ * gets back the oldest waiting call and must run it next.
+ *
+ * Limits come from bulkhead_configure, per function name or, with the
+ * name "*", for every function not named; a limit of 0 means unlimited.
+ * A table holds the bulkheads of one executor; like the function cache,
+ * a table used by one thread only takes no locks.
+ */
+#ifndef __BULKHEAD_H__
+#define __BULKHEAD_H__
+
+#include "csapp.h"
+
+#define BULKHEAD_RUN 0      /* the call has a slot */
+#define BULKHEAD_WAIT 1     /* the call is parked until a slot frees up */
+#define BULKHEAD_FULL -1    /* refused */
+
+struct bulkhead;
+struct bulkheads;
+
+/* Parses "name=limit[:queue]"; -1 if malformed. Call before serving. */
+int bulkhead_configure(const char *spec);
+
+/* Limits for functions that no "*" or named spec covers */
+void bulkhead_default(int limit, int max_waiting);
+
+struct bulkheads *bulkheads_create(int shared);
+
+/* The bulkhead of function name, or NULL if it has none yet */
+struct bulkhead *bulkhead_find(struct bulkheads *t, const char *name);
+
+/* The bulkhead of function name, created with its configured limits */
+struct bulkhead *bulkhead_add(struct bulkheads *t, const char *name);
+
+/*
+ * Asks for a slot for call. A NULL call cannot be parked: it gets a slot
+ * or is refused.
+ */
+int bulkhead_enter(struct bulkhead *b, void *call);
+
+/*
+ * Gives up a slot. Returns the waiting call that now holds it, which
+ * the caller must run, or NULL.
+ */
+void *bulkhead_leave(struct bulkhead *b);
+
+#endif /* __BULKHEAD_H__ */
@@ -0,0 +1,364 @@
+/*
+ * cachebench.c - lookups/sec in a function cache shard as threads grow
+ *
+ * Runs the same lookup loop against two shard indexes: the one tiny used
+ * before fcache, a hash-chained LRU list under a rwlock whose hits take
+ * the read lock and then the write lock to move the entry to the back,
+ * and fcache, whose hits take no lock inside an epoch section. Each
+ * thread looks up names of n cached entries at random for the duration;
+ * with -m M one lookup in M instead replaces the least recently used
+ * entry, as a miss would, under fcache's eviction policy -p. For each
+ * thread count it prints one line:
+ *
+ *     <threads> threads  rwlock <lookups/s>  fcache <lookups/s>
+ *
+ * With -r file it instead replays a trace, one function name per line,
+ * through a shard of -c entries under each eviction policy in turn, and
+ * prints each policy's hits, misses and hit rate, so policies can be
+ * compared on recorded traffic.
+ *
+ *     usage: cachebench [-d seconds] [-n entries] [-m M] [-p policy]
+ *                       [threads...]
+ *            cachebench -r trace [-c entries]
+ */
+#include "csapp.h"
+#include "fcache.h"
+#include "timer.h"
+
+#define MAX_THREADS 256
+
+struct bench_ops {
+    void (*hit)(char *name);
+    void (*replace)(void);
+};
+
+struct worker {
+    pthread_t tid;
+    struct bench_ops *ops;
+    unsigned seed;
+    long lookups;
+} __attribute__((aligned(64)));
+
+static char **names;
+static int nentries = 20;
+static int miss_every;  /* one replacement per miss_every lookups; 0 for none */
+static volatile int stop;
+static volatile long sink;
+
+static void function(int fd, char *cgiargs) {
+    (void)fd;
+    (void)cgiargs;
+}
+
+/******* The rwlock list, as tiny had it ******/
+
+struct entry {
+    char *name;
+    unsigned hash;
+    struct entry *next, *prev, *chain;
+};
+
+static struct entry front, *back = &front;
+static struct entry **buckets;
+static int nbuckets;
+static pthread_rwlock_t list_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned hash_name(char *name) {
+    unsigned h = 2166136261u;
+
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+static void list_add(char *name) {
+    struct entry *e = Calloc(1, sizeof(struct entry));
+
+    e->name = name;
+    e->hash = hash_name(name);
+    e->prev = back;
+    back->next = e;
+    back = e;
+    e->chain = buckets[e->hash & (nbuckets - 1)];
+    buckets[e->hash & (nbuckets - 1)] = e;
+}
+
+/* list_hit - find name and move it to the back, as search_cache did */
+static void list_hit(char *name) {
+    unsigned hash = hash_name(name);
+    struct entry *e;
+
+    pthread_rwlock_rdlock(&list_lock);
+    for (e = buckets[hash & (nbuckets - 1)]; e; e = e->chain)
+        if (e->hash == hash && !strcmp(e->name, name))
+            break;
+    pthread_rwlock_unlock(&list_lock);
+    if (e == NULL || e == back)
+        return;
+    pthread_rwlock_wrlock(&list_lock);
+    if (e != back) {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->prev = back;
+        e->next = NULL;
+        back->next = e;
+        back = e;
+    }
+    pthread_rwlock_unlock(&list_lock);
+}
+
+/*
+ * list_replace - evict the front entry and add it back at the end. The
+ *     node itself is reused: a hit that let go of the read lock may still
+ *     hold it.
+ */
+static void list_replace(void) {
+    struct entry *e, **p;
+
+    pthread_rwlock_wrlock(&list_lock);
+    e = front.next;
+    if (e != back) {
+        front.next = e->next;
+        e->next->prev = &front;
+        e->prev = back;
+        e->next = NULL;
+        back->next = e;
+        back = e;
+    }
+    for (p = &buckets[e->hash & (nbuckets - 1)]; *p != e; p = &(*p)->chain)
+        ;
+    *p = e->chain;
+    e->chain = buckets[e->hash & (nbuckets - 1)];
+    buckets[e->hash & (nbuckets - 1)] = e;
+    pthread_rwlock_unlock(&list_lock);
+}
+
+/******* fcache ******/
+
+static struct fcache fc;
+
+static void unload(struct fcache_entry *e) {
+    Free(e->name);
+    Free(e);
+}
+
+static void fc_hit(char *name) {
+    struct fcache_entry *e;
+
+    fcache_read_begin(&fc);
+    if ((e = fcache_find(&fc, name)) != NULL)
+        sink += e->size;
+    fcache_read_end(&fc);
+}
+
+static void fc_replace(void) {
+    struct fcache_entry *e;
+    char *name;
+
+    fcache_lock(&fc);
+    e = fcache_victim(&fc);
+    name = strdup(e->name);
+    fcache_remove(&fc, e);
+    fcache_insert(&fc, fcache_entry_new(name, NULL, function, 1));
+    fcache_unlock(&fc);
+    Free(name);
+}
+
+/******* Trace replay ******/
+
+static long ticks;
+
+/* tick - a replay's clock, one tick per lookup */
+static long tick(void) {
+    return ++ticks;
+}
+
+static void forget(struct fcache_entry *e) {
+    Free(e->name);
+    Free(e);
+}
+
+/* replay - run the names in trace through a shard of capacity entries */
+static void replay(char **trace, int n, int capacity,
+        struct fcache_policy *policy) {
+    struct fcache c;
+    struct fcache_entry *e;
+    long hits = 0, misses = 0;
+    int i;
+
+    fcache_init(&c, 0, policy, forget);
+    c.clock = tick;
+    for (i = 0; i < n; i++) {
+        if (fcache_find(&c, trace[i]) != NULL) {
+            hits++;
+            continue;
+        }
+        misses++;
+        while (c.count >= capacity)
+            fcache_remove(&c, fcache_victim(&c));
+        fcache_insert(&c, fcache_entry_new(trace[i], NULL, function, 1));
+    }
+    printf("%-6s %10ld hits %10ld misses %5.1f%% hits\n", policy->name,
+            hits, misses, n > 0 ? 100.0 * hits / n : 0.0);
+    while ((e = fcache_victim(&c)) != NULL)
+        fcache_remove(&c, e);
+}
+
+/* replay_all - read the trace in path and replay it under every policy */
+static void replay_all(char *path, int capacity) {
+    FILE *fp;
+    char line[MAXLINE], **trace = NULL;
+    int i, n = 0, cap = 0;
+    size_t len;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error("cannot open trace");
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if ((len = strlen(line)) > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 1024;
+            trace = Realloc(trace, cap * sizeof(char *));
+        }
+        trace[n++] = strdup(line);
+    }
+    fclose(fp);
+    printf("trace: %d lookups  capacity: %d entries\n", n, capacity);
+    for (i = 0; fcache_policies[i] != NULL; i++)
+        replay(trace, n, capacity, fcache_policies[i]);
+}
+
+static struct bench_ops list_ops = { list_hit, list_replace };
+static struct bench_ops fcache_ops = { fc_hit, fc_replace };
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    long n = 0;
+    int i;
+
+    while (!stop) {
+        i = rand_r(&w->seed) % nentries;
+        if (miss_every > 0 && rand_r(&w->seed) % miss_every == 0)
+            w->ops->replace();
+        else
+            w->ops->hit(names[i]);
+        n++;
+    }
+    w->lookups = n;
+    return NULL;
+}
+
+/* run - lookups/sec of nthreads threads against ops for secs seconds */
+static double run(struct bench_ops *ops, int nthreads, int secs) {
+    struct worker *w = NULL;
+    long start, total = 0;
+    int i;
+
+    if (posix_memalign((void **)&w, 64, nthreads * sizeof(struct worker)))
+        app_error("out of memory");
+    memset(w, 0, nthreads * sizeof(struct worker));
+    stop = 0;
+    start = clock_ms();
+    for (i = 0; i < nthreads; i++) {
+        w[i].ops = ops;
+        w[i].seed = i + 1;
+        Pthread_create(&w[i].tid, NULL, work, &w[i]);
+    }
+    sleep(secs);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(w[i].tid, NULL);
+        total += w[i].lookups;
+    }
+    Free(w);
+    return total * 1000.0 / (clock_ms() - start);
+}
+
+int main(int argc, char **argv) {
+    static int defaults[] = { 1, 2, 4, 8 };
+    int opt, secs = 2, i, n, *counts = defaults, ncounts = 4;
+    struct fcache_policy *policy = fcache_policies[0];
+    char buf[32], *trace = NULL;
+    int capacity = 8;
+
+    while ((opt = getopt(argc, argv, "d:n:m:p:r:c:")) != -1) {
+        switch (opt) {
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'n':
+            nentries = atoi(optarg);
+            break;
+        case 'm':
+            miss_every = atoi(optarg);
+            break;
+        case 'p':
+            if ((policy = fcache_policy(optarg)) == NULL) {
+                fprintf(stderr, "unknown eviction policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            trace = optarg;
+            break;
+        case 'c':
+            capacity = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d seconds] [-n entries] [-m M] "
+                    "[-p policy] [threads...]\n"
+                    "       %s -r trace [-c entries]\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (trace != NULL) {
+        if (capacity < 1) {
+            fprintf(stderr, "bad -c\n");
+            exit(1);
+        }
+        replay_all(trace, capacity);
+        exit(0);
+    }
+    if (secs < 1 || nentries < 1 || miss_every < 0) {
+        fprintf(stderr, "bad -d, -n or -m\n");
+        exit(1);
+    }
+    if (optind < argc) {
+        ncounts = argc - optind;
+        counts = Malloc(ncounts * sizeof(int));
+        for (i = 0; i < ncounts; i++)
+            if ((counts[i] = atoi(argv[optind + i])) < 1 ||
+                    counts[i] > MAX_THREADS) {
+                fprintf(stderr, "threads must be 1 to %d\n", MAX_THREADS);
+                exit(1);
+            }
+    }
+
+    /* The same names, as lib/ has them, in both indexes */
+    names = Malloc(nentries * sizeof(char *));
+    for (nbuckets = 64; nbuckets < nentries; nbuckets *= 2)
+        ;
+    buckets = Calloc(nbuckets, sizeof(struct entry *));
+    fcache_init(&fc, 1, policy, unload);
+    for (i = 0; i < nentries; i++) {
+        sprintf(buf, "adder%d", i);
+        names[i] = strdup(buf);
+        list_add(names[i]);
+        fcache_insert(&fc, fcache_entry_new(buf, NULL, function, 1));
+    }
+
+    if (miss_every > 0)
+        printf("entries: %d  replacing 1 lookup in %d under %s\n", nentries,
+                miss_every, policy->name);
+    else
+        printf("entries: %d  hits only\n", nentries);
+    for (i = 0; i < ncounts; i++) {
+        n = counts[i];
+        printf("%3d threads  rwlock %12.0f", n, run(&list_ops, n, secs));
+        fflush(stdout);
+        printf("  fcache %12.0f lookups/s\n", run(&fcache_ops, n, secs));
+    }
+    exit(0);
+}
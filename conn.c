@@ -0,0 +1,385 @@
+/*
+ * conn.c - per-connection input buffer and response output queue
+ */
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "conn.h"
+
+#define SEG_CHUNK 4096      /* minimum size of a heap segment */
+#define SMALL_FILE 65536    /* files up to this size are copied, not sent */
+#define MAX_IOV 64          /* segments handed to one writev */
+#define TLS_RECORD 16384    /* plaintext bytes in a full TLS record */
+
+/* Per-thread file that dynamic functions write their output into */
+static __thread int capture_fd = -1;
+
+long conn_active;
+
+struct conn *conn_new(int fd) {
+    struct conn *c = Calloc(1, sizeof(struct conn));
+    c->fd = fd;
+    c->arrival = clock_ms();
+    rio_readinitb(&c->rio, fd);
+    return c;
+}
+
+/*
+ * conn_start_tls - give c a TLS session if it was accepted on the TLS
+ *     port. Its handshake runs on the first read or write.
+ */
+static void conn_start_tls(struct conn *c) {
+    if ((c->tls = tls_accept(c->fd)) == NULL)
+        return;
+    c->rio.rio_readfn = tls_read;
+    c->rio.rio_ctx = c->tls;
+}
+
+/*
+ * conn_accept - a connection for a socket just accepted from a client,
+ *     with a TLS session if it came in on the TLS port
+ */
+struct conn *conn_accept(int fd) {
+    struct conn *c = conn_new(fd);
+
+    c->accepted = 1;
+    __sync_fetch_and_add(&conn_active, 1);
+    conn_start_tls(c);
+    return c;
+}
+
+static void seg_release(struct seg *s) {
+    if (s->filefd >= 0)
+        close(s->filefd);
+    Free(s->owner);
+}
+
+/*
+ * conn_free - cancel the deadline, release queued output and any h2 or
+ *     TLS session, close the socket. Connections an h2 session serves
+ *     requests into have no socket (fd -1).
+ */
+void conn_free(struct conn *c) {
+    int i;
+
+    wheel_cancel(&c->timer);
+
+    for (i = c->head; i < c->nsegs; i++)
+        seg_release(&c->segs[i]);
+    Free(c->segs);
+    if (c->h2 != NULL)
+        h2_free(c->h2);
+    if (c->tls != NULL)
+        tls_free(c->tls);
+    if (c->accepted)
+        __sync_fetch_and_sub(&conn_active, 1);
+    if (c->fd >= 0)
+        Close(c->fd);
+    Free(c);
+}
+
+static struct seg *seg_push(struct conn *c) {
+    struct seg *s;
+
+    if (c->head == c->nsegs)
+        c->head = c->nsegs = 0;
+    if (c->nsegs == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 8;
+        c->segs = Realloc(c->segs, c->cap * sizeof(struct seg));
+    }
+    s = &c->segs[c->nsegs++];
+    s->owner = s->base = NULL;
+    s->len = s->size = 0;
+    s->filefd = -1;
+    s->off = 0;
+    return s;
+}
+
+/*
+ * conn_append - queue a copy of buf. Small appends are packed into the
+ *     last heap segment so a response header costs one iovec.
+ */
+void conn_append(struct conn *c, const void *buf, size_t len) {
+    struct seg *s = NULL;
+
+    if (c->nsegs > c->head)
+        s = &c->segs[c->nsegs - 1];
+    if (s == NULL || s->filefd >= 0 ||
+            s->base + s->len + len > (char *)s->owner + s->size) {
+        s = seg_push(c);
+        s->size = len > SEG_CHUNK ? len : SEG_CHUNK;
+        s->owner = s->base = Malloc(s->size);
+    }
+    memcpy(s->base + s->len, buf, len);
+    s->len += len;
+    c->pending += len;
+}
+
+/* conn_append_file - queue len bytes of filefd; the queue closes it */
+void conn_append_file(struct conn *c, int filefd, size_t len) {
+    struct seg *s = seg_push(c);
+
+    s->filefd = filefd;
+    s->len = len;
+    c->pending += len;
+}
+
+/* read_at - read len bytes of a file segment from its offset; -1 if short */
+static int read_at(struct seg *s, char *buf, size_t len) {
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if ((n = pread(s->filefd, buf + got, len - got, s->off + got)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/*
+ * conn_load_file - turn a file segment into a heap segment holding the
+ *     rest of the file. Returns -1 on a read error or short file.
+ */
+int conn_load_file(struct seg *s) {
+    char *buf = Malloc(s->len > 0 ? s->len : 1);
+
+    if (read_at(s, buf, s->len) < 0) {
+        Free(buf);
+        return -1;
+    }
+    close(s->filefd);
+    s->filefd = -1;
+    s->owner = s->base = buf;
+    s->size = s->len;
+    return 0;
+}
+
+/* conn_consume - account for n bytes of the queue having been sent */
+void conn_consume(struct conn *c, size_t n) {
+    struct seg *s;
+
+    c->pending -= n;
+    while (c->head < c->nsegs) {
+        s = &c->segs[c->head];
+        if (n < s->len) {
+            if (s->filefd >= 0)
+                s->off += n;
+            else
+                s->base += n;
+            s->len -= n;
+            return;
+        }
+        n -= s->len;
+        seg_release(s);
+        c->head++;
+    }
+}
+
+/*
+ * write_tls - copy as much of the queue as fits one TLS record, files
+ *     included, and write it through c's session. Returns as write.
+ */
+static ssize_t write_tls(struct conn *c) {
+    char rec[TLS_RECORD];
+    struct seg *s;
+    size_t n = 0, len;
+    int i;
+
+    for (i = c->head; i < c->nsegs && n < TLS_RECORD; i++) {
+        s = &c->segs[i];
+        len = s->len < TLS_RECORD - n ? s->len : TLS_RECORD - n;
+        if (s->filefd < 0)
+            memcpy(rec + n, s->base, len);
+        else if (read_at(s, rec + n, len) < 0)
+            return -1;
+        n += len;
+    }
+    return tls_write(c->tls, rec, n);
+}
+
+/*
+ * conn_flush - write queued output
+ *     Runs of heap segments and small files go out in one sendmsg; large
+ *     files go through sendfile. A run that stops short of the end of the
+ *     queue is sent with MSG_MORE so that, say, the headers of a response
+ *     share packets with the sendfile of its body. Over TLS encrypted in
+ *     user space the queue is written a record at a time instead; with
+ *     kernel TLS the socket encrypts and nothing changes. Returns 0 once the
+ *     queue is empty, 1 if the socket would block (non-blocking sockets
+ *     only) and -1 on error.
+ */
+int conn_flush(struct conn *c) {
+    struct iovec iov[MAX_IOV];
+    struct msghdr msg;
+    struct seg *s;
+    ssize_t n;
+    off_t off;
+    int i, cnt;
+
+    while (c->pending > 0) {
+        s = &c->segs[c->head];
+        if (c->tls != NULL && !tls_kernel_send(c->tls)) {
+            if ((n = write_tls(c)) > 0) {
+                conn_consume(c, n);
+                continue;
+            }
+        }
+        else if (s->filefd >= 0 && s->len > SMALL_FILE) {
+            off = s->off;
+            n = sendfile(c->fd, s->filefd, &off, s->len);
+            if (n > 0) {
+                conn_consume(c, n);
+                continue;
+            }
+        }
+        else {
+            for (i = c->head, cnt = 0; i < c->nsegs && cnt < MAX_IOV; i++) {
+                s = &c->segs[i];
+                if (s->filefd >= 0 &&
+                        (s->len > SMALL_FILE || conn_load_file(s) < 0))
+                    break;
+                iov[cnt].iov_base = s->base;
+                iov[cnt++].iov_len = s->len;
+            }
+            if (cnt == 0)
+                return -1;  /* a small file could not be read */
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            n = sendmsg(c->fd, &msg,
+                    MSG_NOSIGNAL | (i < c->nsegs ? MSG_MORE : 0));
+            if (n > 0) {
+                conn_consume(c, n);
+                continue;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        return -1;
+    }
+    /* Drop fully sent segments, including any empty ones */
+    for (; c->head < c->nsegs; c->head++)
+        seg_release(&c->segs[c->head]);
+    c->head = c->nsegs = 0;
+    return 0;
+}
+
+/*
+ * conn_compact - move unparsed bytes to the front of the Rio buffer and
+ *     return how much free space follows them.
+ */
+size_t conn_compact(struct conn *c) {
+    rio_t *rp = &c->rio;
+
+    if (rp->rio_cnt > 0 && rp->rio_bufptr != rp->rio_buf)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    if (rp->rio_cnt < 0)
+        rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+    return RIO_BUFSIZE - rp->rio_cnt;
+}
+
+/*
+ * conn_fill - read once into the free space of the Rio buffer. Returns
+ *     the number of bytes read, 0 on EOF and -1 on error (EAGAIN
+ *     included). A full buffer reports -1 with errno set to ENOBUFS.
+ */
+ssize_t conn_fill(struct conn *c) {
+    rio_t *rp = &c->rio;
+    size_t room = conn_compact(c);
+    ssize_t n;
+
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    do {
+        n = rp->rio_readfn != NULL ?
+            rp->rio_readfn(rp->rio_ctx, rp->rio_buf + rp->rio_cnt, room) :
+            read(c->fd, rp->rio_buf + rp->rio_cnt, room);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        rp->rio_cnt += n;
+    return n;
+}
+
+/*
+ * conn_has_request - is a complete request header buffered? On an h2
+ *     connection, a complete frame.
+ */
+int conn_has_request(struct conn *c) {
+    if (c->h2 != NULL)
+        return h2_has_frame(c);
+    if (c->rio.rio_cnt <= 0)
+        return 0;
+    return memmem(c->rio.rio_bufptr, c->rio.rio_cnt, "\r\n\r\n", 4) != NULL;
+}
+
+/*
+ * conn_pending_input - how many input bytes c's TLS session has decrypted
+ *     but not handed to the Rio buffer yet. The socket has already been
+ *     read, so epoll will not report them.
+ */
+int conn_pending_input(struct conn *c) {
+    return c->tls != NULL ? tls_pending(c->tls) : 0;
+}
+
+/*
+ * conn_capture_fd - return this thread's empty capture file. Dynamic
+ *     functions write to it instead of the socket so tiny can frame their
+ *     output with a Content-length and send it on any kind of socket.
+ */
+int conn_capture_fd(void) {
+    if (capture_fd < 0 && (capture_fd = memfd_create("tiny-capture", 0)) < 0)
+        unix_error("memfd_create error");
+    return capture_fd;
+}
+
+size_t conn_capture_size(int capfd) {
+    struct stat st;
+
+    Fstat(capfd, &st);
+    return st.st_size;
+}
+
+/* conn_append_capture - queue the captured output and empty the file */
+void conn_append_capture(struct conn *c, int capfd, size_t len) {
+    struct seg *s;
+
+    if (len == 0) {
+        conn_take_capture(capfd, NULL, 0);
+        return;
+    }
+    s = seg_push(c);
+    s->owner = s->base = Malloc(len);
+    s->size = len;
+    s->len = conn_take_capture(capfd, s->base, len);
+    c->pending += s->len;
+}
+
+/* conn_take_capture - copy up to len captured bytes to buf and empty the file */
+size_t conn_take_capture(int capfd, char *buf, size_t len) {
+    ssize_t n;
+    size_t off = 0;
+
+    while (off < len) {
+        if ((n = pread(capfd, buf + off, len - off, off)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    if (ftruncate(capfd, 0) < 0)
+        unix_error("ftruncate error");
+    Lseek(capfd, 0, SEEK_SET);
+    return off;
+}
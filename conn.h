@@ -0,0 +1,93 @@
+/*
+ * conn.h - per-connection state shared by tiny's serving modes
+ *
+ * A connection owns its socket, a Rio read buffer holding request bytes
+ * that have arrived but not been parsed yet, and an output queue of
+ * response segments that have been produced but not yet written. The
+ * request handlers only ever append to the output queue; the serving mode
+ * decides when and how the queue is written (blocking in thread mode,
+ * non-blocking from the event loop, as ring submissions with io_uring).
+ *
+ * File bodies are queued as an open descriptor rather than file contents.
+ * conn_flush reads small files into memory so they can share one sendmsg
+ * with the surrounding headers and hands large ones to sendfile. Because
+ * the queue is only written when a serving mode flushes it, the responses
+ * to several pipelined requests leave in the same writes.
+ *
+ * A connection whose client opened with the HTTP/2 preface carries an h2
+ * session (see h2.h); its requests are frames rather than header blocks.
+ *
+ * One accepted on the TLS port carries a TLS session (see tls.h). Its
+ * Rio buffer reads through the session, and conn_flush writes through it
+ * unless kernel TLS encrypts on the socket itself, in which case the
+ * queue goes out by sendmsg and sendfile as usual.
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "csapp.h"
+#include "timer.h"
+#include "h2.h"
+#include "tls.h"
+
+/* One piece of a queued response */
+struct seg {
+    char *base;     /* first unsent byte (heap segments) */
+    size_t len;     /* unsent bytes left */
+    void *owner;    /* heap block to free once sent */
+    size_t size;    /* allocated size of owner */
+    int filefd;     /* file to send from, or -1 for a heap segment */
+    off_t off;      /* next file offset to send */
+};
+
+struct conn {
+    int fd;
+    rio_t rio;          /* unparsed request bytes */
+    struct seg *segs;   /* queued response segments */
+    int head;           /* first unsent segment */
+    int nsegs;          /* one past the last queued segment */
+    int cap;            /* allocated length of segs */
+    size_t pending;     /* total unsent bytes */
+    int keepalive;      /* keep the connection open after this response */
+    int closing;        /* no more requests will be read */
+    int events;         /* epoll events being watched (event loop) */
+    void *udata;        /* owned by the serving mode */
+    struct timer timer; /* the connection's current deadline */
+    int deadline;       /* which deadline the timer is armed for */
+    long arrival;       /* clock_ms() when the current request was parsed */
+    long due;           /* clock_ms() its client stops waiting at, or 0 */
+    struct h2 *h2;      /* the HTTP/2 session, or NULL for HTTP/1.x */
+    struct tls *tls;    /* the TLS session, or NULL for plain TCP */
+    int accepted;       /* counted in conn_active */
+};
+
+/* What a connection's timer is counting down */
+enum { DEADLINE_NONE, DEADLINE_HEADER, DEADLINE_BODY, DEADLINE_IDLE };
+
+/* Client connections accepted and not yet freed, for draining (-U) */
+extern long conn_active;
+
+struct conn *conn_new(int fd);
+struct conn *conn_accept(int fd);
+void conn_free(struct conn *c);
+
+/* Output queue */
+void conn_append(struct conn *c, const void *buf, size_t len);
+void conn_append_file(struct conn *c, int filefd, size_t len);
+int conn_load_file(struct seg *s);
+void conn_consume(struct conn *c, size_t n);
+int conn_flush(struct conn *c);
+
+/* Input buffer */
+size_t conn_compact(struct conn *c);
+ssize_t conn_fill(struct conn *c);
+int conn_has_request(struct conn *c);
+int conn_pending_input(struct conn *c);
+
+/* Capturing the output of a dynamic function */
+int conn_capture_fd(void);
+size_t conn_capture_size(int capfd);
+void conn_append_capture(struct conn *c, int capfd, size_t len);
+size_t conn_take_capture(int capfd, char *buf, size_t len);
+
+#endif /* __CONN_H__ */
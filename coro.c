@@ -0,0 +1,209 @@
+/*
+ * coro.c - stackful coroutines on epoll scheduler threads
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "coro.h"
+
+#define MAX_EVENTS 256
+#define STACK_SIZE (1 << 20)    /* reserved per coroutine, touched lazily */
+#define MAX_FREE_STACKS 64      /* stacks each scheduler keeps for reuse */
+
+struct sched;
+
+struct coro {
+    ucontext_t ctx;
+    struct sched *s;
+    char *stack;
+    int fd;             /* the connection, or the socket of a listener */
+    int listening;      /* stands for a listening socket, never runs */
+    int done;           /* the handler has returned */
+};
+
+struct sched {
+    int epfd;
+    coro_handler handler;
+    ucontext_t main;        /* the scheduler loop, while a coroutine runs */
+    struct coro *current;   /* the running coroutine, or NULL */
+    char *stacks[MAX_FREE_STACKS];
+    int nstacks;
+};
+
+static __thread struct sched *self;
+
+/* The schedulers and listeners of coro_run, for coro_stop_accepting */
+static struct sched *all_scheds;
+static int nscheds;
+static struct coro *all_listeners;
+static int nlisteners;
+
+/* stack_alloc - a coroutine stack with a guard page below it */
+static char *stack_alloc(struct sched *s) {
+    char *stack;
+
+    if (s->nstacks > 0)
+        return s->stacks[--s->nstacks];
+    stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        unix_error("mmap error");
+    if (mprotect(stack, getpagesize(), PROT_NONE) < 0)
+        unix_error("mprotect error");
+    return stack;
+}
+
+static void stack_free(struct sched *s, char *stack) {
+    if (s->nstacks < MAX_FREE_STACKS)
+        s->stacks[s->nstacks++] = stack;
+    else
+        munmap(stack, STACK_SIZE);
+}
+
+/* trampoline - body of every coroutine; returns to the scheduler */
+static void trampoline(void) {
+    struct coro *co = self->current;
+
+    self->handler(co->fd);
+    co->done = 1;
+}
+
+/* resume - run co until it blocks or finishes, freeing it if it did */
+static void resume(struct sched *s, struct coro *co) {
+    s->current = co;
+    if (swapcontext(&s->main, &co->ctx) < 0)
+        unix_error("swapcontext error");
+    s->current = NULL;
+    if (co->done) {
+        stack_free(s, co->stack);
+        Free(co);
+    }
+}
+
+static void spawn(struct sched *s, int fd) {
+    struct coro *co = Calloc(1, sizeof(struct coro));
+
+    co->s = s;
+    co->fd = fd;
+    co->stack = stack_alloc(s);
+    if (getcontext(&co->ctx) < 0)
+        unix_error("getcontext error");
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = STACK_SIZE;
+    co->ctx.uc_link = &s->main;
+    makecontext(&co->ctx, trampoline, 0);
+    resume(s, co);
+}
+
+/*
+ * coro_block - park the running coroutine until fd is ready. A one-shot
+ *     registration points epoll straight at the coroutine, so waiting
+ *     costs one epoll_ctl. Returns 0 once fd is ready (or shut down) and
+ *     -1 if the caller is not a coroutine.
+ */
+int coro_block(int fd, int writing) {
+    struct sched *s = self;
+    struct coro *co;
+    struct epoll_event ev;
+
+    if (s == NULL || (co = s->current) == NULL)
+        return -1;
+    ev.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = co;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+            (errno != ENOENT || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+        return -1;
+    if (swapcontext(&co->ctx, &s->main) < 0)
+        unix_error("swapcontext error");
+    return 0;
+}
+
+static void accept_all(struct sched *s, int listenfd) {
+    int fd;
+
+    while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+        spawn(s, fd);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+}
+
+static void *sched_thread(void *arg) {
+    struct sched *s = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct coro *co;
+    int i, n;
+
+    self = s;
+    while (1) {
+        n = epoll_wait(s->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            co = events[i].data.ptr;
+            if (co->listening)
+                accept_all(s, co->fd);
+            else
+                resume(s, co);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * coro_run - install coro_block as io_block and start nthreads scheduler
+ *     threads; the calling thread becomes the last one. Listening
+ *     sockets are shared out as in evloop_run, with EPOLLEXCLUSIVE.
+ */
+void coro_run(int *listenfds, int nlisten, int nthreads,
+        coro_handler handler) {
+    struct sched *scheds;
+    struct coro *listeners;
+    struct epoll_event ev;
+    pthread_t tid;
+    int i, j, flags;
+
+    io_block = coro_block;
+    listeners = Calloc(nlisten, sizeof(struct coro));
+    for (j = 0; j < nlisten; j++) {
+        if ((flags = fcntl(listenfds[j], F_GETFL, 0)) < 0 ||
+                fcntl(listenfds[j], F_SETFL, flags | O_NONBLOCK) < 0)
+            unix_error("fcntl error");
+        listeners[j].fd = listenfds[j];
+        listeners[j].listening = 1;
+    }
+    scheds = Calloc(nthreads, sizeof(struct sched));
+    for (i = 0; i < nthreads; i++) {
+        if ((scheds[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        scheds[i].handler = handler;
+        for (j = 0; j < nlisten; j++) {
+            if (j % nthreads != i && i % nlisten != j)
+                continue;
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &listeners[j];
+            if (epoll_ctl(scheds[i].epfd, EPOLL_CTL_ADD, listenfds[j], &ev) < 0)
+                unix_error("epoll_ctl error");
+        }
+    }
+    all_listeners = listeners;
+    nlisteners = nlisten;
+    all_scheds = scheds;
+    __sync_synchronize();
+    nscheds = nthreads;
+    for (i = 0; i < nthreads - 1; i++)
+        Pthread_create(&tid, NULL, sched_thread, &scheds[i]);
+    sched_thread(&scheds[nthreads - 1]);
+}
+
+void coro_stop_accepting(void) {
+    int i, j;
+
+    for (i = 0; i < nscheds; i++)
+        for (j = 0; j < nlisteners; j++)
+            epoll_ctl(all_scheds[i].epfd, EPOLL_CTL_DEL, all_listeners[j].fd,
+                    NULL);
+}
@@ -0,0 +1,43 @@
+/*
+ * coro.h - stackful coroutines on epoll scheduler threads
+ *
+ * Each scheduler thread runs an epoll loop over its share of the
+ * listening sockets and starts a coroutine, with its own small stack,
+ * for every connection it accepts. The coroutine runs an ordinary
+ * blocking-style handler on a non-blocking socket: when Rio, conn_flush
+ * or open_clientfd would block, io_block (installed by coro_run) parks
+ * the coroutine on epoll and switches back to the scheduler, which
+ * resumes it once the descriptor is ready. Handlers keep their
+ * sequential code while a thread serves thousands of connections.
+ *
+ * A coroutine never leaves the thread that started it, so thread-local
+ * state stays valid across a suspension. It must not hold a lock that
+ * another coroutine could wait on while it does socket I/O.
+ */
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "csapp.h"
+
+/* Serves one connection, then closes it */
+typedef void (*coro_handler)(int connfd);
+
+/*
+ * Runs nthreads schedulers accepting from nlisten listening sockets;
+ * never returns. Coroutines wait without a time limit: a handler that
+ * needs deadlines shuts its socket down from a watchdog (see timer.h),
+ * which wakes the coroutine blocked on it.
+ */
+void coro_run(int *listenfds, int nlisten, int nthreads,
+        coro_handler handler);
+
+/*
+ * Takes the listening sockets out of the schedulers; the coroutines
+ * already running go on.
+ */
+void coro_stop_accepting(void);
+
+/* Suspends the calling coroutine until fd is readable (or writable) */
+int coro_block(int fd, int writing);
+
+#endif /* __CORO_H__ */
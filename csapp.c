@@ -522,6 +522,16 @@ void V(sem_t *sem)
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+
+int (*io_block)(int fd, int writing) = NULL;
+
+/* would_block - wait out EAGAIN through io_block; 1 means retry */
+static int would_block(int fd, int writing)
+{
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return 0;
+    return io_block != NULL && io_block(fd, writing) == 0;
+}
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -534,8 +544,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 
     while (nleft > 0) {
         if ((nread = read(fd, bufp, nleft)) < 0) {
-            if (errno == EINTR) /* interrupted by sig handler return */
-                nread = 0;      /* and call read() again */
+            if (errno == EINTR || would_block(fd, 0))
+                nread = 0;      /* call read() again */
             else
                 return -1;      /* errno set by read() */ 
         } 
@@ -560,8 +570,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
     while (nleft > 0) {
         if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-            if (errno == EINTR)  /* interrupted by sig handler return */
-                nwritten = 0;    /* and call write() again */
+            if (errno == EINTR || would_block(fd, 1))
+                nwritten = 0;    /* call write() again */
             else
                 return -1;       /* errorno set by write() */
         }
@@ -579,7 +589,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() (or the buffer's rio_readfn, e.g. a TLS session) if the
+ *    internal buffer is empty.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
@@ -587,10 +598,11 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-                sizeof(rp->rio_buf));
+        rp->rio_cnt = rp->rio_readfn != NULL ?
+            rp->rio_readfn(rp->rio_ctx, rp->rio_buf, sizeof(rp->rio_buf)) :
+            read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
+            if (errno != EINTR && !would_block(rp->rio_fd, 0))
                 return -1;
         }
         else if (rp->rio_cnt == 0)  /* EOF */
@@ -619,6 +631,7 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_readfn = NULL;
 }
 /* $end rio_readinitb */
 
@@ -728,11 +741,13 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, int port) 
 {
-    int clientfd;
+    int clientfd, err = 0;
     struct hostent *hp;
     struct sockaddr_in serveraddr;
+    socklen_t errlen = sizeof(err);
 
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((clientfd = socket(AF_INET, SOCK_STREAM |
+                    (io_block != NULL ? SOCK_NONBLOCK : 0), 0)) < 0)
         return -1; /* check errno for cause of error */
 
     /* Fill in the server's IP address and port */
@@ -745,8 +760,17 @@ int open_clientfd(char *hostname, int port)
     serveraddr.sin_port = htons(port);
 
     /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
-        return -1;
+    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0) {
+        /* A non-blocking connect completes once the socket is writable */
+        if (errno != EINPROGRESS || io_block == NULL ||
+                io_block(clientfd, 1) < 0 ||
+                getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            return -1;
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
     return clientfd;
 }
 /* $end open_clientfd */
@@ -756,7 +780,7 @@ int open_clientfd(char *hostname, int port)
  *     Returns -1 and sets errno on Unix error.
  */
 /* $begin open_listenfd */
-int open_listenfd(int port) 
+static int open_listenfd_opts(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -770,6 +794,11 @@ int open_listenfd(int port)
                 (const void *)&optval , sizeof(int)) < 0)
         return -1;
 
+    /* Lets several sockets listen on the same port */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                (const void *)&optval , sizeof(int)) < 0)
+        return -1;
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -784,8 +813,57 @@ int open_listenfd(int port)
         return -1;
     return listenfd;
 }
+
+int open_listenfd(int port) 
+{
+    return open_listenfd_opts(port, 0);
+}
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - open a listening socket on port with
+ *     SO_REUSEPORT set. Each call returns a separate socket on the same
+ *     port, and the kernel spreads incoming connections across them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port) 
+{
+    return open_listenfd_opts(port, 1);
+}
+
+/*
+ * open_unix_listenfd - open a listening AF_UNIX stream socket bound to
+ *     path, replacing any socket file a previous run left there. Any
+ *     other file at path is left alone, and bind fails on it.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_unix_listenfd(char *path) 
+{
+    int listenfd, saved;
+    struct sockaddr_un serveraddr;
+    struct stat sbuf;
+
+    if (strlen(path) >= sizeof(serveraddr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (lstat(path, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode))
+        unlink(path);
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sun_family = AF_UNIX;
+    strcpy(serveraddr.sun_path, path);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+            listen(listenfd, LISTENQ) < 0) {
+        saved = errno;
+        close(listenfd);
+        errno = saved;
+        return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -810,6 +888,24 @@ int Open_listenfd(int port)
         unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+        unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
+int Open_unix_listenfd(char *path) 
+{
+    int rc;
+
+    if ((rc = open_unix_listenfd(path)) < 0)
+        unix_error("Open_unix_listenfd error");
+    return rc;
+}
 /* $end csapp.c */
 
 
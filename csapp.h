@@ -20,6 +20,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -43,6 +44,8 @@ typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
+    ssize_t (*rio_readfn)(void *, void *, size_t); /* read() if NULL */
+    void *rio_ctx;             /* first argument of rio_readfn */
     char rio_buf[RIO_BUFSIZE]; /* internal buffer */
 } rio_t;
 /* $end rio_t */
@@ -142,6 +145,15 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void P(sem_t *sem);
 void V(sem_t *sem);
 
+/*
+ * Set by a coroutine runtime (see coro.h). When a read or write on a
+ * non-blocking descriptor would block, Rio and open_clientfd call
+ * io_block to suspend the caller until fd is ready, then retry. It
+ * returns -1 (caller not a coroutine, or timed out) to fail the I/O.
+ * While it is set, open_clientfd creates non-blocking sockets.
+ */
+extern int (*io_block)(int fd, int writing);
+
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
@@ -159,10 +171,14 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
+int open_unix_listenfd(char *path);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
+int Open_unix_listenfd(char *path);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
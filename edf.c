@@ -0,0 +1,81 @@
+/*
+ * edf.c - earliest-deadline-first queue
+ */
+#include "edf.h"
+
+#define INITIAL_CAP 64
+
+void edf_init(struct edf *q, int max_queued) {
+    memset(q, 0, sizeof(struct edf));
+    q->max_queued = max_queued;
+    q->cap = INITIAL_CAP;
+    q->heap = Malloc(q->cap * sizeof(struct edf_entry));
+    pthread_mutex_init(&q->lock, NULL);
+}
+
+/* before - whether entry a comes out ahead of entry b */
+static int before(struct edf_entry *a, struct edf_entry *b) {
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+/* push - sift a new entry up from the bottom; called with the lock held */
+static void push(struct edf *q, long due, void *item) {
+    struct edf_entry e;
+    int i, parent;
+
+    if (q->n == q->cap) {
+        q->cap *= 2;
+        q->heap = Realloc(q->heap, q->cap * sizeof(struct edf_entry));
+    }
+    e.due = due;
+    e.seq = q->seq++;
+    e.item = item;
+    for (i = q->n++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!before(&e, &q->heap[parent]))
+            break;
+        q->heap[i] = q->heap[parent];
+    }
+    q->heap[i] = e;
+}
+
+void edf_push(struct edf *q, long due, void *item) {
+    pthread_mutex_lock(&q->lock);
+    push(q, due, item);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int edf_try_push(struct edf *q, long due, void *item) {
+    int rc = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->max_queued > 0 && q->n >= q->max_queued)
+        rc = -1;
+    else
+        push(q, due, item);
+    pthread_mutex_unlock(&q->lock);
+    return rc;
+}
+
+/* edf_pop - take the root and sift the last entry down into its place */
+void *edf_pop(struct edf *q) {
+    struct edf_entry last;
+    void *item = NULL;
+    int i, child;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->n > 0) {
+        item = q->heap[0].item;
+        last = q->heap[--q->n];
+        for (i = 0; (child = 2 * i + 1) < q->n; i = child) {
+            if (child + 1 < q->n && before(&q->heap[child + 1], &q->heap[child]))
+                child++;
+            if (!before(&q->heap[child], &last))
+                break;
+            q->heap[i] = q->heap[child];
+        }
+        q->heap[i] = last;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
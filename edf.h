@@ -0,0 +1,43 @@
+/*
+ * edf.h - earliest-deadline-first queue
+ *
+ * A binary min-heap of items keyed by their due time (any monotonic ms
+ * clock value), so the item whose deadline comes first is always taken
+ * first. Items due at the same time come out in the order they went in.
+ * The queue is shared between threads and guarded by its own lock.
+ */
+#ifndef __EDF_H__
+#define __EDF_H__
+
+#include <limits.h>
+#include "csapp.h"
+
+#define EDF_NEVER LONG_MAX  /* due time of an item without a deadline */
+
+struct edf_entry {
+    long due;
+    long seq;               /* breaks ties in arrival order */
+    void *item;
+};
+
+struct edf {
+    struct edf_entry *heap;
+    int n;
+    int cap;
+    int max_queued;         /* bound for edf_try_push; 0 = none */
+    long seq;
+    pthread_mutex_t lock;
+};
+
+void edf_init(struct edf *q, int max_queued);
+
+/* Queues item regardless of the bound */
+void edf_push(struct edf *q, long due, void *item);
+
+/* Queues item unless max_queued items are waiting; then returns -1 */
+int edf_try_push(struct edf *q, long due, void *item);
+
+/* Takes the item due first, or NULL if the queue is empty */
+void *edf_pop(struct edf *q);
+
+#endif /* __EDF_H__ */
@@ -0,0 +1,144 @@
+/*
+ * epoch.c - epoch-based reclamation for lock-free readers
+ */
+#include "epoch.h"
+
+/*
+ * A thread's slot. epoch is 0 outside a section, else the global epoch
+ * it saw on entry, shifted left once with the low bit set.
+ */
+struct slot {
+    volatile unsigned long epoch;
+    int depth;              /* nesting of sections */
+    int in_use;             /* taken by a live thread */
+    struct slot *next;
+} __attribute__((aligned(64)));
+
+struct retired {
+    void (*fn)(void *);
+    void *arg;
+    unsigned long epoch;    /* global epoch when it was unlinked */
+    struct retired *next;
+};
+
+static volatile unsigned long global_epoch = 1;
+static struct slot *slots;              /* only ever grows */
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *limbo;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static __thread struct slot *self;
+
+/* release - a thread exiting gives its slot to the next new thread */
+static void release(void *arg) {
+    struct slot *s = arg;
+
+    s->epoch = 0;
+    s->depth = 0;
+    __sync_synchronize();
+    s->in_use = 0;
+}
+
+static void make_key(void) {
+    if (pthread_key_create(&slot_key, release) != 0)
+        app_error("epoch: pthread_key_create error");
+}
+
+/* my_slot - the calling thread's slot, taken on its first section */
+static struct slot *my_slot(void) {
+    struct slot *s;
+
+    if (self != NULL)
+        return self;
+    pthread_once(&slot_once, make_key);
+    pthread_mutex_lock(&slots_lock);
+    for (s = slots; s != NULL; s = s->next)
+        if (!s->in_use)
+            break;
+    if (s == NULL) {
+        if (posix_memalign((void **)&s, 64, sizeof(struct slot)) != 0)
+            app_error("epoch: out of memory");
+        memset(s, 0, sizeof(struct slot));
+        s->next = slots;
+        slots = s;
+    }
+    s->in_use = 1;
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, s);
+    return self = s;
+}
+
+/*
+ * epoch_enter - announce the epoch before touching anything shared; the
+ *     fence orders the announcement before the reads that follow
+ */
+void epoch_enter(void) {
+    struct slot *s = my_slot();
+
+    if (s->depth++ > 0)
+        return;
+    s->epoch = (global_epoch << 1) | 1;
+    __sync_synchronize();
+}
+
+void epoch_exit(void) {
+    struct slot *s = self;
+
+    if (--s->depth > 0)
+        return;
+    __sync_synchronize();
+    s->epoch = 0;
+}
+
+/*
+ * advance - move the global epoch on if every thread in a section has
+ *     seen the current one; called with limbo_lock held
+ */
+static int advance(void) {
+    unsigned long g = global_epoch, e;
+    struct slot *s;
+
+    __sync_synchronize();
+    for (s = slots; s != NULL; s = s->next) {
+        e = s->epoch;
+        if ((e & 1) && (e >> 1) != g)
+            return 0;
+    }
+    global_epoch = g + 1;
+    return 1;
+}
+
+void epoch_retire(void (*fn)(void *), void *arg) {
+    struct retired *r = Malloc(sizeof(struct retired));
+    struct retired **p, *ready = NULL;
+    int i;
+
+    r->fn = fn;
+    r->arg = arg;
+    pthread_mutex_lock(&limbo_lock);
+    r->epoch = global_epoch;
+    r->next = limbo;
+    limbo = r;
+    /* Two steps free what was just retired if nobody is reading */
+    for (i = 0; i < 2 && advance(); i++)
+        ;
+    for (p = &limbo; *p != NULL; ) {
+        r = *p;
+        if (r->epoch + 2 <= global_epoch) {
+            *p = r->next;
+            r->next = ready;
+            ready = r;
+        }
+        else
+            p = &r->next;
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    /* fn may be slow (dlclose), so it runs outside the lock */
+    while ((r = ready) != NULL) {
+        ready = r->next;
+        r->fn(r->arg);
+        Free(r);
+    }
+}
@@ -0,0 +1,27 @@
+/*
+ * epoch.h - epoch-based reclamation for lock-free readers
+ *
+ * Readers bracket every use of shared nodes with epoch_enter and
+ * epoch_exit, which only write the calling thread's own slot: no lock,
+ * no shared counter. A writer that has unlinked a node hands it to
+ * epoch_retire instead of freeing it. The node is freed once the global
+ * epoch has moved on twice, and the epoch only moves on once every
+ * thread inside a section has seen the current one, so by then no
+ * reader can still hold a pointer to it.
+ *
+ * Writers never wait for readers: retired nodes wait on a list, which
+ * each epoch_retire tries to drain. A reader that stays inside a section
+ * for long only delays the freeing. Sections may nest.
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* Calls fn(arg) once no reader can see what arg was unlinked from */
+void epoch_retire(void (*fn)(void *), void *arg);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,343 @@
+/*
+ * evloop.c - epoll event loops for tiny
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "evloop.h"
+
+#define MAX_EVENTS 256
+
+struct evloop {
+    int epfd;
+    evloop_handler handler;
+    struct timeouts to;
+    struct wheel wheel; /* the deadlines of this loop's connections */
+    struct conn **listeners;
+    int nlisten;
+    struct evloop *next;    /* in the list of every loop */
+    int nloops;             /* loops started together (parking) */
+    int parking;            /* hand requests to the handler, not serve */
+    struct conn *wakeup;    /* eventfd written when inbox fills */
+    struct conn *inbox;     /* parked, not yet watched; linked by udata */
+    pthread_mutex_t lock;   /* guards inbox */
+};
+
+/* Every loop started, for evloop_stop_accepting */
+static struct evloop *all_loops;
+static pthread_mutex_t loops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* udata of the conns that stand for listening sockets and wakeups */
+static int listener_tag, wakeup_tag;
+
+static void set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+}
+
+/* set_blocking - switch a parked connection's socket in or out of O_NONBLOCK */
+static void set_blocking(int fd, int blocking) {
+    if (fcntl(fd, F_SETFL, blocking ? 0 : O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+}
+
+static void watch(struct evloop *loop, int op, struct conn *c, int events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, op, c->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    c->events = events;
+}
+
+static void drop(struct evloop *loop, struct conn *c) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_free(c);
+}
+
+/* expired - a connection missed its deadline */
+static void expired(struct timer *t) {
+    struct conn *c = t->arg;
+
+    drop(c->udata, c);
+}
+
+/*
+ * set_deadline - arm c's timer for the given deadline, unless it already
+ *     runs for that one: a trickle of header bytes must not push the
+ *     header deadline back. DEADLINE_NONE stops the timer.
+ */
+static void set_deadline(struct evloop *loop, struct conn *c, int which) {
+    int ms;
+
+    if (c->deadline == which)
+        return;
+    c->deadline = which;
+    if (which == DEADLINE_HEADER)
+        ms = loop->to.header_ms;
+    else if (which == DEADLINE_BODY)
+        ms = loop->to.body_ms;
+    else if (which == DEADLINE_IDLE)
+        ms = loop->to.idle_ms;
+    else
+        ms = 0;
+    wheel_arm(&loop->wheel, &c->timer, ms);
+}
+
+/* accept_all - accept every pending connection on a listening socket */
+static void accept_all(struct evloop *loop, int listenfd) {
+    struct conn *c;
+    int fd;
+
+    while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        c = conn_accept(fd);
+        c->udata = loop;
+        timer_init(&c->timer, expired, c);
+        watch(loop, EPOLL_CTL_ADD, c, EPOLLIN);
+        set_deadline(loop, c, DEADLINE_HEADER);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+}
+
+/*
+ * hand_off - a parked connection has a request: take it out of the loop
+ *     and give it, blocking again, to the handler
+ */
+static void hand_off(struct evloop *loop, struct conn *c) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    set_deadline(loop, c, DEADLINE_NONE);
+    set_blocking(c->fd, 1);
+    if (loop->handler(c) < 0)
+        conn_free(c);
+}
+
+/*
+ * serve - run the handler on every complete request in the buffer, then
+ *     push out as much of the response queue as the socket will take.
+ *     Pipelined requests thus share one flush, and a connection that
+ *     keeps reading costs no epoll_ctl. Input a TLS session decrypted
+ *     ahead is read in here, since epoll will not report it. No deadline
+ *     runs while a request is served. Then start the deadline of what the
+ *     connection waits for next: room to send the rest of the responses,
+ *     the rest of a request, or a new request.
+ */
+static void serve(struct evloop *loop, struct conn *c) {
+    int rc, events, next;
+
+    while (!c->closing) {
+        if (!conn_has_request(c)) {
+            if (conn_pending_input(c) > 0 && conn_fill(c) > 0)
+                continue;
+            break;
+        }
+        if (loop->parking) {
+            hand_off(loop, c);
+            return;
+        }
+        set_deadline(loop, c, DEADLINE_NONE);
+        if (loop->handler(c) < 0) {
+            drop(loop, c);
+            return;
+        }
+        if (!c->keepalive)
+            c->closing = 1;
+    }
+
+    if ((rc = conn_flush(c)) < 0 || (rc == 0 && c->closing)) {
+        drop(loop, c);
+        return;
+    }
+    if (rc)
+        next = DEADLINE_BODY;
+    else if (c->rio.rio_cnt > 0 || c->deadline == DEADLINE_HEADER)
+        next = DEADLINE_HEADER;
+    else
+        next = DEADLINE_IDLE;
+    set_deadline(loop, c, next);
+
+    events = rc ? EPOLLOUT : EPOLLIN;
+    if (c->events != events)
+        watch(loop, EPOLL_CTL_MOD, c, events);
+}
+
+static void on_readable(struct evloop *loop, struct conn *c) {
+    ssize_t n = conn_fill(c);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        /* EOF, error, or a request header that overflows the buffer */
+        drop(loop, c);
+        return;
+    }
+    if (n > 0 && c->deadline == DEADLINE_IDLE)
+        set_deadline(loop, c, DEADLINE_HEADER);
+    serve(loop, c);
+}
+
+/*
+ * adopt - start watching the connections parked since the last wakeup.
+ *     Each keeps the deadline it was parked with. Input a TLS session
+ *     already decrypted is served at once, as epoll will not report it.
+ */
+static void adopt(struct evloop *loop) {
+    struct conn *c, *next;
+    uint64_t n;
+    int which;
+
+    if (read(loop->wakeup->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    pthread_mutex_lock(&loop->lock);
+    c = loop->inbox;
+    loop->inbox = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    for (; c != NULL; c = next) {
+        next = c->udata;
+        c->udata = loop;
+        timer_init(&c->timer, expired, c);
+        which = c->deadline;
+        c->deadline = DEADLINE_NONE;
+        set_blocking(c->fd, 0);
+        watch(loop, EPOLL_CTL_ADD, c, EPOLLIN);
+        set_deadline(loop, c, which);
+        serve(loop, c);
+    }
+}
+
+static void *loop_thread(void *arg) {
+    struct evloop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct conn *c;
+    int i, n;
+
+    while (1) {
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS,
+                wheel_advance(&loop->wheel));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c->udata == &listener_tag)
+                accept_all(loop, c->fd);
+            else if (c->udata == &wakeup_tag)
+                adopt(loop);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                drop(loop, c);
+            else if (events[i].events & EPOLLIN)
+                on_readable(loop, c);
+            else if (events[i].events & EPOLLOUT)
+                serve(loop, c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * evloop_run - start nloops event loop threads on the listening sockets.
+ *     The calling thread becomes the last loop. EPOLLEXCLUSIVE wakes only
+ *     one of the loops sharing a socket per incoming connection so they
+ *     do not stampede on accept.
+ */
+void evloop_run(int *listenfds, int nlisten, int nloops,
+        const struct timeouts *to, evloop_handler handler) {
+    struct evloop *loops;
+    struct conn **listeners;
+    pthread_t tid;
+    int i, j;
+
+    listeners = Malloc(nlisten * sizeof(struct conn *));
+    for (j = 0; j < nlisten; j++) {
+        set_nonblocking(listenfds[j]);
+        listeners[j] = conn_new(listenfds[j]);
+        listeners[j]->udata = &listener_tag;
+    }
+    loops = Calloc(nloops, sizeof(struct evloop));
+    for (i = 0; i < nloops; i++) {
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        loops[i].handler = handler;
+        loops[i].to = *to;
+        wheel_init(&loops[i].wheel);
+        loops[i].listeners = listeners;
+        loops[i].nlisten = nlisten;
+        for (j = 0; j < nlisten; j++)
+            if (j % nloops == i || i % nlisten == j)
+                watch(&loops[i], EPOLL_CTL_ADD, listeners[j],
+                        EPOLLIN | EPOLLEXCLUSIVE);
+        pthread_mutex_lock(&loops_lock);
+        loops[i].next = all_loops;
+        all_loops = &loops[i];
+        pthread_mutex_unlock(&loops_lock);
+    }
+    for (i = 0; i < nloops - 1; i++)
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    loop_thread(&loops[nloops - 1]);
+}
+
+/*
+ * evloop_stop_accepting - the listeners are removed from the epoll sets
+ *     right away rather than by their loops: with EPOLLEXCLUSIVE a loop
+ *     that took a wakeup without accepting could leave a connection
+ *     queued that no other process watching the socket hears about.
+ */
+void evloop_stop_accepting(void) {
+    struct evloop *loop;
+    int j;
+
+    pthread_mutex_lock(&loops_lock);
+    for (loop = all_loops; loop != NULL; loop = loop->next)
+        for (j = 0; j < loop->nlisten; j++)
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listeners[j]->fd, NULL);
+    pthread_mutex_unlock(&loops_lock);
+}
+
+/*
+ * evloop_parking - start nloops parking loops, each with an eventfd that
+ *     evloop_park writes to when it adds to an empty inbox
+ */
+struct evloop *evloop_parking(int nloops, const struct timeouts *to,
+        evloop_handler ready) {
+    struct evloop *loops;
+    pthread_t tid;
+    int i, fd;
+
+    loops = Calloc(nloops, sizeof(struct evloop));
+    for (i = 0; i < nloops; i++) {
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        if ((fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("eventfd error");
+        loops[i].handler = ready;
+        loops[i].to = *to;
+        wheel_init(&loops[i].wheel);
+        loops[i].nloops = nloops;
+        loops[i].parking = 1;
+        loops[i].wakeup = conn_new(fd);
+        loops[i].wakeup->udata = &wakeup_tag;
+        pthread_mutex_init(&loops[i].lock, NULL);
+        watch(&loops[i], EPOLL_CTL_ADD, loops[i].wakeup, EPOLLIN);
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    }
+    return loops;
+}
+
+/* evloop_park - queue c on its parking loop, waking the loop if need be */
+void evloop_park(struct evloop *loops, struct conn *c) {
+    struct evloop *loop = &loops[c->fd % loops->nloops];
+    uint64_t one = 1;
+    int wake;
+
+    pthread_mutex_lock(&loop->lock);
+    wake = loop->inbox == NULL;
+    c->udata = loop->inbox;
+    loop->inbox = c;
+    pthread_mutex_unlock(&loop->lock);
+    if (wake && write(loop->wakeup->fd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
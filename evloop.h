@@ -0,0 +1,62 @@
+/*
+ * evloop.h - epoll event loops for tiny
+ *
+ * Each loop thread owns an epoll instance that watches one or more
+ * listening sockets and the non-blocking connections that thread accepted.
+ * Request bytes are read into the connection's Rio buffer as they arrive;
+ * once a complete request header is buffered the handler runs, queues its
+ * response on the connection and the loop writes it out as the socket
+ * drains. No thread ever blocks on a single client. Each loop keeps its
+ * connections' deadlines on its own timing wheel: a connection that takes
+ * longer than header_ms to deliver a request header, body_ms to take a
+ * batch of responses or idle_ms to start its next request is closed.
+ *
+ * Parking loops do the waiting for a pool of blocking workers instead:
+ * they hold connections until a request is in and then hand them over.
+ */
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include "conn.h"
+
+/*
+ * Parses and serves one buffered request, queueing the response on c.
+ * Sets c->keepalive if the connection should stay open afterwards.
+ * Returns 0 on success, -1 to drop the connection at once.
+ */
+typedef int (*evloop_handler)(struct conn *c);
+
+/*
+ * Runs nloops event loops accepting from nlisten listening sockets;
+ * never returns. Loop i watches every listener j with j % nloops == i or
+ * i % nlisten == j, so each socket has a loop and each loop a socket.
+ */
+void evloop_run(int *listenfds, int nlisten, int nloops,
+        const struct timeouts *to, evloop_handler handler);
+
+/*
+ * Takes the listening sockets out of every loop started so far; the
+ * connections already accepted are served on.
+ */
+void evloop_stop_accepting(void);
+
+/*
+ * Starts nloops loops that watch no listener, only the connections given
+ * to them with evloop_park, each until a whole request header is buffered
+ * or one of its deadlines passes. ready is then called on the loop thread
+ * with the connection out of the loop and its socket blocking again, and
+ * c belongs to the caller; ready returns -1 to have the loop free it.
+ * Thread mode parks its connections between requests here, so a client
+ * that is idle or slow to send a header holds no worker.
+ */
+struct evloop *evloop_parking(int nloops, const struct timeouts *to,
+        evloop_handler ready);
+
+/*
+ * Hands c, which has no whole request buffered, to one of the parking
+ * loops; c->deadline says whether it waits for the rest of a header or
+ * for a new request. Safe to call from any thread.
+ */
+void evloop_park(struct evloop *loops, struct conn *c);
+
+#endif /* __EVLOOP_H__ */
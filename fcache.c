@@ -0,0 +1,420 @@
+/*
+ * fcache.c - a function cache shard with lock-free lookups
+ */
+#include "fcache.h"
+#include "epoch.h"
+#include "timer.h"
+
+#define FCACHE_SLOTS 64         /* initial table size */
+#define TOMBSTONE ((struct fcache_entry *)1)
+
+/* hash_name - FNV-1a of a function name */
+static unsigned hash_name(const char *name) {
+    unsigned h = 2166136261u;
+
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+static struct fcache_table *table_new(int nslots) {
+    struct fcache_table *t = Calloc(1, sizeof(struct fcache_table) +
+            nslots * sizeof(struct fcache_entry *));
+
+    t->nslots = nslots;
+    return t;
+}
+
+void fcache_init(struct fcache *c, int shared, struct fcache_policy *policy,
+        void (*unload)(struct fcache_entry *e)) {
+    int i;
+
+    memset(c, 0, sizeof(struct fcache));
+    c->table = table_new(FCACHE_SLOTS);
+    c->list.next = c->list.prev = &c->list;
+    c->shared = shared;
+    pthread_mutex_init(&c->lock, NULL);
+    c->unload = unload;
+    c->clock = clock_ms;
+    c->policy = policy;
+    for (i = 0; i < 2; i++)
+        c->ghosts[i].list.next = c->ghosts[i].list.prev = &c->ghosts[i].list;
+}
+
+void fcache_read_begin(struct fcache *c) {
+    if (c->shared)
+        epoch_enter();
+}
+
+void fcache_read_end(struct fcache *c) {
+    if (c->shared)
+        epoch_exit();
+}
+
+/*
+ * fcache_find - probe from the name's home slot to the first empty one.
+ *     The table is never more than three quarters used, so one exists.
+ */
+struct fcache_entry *fcache_find(struct fcache *c, const char *name) {
+    struct fcache_table *t = c->table;
+    unsigned hash = hash_name(name), mask = t->nslots - 1, i;
+    struct fcache_entry *e;
+    long now;
+
+    for (i = hash & mask; (e = t->slots[i]) != NULL; i = (i + 1) & mask) {
+        if (e == TOMBSTONE || e->hash != hash || strcmp(e->name, name))
+            continue;
+        if (e->used != (now = c->clock()))
+            e->used = now;
+        if (c->policy->hit != NULL)
+            c->policy->hit(e);
+        return e;
+    }
+    return NULL;
+}
+
+void fcache_lock(struct fcache *c) {
+    if (c->shared)
+        pthread_mutex_lock(&c->lock);
+}
+
+void fcache_unlock(struct fcache *c) {
+    if (c->shared)
+        pthread_mutex_unlock(&c->lock);
+}
+
+struct fcache_entry *fcache_entry_new(const char *name, void *handle,
+        dynamic_fn function, int size) {
+    struct fcache_entry *e = Calloc(1, sizeof(struct fcache_entry));
+
+    e->name = strdup(name);
+    e->hash = hash_name(name);
+    e->handle = handle;
+    e->function = function;
+    e->size = size;
+    return e;
+}
+
+/* place - put e in the first free slot of its probe sequence in t */
+static void place(struct fcache_table *t, struct fcache_entry *e) {
+    unsigned mask = t->nslots - 1, i;
+
+    for (i = e->hash & mask; t->slots[i] != NULL && t->slots[i] != TOMBSTONE;
+            i = (i + 1) & mask)
+        ;
+    if (t->slots[i] == NULL)
+        t->nused++;
+    /* Readers must see e's fields before the pointer to it */
+    __sync_synchronize();
+    t->slots[i] = e;
+}
+
+/*
+ * rebuild - replace the table with one at most half full and without
+ *     tombstones, then retire the old one
+ */
+static void rebuild(struct fcache *c) {
+    struct fcache_table *old = c->table, *t;
+    struct fcache_entry *e;
+    int n = FCACHE_SLOTS;
+
+    while (n < 2 * (c->count + 1))
+        n *= 2;
+    t = table_new(n);
+    for (e = c->list.next; e != &c->list; e = e->next)
+        place(t, e);
+    __sync_synchronize();
+    c->table = t;
+    if (c->shared)
+        epoch_retire(free, old);
+    else
+        Free(old);
+}
+
+void fcache_insert(struct fcache *c, struct fcache_entry *e) {
+    struct fcache_table *t = c->table;
+
+    if (4 * (t->nused + 1) > 3 * t->nslots)
+        rebuild(c);
+    e->prev = c->list.prev;
+    e->next = &c->list;
+    c->list.prev->next = e;
+    c->list.prev = e;
+    c->count++;
+    c->size += e->size;
+    e->cache = c;
+    e->used = c->clock();
+    if (c->policy->insert != NULL)
+        c->policy->insert(c, e);
+    place(c->table, e);
+}
+
+struct fcache_entry *fcache_victim(struct fcache *c) {
+    return c->count > 0 ? c->policy->victim(c) : NULL;
+}
+
+/* unload - epoch_retire's view of the shard's unload callback */
+static void unload(void *arg) {
+    struct fcache_entry *e = arg;
+
+    e->cache->unload(e);
+}
+
+void fcache_remove(struct fcache *c, struct fcache_entry *e) {
+    struct fcache_table *t = c->table;
+    unsigned mask = t->nslots - 1, i;
+
+    for (i = e->hash & mask; t->slots[i] != e; i = (i + 1) & mask)
+        ;
+    t->slots[i] = TOMBSTONE;
+    if (c->policy->remove != NULL)
+        c->policy->remove(c, e);
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    c->count--;
+    c->size -= e->size;
+    if (!c->shared) {
+        c->unload(e);
+        return;
+    }
+    epoch_retire(unload, e);
+}
+
+/******* Eviction policies ******/
+
+/* lru_of - the least recently hit entry on queue (-1 for any), or NULL */
+static struct fcache_entry *lru_of(struct fcache *c, int queue) {
+    struct fcache_entry *e, *lru = NULL;
+
+    for (e = c->list.next; e != &c->list; e = e->next)
+        if ((queue < 0 || e->queue == queue) &&
+                (lru == NULL || e->used < lru->used))
+            lru = e;
+    return lru;
+}
+
+/* ghost_find - take hash out of g; returns whether it was there */
+static int ghost_find(struct fcache_ghosts *g, unsigned hash) {
+    struct fcache_ghost *h;
+
+    for (h = g->list.next; h != &g->list; h = h->next)
+        if (h->hash == hash) {
+            h->prev->next = h->next;
+            h->next->prev = h->prev;
+            g->count--;
+            Free(h);
+            return 1;
+        }
+    return 0;
+}
+
+static void ghost_add(struct fcache_ghosts *g, unsigned hash) {
+    struct fcache_ghost *h = Malloc(sizeof(struct fcache_ghost));
+
+    h->hash = hash;
+    h->prev = g->list.prev;
+    h->next = &g->list;
+    g->list.prev->next = h;
+    g->list.prev = h;
+    g->count++;
+}
+
+/* ghost_drop - forget g's oldest hash */
+static void ghost_drop(struct fcache_ghosts *g) {
+    struct fcache_ghost *h = g->list.next;
+
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
+    g->count--;
+    Free(h);
+}
+
+/* LRU: the entry with the oldest stamp */
+static struct fcache_entry *lru_victim(struct fcache *c) {
+    return lru_of(c, -1);
+}
+
+/*
+ * CLOCK: the hand sweeps the entries in load order, giving each one hit
+ * since it last passed a second chance
+ */
+static void clock_hit(struct fcache_entry *e) {
+    if (!e->referenced)
+        e->referenced = 1;
+}
+
+static struct fcache_entry *clock_victim(struct fcache *c) {
+    struct fcache_entry *e = c->hand != NULL ? c->hand : c->list.next;
+
+    while (1) {
+        if (e == &c->list)
+            e = e->next;
+        if (!e->referenced)
+            break;
+        e->referenced = 0;
+        e = e->next;
+    }
+    c->hand = e;
+    return e;
+}
+
+static void clock_remove(struct fcache *c, struct fcache_entry *e) {
+    if (c->hand == e)
+        c->hand = e->next != &c->list ? e->next : NULL;
+}
+
+/*
+ * LFU: the entry hit least since it was loaded, the older of two with
+ * as many hits
+ */
+static void lfu_hit(struct fcache_entry *e) {
+    e->hits++;
+}
+
+static struct fcache_entry *lfu_victim(struct fcache *c) {
+    struct fcache_entry *e, *lfu = NULL;
+
+    for (e = c->list.next; e != &c->list; e = e->next)
+        if (lfu == NULL || e->hits < lfu->hits ||
+                (e->hits == lfu->hits && e->used < lfu->used))
+            lfu = e;
+    return lfu;
+}
+
+/*
+ * ARC and 2Q: a hit on an entry of the first queue only sets its
+ * reference bit; promote moves such entries to the second queue when a
+ * victim is next chosen
+ */
+static void promote_hit(struct fcache_entry *e) {
+    if (e->queue == 0 && !e->referenced)
+        e->referenced = 1;
+}
+
+static void promote(struct fcache *c) {
+    struct fcache_entry *e;
+
+    for (e = c->list.next; e != &c->list; e = e->next)
+        if (e->queue == 0 && e->referenced) {
+            e->referenced = 0;
+            e->queue = 1;
+            c->queued[0]--;
+            c->queued[1]++;
+        }
+}
+
+/*
+ * 2Q: a function comes in on A1in, which is evicted first-in first-out
+ * once it holds more than a quarter of the entries, so a scan passes
+ * through A1in without touching Am. A function evicted from A1in is
+ * remembered on A1out, with room for half as many functions as are
+ * cached, and one loaded again while remembered goes to Am, which is
+ * evicted LRU. Unlike the original, which guards against correlated
+ * references to a database page, a hit in A1in also earns a place in
+ * Am: separate requests for a function are not correlated.
+ */
+enum { A1IN, AM };
+
+static void twoq_insert(struct fcache *c, struct fcache_entry *e) {
+    e->queue = ghost_find(&c->ghosts[0], e->hash) ? AM : A1IN;
+    c->queued[e->queue]++;
+}
+
+static struct fcache_entry *twoq_victim(struct fcache *c) {
+    struct fcache_entry *e;
+
+    promote(c);
+    if (4 * c->queued[A1IN] > c->count || c->queued[AM] == 0)
+        for (e = c->list.next; e != &c->list; e = e->next)
+            if (e->queue == A1IN)
+                return e;
+    return lru_of(c, AM);
+}
+
+static void twoq_remove(struct fcache *c, struct fcache_entry *e) {
+    c->queued[e->queue]--;
+    if (e->queue != A1IN)
+        return;
+    ghost_add(&c->ghosts[0], e->hash);
+    while (2 * c->ghosts[0].count > c->count + 1)
+        ghost_drop(&c->ghosts[0]);
+}
+
+/*
+ * ARC: T1 holds functions hit once, T2 those hit again, and the ghosts
+ * B1 and B2 what each recently evicted. A miss found in B1 means T1 was
+ * too short and lengthens its target; one found in B2 shortens it. A hit
+ * on T1 moves the entry to T2 only when the next victim is chosen. Sizes
+ * count entries, not bytes.
+ */
+enum { T1, T2 };
+
+static void arc_insert(struct fcache *c, struct fcache_entry *e) {
+    int b1 = c->ghosts[T1].count, b2 = c->ghosts[T2].count;
+
+    e->queue = T1;
+    if (ghost_find(&c->ghosts[T1], e->hash)) {
+        c->target += b2 > b1 ? b2 / b1 : 1;
+        if (c->target > c->count + 1)
+            c->target = c->count + 1;
+        e->queue = T2;
+    }
+    else if (ghost_find(&c->ghosts[T2], e->hash)) {
+        c->target -= b1 > b2 ? b1 / b2 : 1;
+        if (c->target < 0)
+            c->target = 0;
+        e->queue = T2;
+    }
+    c->queued[e->queue]++;
+}
+
+static struct fcache_entry *arc_victim(struct fcache *c) {
+    promote(c);
+    if (c->queued[T1] > 0 &&
+            (c->queued[T1] > c->target || c->queued[T2] == 0))
+        return lru_of(c, T1);
+    return lru_of(c, T2);
+}
+
+/* arc_remove - keep the ghosts to about as many as there are entries */
+static void arc_remove(struct fcache *c, struct fcache_entry *e) {
+    struct fcache_ghosts *b1 = &c->ghosts[T1], *b2 = &c->ghosts[T2];
+
+    c->queued[e->queue]--;
+    ghost_add(&c->ghosts[e->queue], e->hash);
+    while (b1->count + b2->count > c->count) {
+        if (b2->count == 0 || c->queued[T1] + b1->count > c->count)
+            ghost_drop(b1);
+        else
+            ghost_drop(b2);
+    }
+}
+
+static struct fcache_policy lru_policy = {
+    "lru", NULL, NULL, lru_victim, NULL
+};
+static struct fcache_policy clock_policy = {
+    "clock", clock_hit, NULL, clock_victim, clock_remove
+};
+static struct fcache_policy lfu_policy = {
+    "lfu", lfu_hit, NULL, lfu_victim, NULL
+};
+static struct fcache_policy arc_policy = {
+    "arc", promote_hit, arc_insert, arc_victim, arc_remove
+};
+static struct fcache_policy twoq_policy = {
+    "2q", promote_hit, twoq_insert, twoq_victim, twoq_remove
+};
+
+struct fcache_policy *fcache_policies[] = {
+    &lru_policy, &clock_policy, &lfu_policy, &arc_policy, &twoq_policy, NULL
+};
+
+struct fcache_policy *fcache_policy(const char *name) {
+    int i;
+
+    for (i = 0; fcache_policies[i] != NULL; i++)
+        if (!strcasecmp(fcache_policies[i]->name, name))
+            return fcache_policies[i];
+    return NULL;
+}
@@ -0,0 +1,133 @@
+/*
+ * fcache.h - a function cache shard with lock-free lookups
+ *
+ * Entries are found through an open-addressing hash table of pointers.
+ * Lookups take no lock and write nothing shared: a reader probes the
+ * table inside an epoch section (see epoch.h) and notes a hit by
+ * writing the entry's last-use stamp, and only when the millisecond has
+ * changed, so a hot entry's line is not written on every hit. The
+ * reader stays in its section while it runs the function, which keeps
+ * the entry, and its library, from being freed under it.
+ *
+ * Inserting, evicting and growing the table are serialized by the
+ * shard's lock. Removed entries leave a tombstone in the table and are
+ * unloaded through epoch_retire; a grown table replaces the old one,
+ * which is retired the same way.
+ *
+ * Which entry to evict is up to the shard's eviction policy, chosen at
+ * startup: lru, clock, lfu, arc or 2q. A hit only marks the entry for
+ * the policy (a stamp, a reference bit, a count), never a list, so hits
+ * stay lock-free under every policy. The policy acts on the marks when
+ * asked for a victim, under the shard's lock: CLOCK clears reference
+ * bits as its hand sweeps, ARC promotes entries hit since they came in,
+ * and so on. Entries stay on one list in load order and a policy's
+ * queues are tags on them, so picking a victim is a scan of the shard,
+ * which is cheap next to the dlopen of the miss that causes it. ARC and
+ * 2Q also remember the hashes of recently evicted functions (ghosts),
+ * to tell a function coming back from one seen for the first time.
+ *
+ * A shard used by one thread only (shared 0) takes no lock, enters no
+ * epoch and unloads at once.
+ */
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+struct fcache;
+struct fcache_entry;
+
+/* An eviction policy; all but hit are called under the shard's lock */
+struct fcache_policy {
+    char *name;
+    void (*hit)(struct fcache_entry *e);    /* lock-free; NULL if unused */
+    void (*insert)(struct fcache *c, struct fcache_entry *e);  /* or NULL */
+    struct fcache_entry *(*victim)(struct fcache *c);
+    void (*remove)(struct fcache *c, struct fcache_entry *e);  /* or NULL */
+};
+
+/* Every policy, lru first, up to a NULL */
+extern struct fcache_policy *fcache_policies[];
+
+/* The policy called name, or NULL */
+struct fcache_policy *fcache_policy(const char *name);
+
+/* A lib/ function, as every handler is called */
+typedef void (*dynamic_fn)(int fd, char *cgiargs);
+
+struct fcache_entry {
+    char *name;
+    unsigned hash;
+    void *handle;
+    dynamic_fn function;
+    int size;
+    volatile long used;     /* clock value of the last hit */
+    volatile int hits;      /* counted for LFU, without atomics */
+    volatile int referenced;        /* hit since the policy last looked */
+    int queue;              /* ARC's T1 or T2, 2Q's A1in or Am */
+    struct fcache_entry *next;      /* every entry, oldest first; */
+    struct fcache_entry *prev;      /*     for writers only */
+    struct fcache *cache;   /* the shard it was inserted in */
+};
+
+struct fcache_table {
+    int nslots;             /* a power of two */
+    int nused;              /* live entries plus tombstones */
+    struct fcache_entry *slots[];
+};
+
+/* Hashes of evicted functions, oldest first */
+struct fcache_ghost {
+    unsigned hash;
+    struct fcache_ghost *next;
+    struct fcache_ghost *prev;
+};
+
+struct fcache_ghosts {
+    struct fcache_ghost list;       /* sentinel */
+    int count;
+};
+
+struct fcache {
+    struct fcache_table *volatile table;
+    struct fcache_entry list;       /* sentinel of the entry list */
+    int count;
+    long size;              /* bytes of the libraries in the shard */
+    int shared;
+    pthread_mutex_t lock;
+    void (*unload)(struct fcache_entry *e);     /* once e is unreachable */
+    long (*clock)(void);    /* stamps hits; clock_ms unless set after init */
+    struct fcache_policy *policy;
+    struct fcache_entry *hand;      /* CLOCK's next candidate, or NULL */
+    int queued[2];          /* entries per ARC or 2Q queue */
+    struct fcache_ghosts ghosts[2]; /* ARC's B1 and B2, 2Q's A1out */
+    int target;             /* ARC's wanted T1 length */
+};
+
+void fcache_init(struct fcache *c, int shared, struct fcache_policy *policy,
+        void (*unload)(struct fcache_entry *e));
+
+/* Brackets lookups and the use of what they return */
+void fcache_read_begin(struct fcache *c);
+void fcache_read_end(struct fcache *c);
+
+/* The entry for name, or NULL; only between read_begin and read_end */
+struct fcache_entry *fcache_find(struct fcache *c, const char *name);
+
+/* Serialize the writers below */
+void fcache_lock(struct fcache *c);
+void fcache_unlock(struct fcache *c);
+
+/* A new entry, not yet in any shard */
+struct fcache_entry *fcache_entry_new(const char *name, void *handle,
+        dynamic_fn function, int size);
+
+void fcache_insert(struct fcache *c, struct fcache_entry *e);
+
+/* The entry the policy would evict next, or NULL if the shard is empty */
+struct fcache_entry *fcache_victim(struct fcache *c);
+
+/* Takes e out of the shard; it is unloaded once no reader can see it */
+void fcache_remove(struct fcache *c, struct fcache_entry *e);
+
+#endif /* __FCACHE_H__ */
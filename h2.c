@@ -0,0 +1,955 @@
+/*
+ * h2.c - HTTP/2 framing, HPACK and flow control for tiny's h2c connections
+ */
+#define _GNU_SOURCE
+#include "h2.h"
+#include "conn.h"
+
+#define FRAME_HDR 9
+#define MAX_RECV_FRAME (RIO_BUFSIZE - FRAME_HDR)  /* must fit in the Rio buffer */
+#define MAX_BLOCK (2 * MAXBUF)      /* largest request header block */
+#define DATA_CHUNK 16384            /* most body bytes per DATA frame */
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffL
+#define RECV_WINDOW 4096            /* request body bytes a stream may send */
+#define MAX_STREAMS 100             /* streams with a response in flight */
+#define TABLE_SIZE 4096             /* HPACK table size, both directions */
+#define TABLE_ENTRIES (TABLE_SIZE / 32)
+#define STATIC_ENTRIES 61
+
+/* The preface after H2_PREFACE_LINE */
+#define PREFACE_REST "\r\nSM\r\n\r\n"
+
+/* Frame types */
+enum { DATA, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING,
+    GOAWAY, WINDOW_UPDATE, CONTINUATION };
+
+/* Frame flags */
+#define END_STREAM 0x1
+#define ACK 0x1
+#define END_HEADERS 0x4
+#define PADDED 0x8
+#define PRIORITY_FLAG 0x20
+
+/* Settings */
+enum { SET_HEADER_TABLE_SIZE = 1, SET_ENABLE_PUSH, SET_MAX_CONCURRENT_STREAMS,
+    SET_INITIAL_WINDOW_SIZE, SET_MAX_FRAME_SIZE, SET_MAX_HEADER_LIST_SIZE };
+
+/* Error codes */
+enum { NO_ERROR, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR,
+    SETTINGS_TIMEOUT, STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM,
+    CANCEL, COMPRESSION_ERROR };
+
+/* An HPACK dynamic table; entry 1 is the newest */
+struct hpack_entry {
+    char *name;
+    char *value;
+    size_t size;    /* RFC 7541 size: both lengths plus 32 */
+};
+
+struct hpack_table {
+    struct hpack_entry ents[TABLE_ENTRIES];
+    int first;      /* oldest entry */
+    int n;
+    size_t size;
+    size_t max;
+};
+
+/* A stream whose response body is still being sent */
+struct stream {
+    int id;
+    long window;        /* bytes the client will take on this stream */
+    struct conn *body;  /* output queue holding the rest of the body */
+};
+
+struct h2 {
+    h2_handler handler;
+    int preface;            /* bytes of the preface still to read */
+    long window;            /* bytes the client will take on the connection */
+    long initial_window;    /* the client's window for new streams */
+    int last_stream;        /* highest stream the client opened */
+    int goaway;             /* the client is going away */
+    /* The header block being collected from HEADERS and CONTINUATION */
+    int block_stream;       /* 0 if none */
+    unsigned char block[MAX_BLOCK];
+    size_t block_len;
+    struct hpack_table dec; /* the client's header table */
+    struct hpack_table enc; /* ours */
+    long enc_update;        /* table size change to announce, or -1 */
+    struct stream streams[MAX_STREAMS];
+    int nstreams;
+    struct conn *scratch;   /* a spare connection to serve requests into */
+};
+
+/* Codes of each length, 0 to 30 */
+static const unsigned char huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+/* Symbols in code order; 256 is EOS */
+static const short huff_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+/* The HPACK static table, entries 1 to 61 */
+static const struct { char *name, *value; } static_table[STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+static unsigned long get32(unsigned char *p) {
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, unsigned long v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/******* HPACK *******/
+
+static void table_evict(struct hpack_table *t) {
+    struct hpack_entry *e = &t->ents[t->first];
+
+    t->size -= e->size;
+    Free(e->name);
+    Free(e->value);
+    t->first = (t->first + 1) % TABLE_ENTRIES;
+    t->n--;
+}
+
+/* table_resize - set t's maximum size, evicting entries that no longer fit */
+static void table_resize(struct hpack_table *t, size_t max) {
+    t->max = max;
+    while (t->size > t->max)
+        table_evict(t);
+}
+
+/* table_add - insert a new entry; one larger than the table empties it */
+static void table_add(struct hpack_table *t, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + 32;
+    struct hpack_entry *e;
+
+    while (t->n > 0 && t->size + size > t->max)
+        table_evict(t);
+    if (size > t->max)
+        return;
+    e = &t->ents[(t->first + t->n) % TABLE_ENTRIES];
+    e->name = strdup(name);
+    e->value = strdup(value);
+    e->size = size;
+    t->size += size;
+    t->n++;
+}
+
+/* table_get - entry i (1 for the newest) of the dynamic table */
+static struct hpack_entry *table_get(struct hpack_table *t, int i) {
+    return &t->ents[(t->first + t->n - i) % TABLE_ENTRIES];
+}
+
+static void table_free(struct hpack_table *t) {
+    while (t->n > 0)
+        table_evict(t);
+}
+
+/* lookup - the name and value of index i across both tables; -1 if none */
+static int lookup(struct hpack_table *t, size_t i, char **name, char **value) {
+    struct hpack_entry *e;
+
+    if (i >= 1 && i <= STATIC_ENTRIES) {
+        *name = static_table[i - 1].name;
+        *value = static_table[i - 1].value;
+        return 0;
+    }
+    if (i <= STATIC_ENTRIES || i > STATIC_ENTRIES + (size_t)t->n)
+        return -1;
+    e = table_get(t, i - STATIC_ENTRIES);
+    *name = e->name;
+    *value = e->value;
+    return 0;
+}
+
+/* get_int - decode an integer with an N-bit prefix at *pp */
+static int get_int(unsigned char **pp, unsigned char *end, int prefix,
+        size_t *out) {
+    unsigned char *p = *pp;
+    size_t max = (1 << prefix) - 1, v = *p++ & max;
+    int shift = 0;
+
+    if (v == max) {
+        do {
+            if (p == end || shift > 28)
+                return -1;
+            v += (size_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+    }
+    *pp = p;
+    *out = v;
+    return 0;
+}
+
+/*
+ * huff_decode - decode a Huffman-coded string into dst. The code is
+ *     canonical, so the codes of each length are consecutive numbers and
+ *     a bit at a time is enough to find where one ends. Returns the
+ *     decoded length, or -1 if it does not fit or the padding is not
+ *     a prefix of EOS.
+ */
+static int huff_decode(unsigned char *src, size_t len, char *dst,
+        size_t size) {
+    int code = 0, first = 0, index = 0, nbits = 0, ones = 1, bit, sym;
+    size_t i, n = 0;
+
+    for (i = 0; i < 8 * len; i++) {
+        bit = src[i / 8] >> (7 - i % 8) & 1;
+        code |= bit;
+        ones &= bit;
+        nbits++;
+        if (code - first < huff_count[nbits]) {
+            sym = huff_syms[index + code - first];
+            if (sym == 256 || n + 1 >= size)
+                return -1;
+            dst[n++] = sym;
+            code = first = index = nbits = 0;
+            ones = 1;
+            continue;
+        }
+        if (nbits == 30)
+            return -1;
+        index += huff_count[nbits];
+        first = (first + huff_count[nbits]) << 1;
+        code <<= 1;
+    }
+    if (nbits > 7 || !ones)
+        return -1;
+    return n;
+}
+
+/* get_string - decode a string literal at *pp into a buffer of size bytes */
+static int get_string(unsigned char **pp, unsigned char *end, char *buf,
+        size_t size) {
+    int huffman = **pp & 0x80;
+    size_t len;
+    int n;
+
+    if (*pp == end || get_int(pp, end, 7, &len) < 0 ||
+            len > (size_t)(end - *pp))
+        return -1;
+    if (huffman) {
+        if ((n = huff_decode(*pp, len, buf, size)) < 0)
+            return -1;
+    }
+    else {
+        if (len >= size)
+            return -1;
+        memcpy(buf, *pp, len);
+        n = len;
+    }
+    buf[n] = '\0';
+    *pp += len;
+    return 0;
+}
+
+/* request_field - note the request header fields tiny cares about */
+static void request_field(struct h2_request *req, char *name, char *value) {
+    if (!strcmp(name, ":method"))
+        strcpy(req->method, value);
+    else if (!strcmp(name, ":path"))
+        strcpy(req->path, value);
+    else if (!strcmp(name, "x-deadline-ms"))
+        req->deadline_ms = atol(value);
+}
+
+/* hpack_decode - decode a request header block; -1 on a compression error */
+static int hpack_decode(struct hpack_table *t, unsigned char *p, size_t len,
+        struct h2_request *req) {
+    unsigned char *end = p + len;
+    char namebuf[MAXLINE], valuebuf[MAXLINE], *name, *value;
+    size_t i;
+    int indexing;
+
+    while (p < end) {
+        if (*p & 0x80) {            /* indexed field */
+            if (get_int(&p, end, 7, &i) < 0 || lookup(t, i, &name, &value) < 0)
+                return -1;
+            request_field(req, name, value);
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) {  /* table size update */
+            if (get_int(&p, end, 5, &i) < 0 || i > TABLE_SIZE)
+                return -1;
+            table_resize(t, i);
+            continue;
+        }
+        /* A literal, with incremental indexing or without */
+        indexing = *p & 0x40;
+        if (get_int(&p, end, indexing ? 6 : 4, &i) < 0)
+            return -1;
+        if (i > 0) {
+            if (lookup(t, i, &name, &value) < 0)
+                return -1;
+            strcpy(namebuf, name);
+        }
+        else if (get_string(&p, end, namebuf, MAXLINE) < 0)
+            return -1;
+        if (get_string(&p, end, valuebuf, MAXLINE) < 0)
+            return -1;
+        request_field(req, namebuf, valuebuf);
+        if (indexing)
+            table_add(t, namebuf, valuebuf);
+    }
+    return 0;
+}
+
+/* put_int - encode v with an N-bit prefix, the first byte's other bits set */
+static unsigned char *put_int(unsigned char *p, int bits, int prefix,
+        size_t v) {
+    size_t max = (1 << prefix) - 1;
+
+    if (v < max) {
+        *p++ = bits | v;
+        return p;
+    }
+    *p++ = bits | max;
+    for (v -= max; v >= 128; v /= 128)
+        *p++ = v % 128 + 128;
+    *p++ = v;
+    return p;
+}
+
+static unsigned char *put_string(unsigned char *p, char *s) {
+    size_t len = strlen(s);
+
+    p = put_int(p, 0, 7, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/*
+ * hpack_field - encode one response field: as an index if either table
+ *     holds it, else as a literal that enters our table unless it is
+ *     not worth keeping
+ */
+static unsigned char *hpack_field(struct hpack_table *t, unsigned char *p,
+        char *name, char *value, int keep) {
+    struct hpack_entry *e;
+    int i, name_index = 0;
+
+    for (i = 1; i <= t->n; i++) {
+        e = table_get(t, i);
+        if (!strcmp(e->name, name) && !strcmp(e->value, value))
+            return put_int(p, 0x80, 7, STATIC_ENTRIES + i);
+    }
+    for (i = 1; i <= STATIC_ENTRIES; i++) {
+        if (strcmp(static_table[i - 1].name, name))
+            continue;
+        if (!strcmp(static_table[i - 1].value, value))
+            return put_int(p, 0x80, 7, i);
+        if (name_index == 0)
+            name_index = i;
+    }
+    p = keep ? put_int(p, 0x40, 6, name_index) : put_int(p, 0, 4, name_index);
+    if (name_index == 0)
+        p = put_string(p, name);
+    p = put_string(p, value);
+    if (keep)
+        table_add(t, name, value);
+    return p;
+}
+
+/*
+ * hpack_response - encode the HTTP/1.1 response header in hdr (len bytes,
+ *     ending in the blank line) into out. Connection-specific fields
+ *     have no place in HTTP/2 and are dropped; Content-length changes
+ *     with every response, so it is never added to the table. Returns
+ *     the encoded length, or -1 if hdr is not a response header.
+ */
+static int hpack_response(struct h2 *h, char *hdr, size_t len,
+        unsigned char *out) {
+    char line[MAXLINE], status[4], *colon, *value, *eol, *end = hdr + len;
+    unsigned char *p = out;
+    int i;
+
+    if (h->enc_update >= 0) {
+        p = put_int(p, 0x20, 5, h->enc_update);
+        h->enc_update = -1;
+    }
+    if ((eol = memmem(hdr, len, "\r\n", 2)) == NULL ||
+            sscanf(hdr, "HTTP/%*s %3[0-9]", status) < 1)
+        return -1;
+    p = hpack_field(&h->enc, p, ":status", status, 1);
+    for (hdr = eol + 2; hdr < end; hdr = eol + 2) {
+        if ((eol = memmem(hdr, end - hdr, "\r\n", 2)) == NULL)
+            return -1;
+        if (eol == hdr)
+            break;
+        if (eol - hdr >= MAXLINE)
+            return -1;
+        memcpy(line, hdr, eol - hdr);
+        line[eol - hdr] = '\0';
+        if ((colon = strchr(line, ':')) == NULL)
+            return -1;
+        *colon = '\0';
+        for (i = 0; line[i]; i++)
+            line[i] = tolower(line[i]);
+        for (value = colon + 1; *value == ' '; value++)
+            ;
+        if (!strcmp(line, "connection") || !strcmp(line, "keep-alive") ||
+                !strcmp(line, "transfer-encoding"))
+            continue;
+        p = hpack_field(&h->enc, p, line, value,
+                strcmp(line, "content-length"));
+    }
+    return p - out;
+}
+
+/******* Frames *******/
+
+static void frame(struct conn *c, size_t len, int type, int flags, int id) {
+    unsigned char hdr[FRAME_HDR];
+
+    hdr[0] = len >> 16;
+    hdr[1] = len >> 8;
+    hdr[2] = len;
+    hdr[3] = type;
+    hdr[4] = flags;
+    put32(hdr + 5, id);
+    conn_append(c, hdr, FRAME_HDR);
+}
+
+static void send_rst(struct conn *c, int id, int code) {
+    unsigned char payload[4];
+
+    put32(payload, code);
+    frame(c, 4, RST_STREAM, 0, id);
+    conn_append(c, payload, 4);
+}
+
+static void send_window_update(struct conn *c, int id, size_t inc) {
+    unsigned char payload[4];
+
+    put32(payload, inc);
+    frame(c, 4, WINDOW_UPDATE, 0, id);
+    conn_append(c, payload, 4);
+}
+
+/*
+ * send_goaway - end the session over a connection error: say which
+ *     streams were seen and let the serving mode close once it is sent
+ */
+static int send_goaway(struct conn *c, int code) {
+    unsigned char payload[8];
+
+    put32(payload, c->h2->last_stream);
+    put32(payload + 4, code);
+    frame(c, 8, GOAWAY, 0, 0);
+    conn_append(c, payload, 8);
+    c->keepalive = 0;
+    return 0;
+}
+
+/* recycle - keep a drained connection as the next scratch one */
+static void recycle(struct h2 *h, struct conn *resp) {
+    if (h->scratch == NULL) {
+        resp->head = resp->nsegs = 0;
+        h->scratch = resp;
+    }
+    else
+        conn_free(resp);
+}
+
+/* read_chunk - read n bytes of a file segment's body into buf */
+static int read_chunk(struct seg *s, char *buf, size_t n) {
+    size_t got = 0;
+    ssize_t rc;
+
+    while (got < n) {
+        if ((rc = pread(s->filefd, buf + got, n - got, s->off + got)) <= 0) {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += rc;
+    }
+    return 0;
+}
+
+/*
+ * send_data - queue one DATA frame of st's body, as large as both
+ *     windows allow. File bodies are read a frame at a time. Returns 1
+ *     if it queued a frame, 0 if the windows are shut and -1 if the body
+ *     could not be read.
+ */
+static int send_data(struct conn *c, struct stream *st) {
+    struct h2 *h = c->h2;
+    struct conn *body = st->body;
+    char chunk[DATA_CHUNK];
+    struct seg *s;
+    long n = DATA_CHUNK;
+
+    conn_consume(body, 0);      /* skip empty segments */
+    s = &body->segs[body->head];
+    if (n > st->window)
+        n = st->window;
+    if (n > h->window)
+        n = h->window;
+    if (n <= 0)     /* a SETTINGS change can leave a window negative */
+        return 0;
+    if ((size_t)n > s->len)
+        n = s->len;
+    if (s->filefd >= 0 && read_chunk(s, chunk, n) < 0)
+        return -1;
+    frame(c, n, DATA, (size_t)n == body->pending ? END_STREAM : 0, st->id);
+    conn_append(c, s->filefd >= 0 ? chunk : s->base, n);
+    conn_consume(body, n);
+    st->window -= n;
+    h->window -= n;
+    return 1;
+}
+
+/*
+ * pump - send what the windows allow of every pending body, a frame
+ *     per stream in turn so that one large body does not hold up the
+ *     rest, and retire the streams that finish
+ */
+static void pump(struct conn *c) {
+    struct h2 *h = c->h2;
+    struct stream *st;
+    int i, rc, progress;
+
+    do {
+        progress = 0;
+        for (i = 0; i < h->nstreams; i++) {
+            st = &h->streams[i];
+            if ((rc = send_data(c, st)) < 0)
+                send_rst(c, st->id, INTERNAL_ERROR);
+            progress |= rc > 0;
+            if (rc < 0 || st->body->pending == 0) {
+                recycle(h, st->body);
+                *st = h->streams[--h->nstreams];
+                i--;
+            }
+        }
+    } while (progress && h->window > 0);
+}
+
+/* find_stream - the pending stream with id, or NULL */
+static struct stream *find_stream(struct h2 *h, int id) {
+    int i;
+
+    for (i = 0; i < h->nstreams; i++)
+        if (h->streams[i].id == id)
+            return &h->streams[i];
+    return NULL;
+}
+
+/*
+ * respond - re-frame the HTTP/1.1 response a handler queued on resp as
+ *     stream id's HEADERS and DATA
+ */
+static void respond(struct conn *c, int id, struct conn *resp) {
+    struct h2 *h = c->h2;
+    unsigned char block[2 * MAXBUF];
+    struct stream *st;
+    struct seg *s;
+    char *blank;
+    size_t hdrlen;
+    int len;
+
+    /* Handlers queue the whole header in one heap segment */
+    s = &resp->segs[resp->head];
+    len = -1;
+    if (resp->nsegs > resp->head && s->filefd < 0 &&
+            (blank = memmem(s->base, s->len, "\r\n\r\n", 4)) != NULL) {
+        hdrlen = blank + 4 - s->base;
+        len = hpack_response(h, s->base, hdrlen, block);
+    }
+    if (len < 0) {
+        conn_consume(resp, resp->pending);
+        recycle(h, resp);
+        send_rst(c, id, INTERNAL_ERROR);
+        return;
+    }
+    conn_consume(resp, hdrlen);
+    frame(c, len, HEADERS, END_HEADERS | (resp->pending ? 0 : END_STREAM), id);
+    conn_append(c, block, len);
+    if (resp->pending == 0) {
+        recycle(h, resp);
+        return;
+    }
+    st = &h->streams[h->nstreams++];
+    st->id = id;
+    st->window = h->initial_window;
+    st->body = resp;
+    pump(c);
+}
+
+/* serve_block - decode the finished header block and serve its stream */
+static int serve_block(struct conn *c) {
+    struct h2 *h = c->h2;
+    struct h2_request req;
+    struct conn *resp;
+    int id = h->block_stream;
+
+    memset(&req, 0, sizeof(req));
+    req.stream = id;
+    h->block_stream = 0;
+    if (hpack_decode(&h->dec, h->block, h->block_len, &req) < 0)
+        return send_goaway(c, COMPRESSION_ERROR);
+    if (req.method[0] == '\0' || req.path[0] == '\0') {
+        send_rst(c, id, PROTOCOL_ERROR);
+        return 0;
+    }
+    if (h->nstreams == MAX_STREAMS || h->goaway) {
+        send_rst(c, id, REFUSED_STREAM);
+        return 0;
+    }
+    if ((resp = h->scratch) != NULL)
+        h->scratch = NULL;
+    else
+        resp = conn_new(-1);
+    resp->keepalive = 1;
+    resp->arrival = clock_ms();
+    resp->due = 0;
+    h->handler(resp, &req);
+    respond(c, id, resp);
+    return 0;
+}
+
+/* add_block - collect a header block fragment; serve it once complete */
+static int add_block(struct conn *c, unsigned char *p, size_t len,
+        int flags) {
+    struct h2 *h = c->h2;
+
+    if (h->block_len + len > MAX_BLOCK)
+        return send_goaway(c, COMPRESSION_ERROR);
+    memcpy(h->block + h->block_len, p, len);
+    h->block_len += len;
+    return flags & END_HEADERS ? serve_block(c) : 0;
+}
+
+static int on_headers(struct conn *c, unsigned char *p, size_t len,
+        int flags, int id) {
+    struct h2 *h = c->h2;
+    size_t pad = 0;
+
+    /* Streams are opened by the client, in order, once each */
+    if (id == 0 || id % 2 == 0 || id <= h->last_stream)
+        return send_goaway(c, PROTOCOL_ERROR);
+    h->last_stream = id;
+    if (flags & PADDED) {
+        if (len < 1)
+            return send_goaway(c, FRAME_SIZE_ERROR);
+        pad = *p++;
+        len--;
+    }
+    if (flags & PRIORITY_FLAG) {
+        if (len < 5)
+            return send_goaway(c, FRAME_SIZE_ERROR);
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len)
+        return send_goaway(c, PROTOCOL_ERROR);
+    h->block_stream = id;
+    h->block_len = 0;
+    return add_block(c, p, len - pad, flags);
+}
+
+static int on_settings(struct conn *c, unsigned char *p, size_t len,
+        int flags, int id) {
+    struct h2 *h = c->h2;
+    unsigned long value;
+    long delta;
+    int i;
+
+    if (id != 0)
+        return send_goaway(c, PROTOCOL_ERROR);
+    if (flags & ACK)
+        return len ? send_goaway(c, FRAME_SIZE_ERROR) : 0;
+    if (len % 6)
+        return send_goaway(c, FRAME_SIZE_ERROR);
+    for (; len > 0; p += 6, len -= 6) {
+        value = get32(p + 2);
+        switch (p[0] << 8 | p[1]) {
+        case SET_HEADER_TABLE_SIZE:
+            /* Ours stays within the client's table; a cut is announced */
+            if (value < h->enc.max) {
+                table_resize(&h->enc, value);
+                h->enc_update = value;
+            }
+            break;
+        case SET_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW)
+                return send_goaway(c, FLOW_CONTROL_ERROR);
+            delta = value - h->initial_window;
+            h->initial_window = value;
+            for (i = 0; i < h->nstreams; i++)
+                h->streams[i].window += delta;
+            break;
+        case SET_MAX_FRAME_SIZE:
+            /* Our DATA_CHUNK frames are within every legal value */
+            if (value < 16384 || value > 16777215)
+                return send_goaway(c, PROTOCOL_ERROR);
+            break;
+        }
+    }
+    frame(c, 0, SETTINGS, ACK, 0);
+    pump(c);
+    return 0;
+}
+
+/* cancel - the client reset a stream; forget the rest of its body */
+static void cancel(struct h2 *h, int id) {
+    struct stream *st = find_stream(h, id);
+
+    if (st == NULL)
+        return;
+    conn_consume(st->body, st->body->pending);
+    recycle(h, st->body);
+    *st = h->streams[--h->nstreams];
+}
+
+static int on_window_update(struct conn *c, unsigned char *p, size_t len,
+        int id) {
+    struct h2 *h = c->h2;
+    unsigned long inc;
+    struct stream *st;
+
+    if (len != 4)
+        return send_goaway(c, FRAME_SIZE_ERROR);
+    inc = get32(p) & MAX_WINDOW;
+    if (id == 0) {
+        if (inc == 0 || h->window + inc > MAX_WINDOW)
+            return send_goaway(c, inc ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+        h->window += inc;
+    }
+    else if ((st = find_stream(h, id)) != NULL) {
+        if (inc == 0 || st->window + inc > MAX_WINDOW) {
+            send_rst(c, id, inc ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+            cancel(h, id);
+        }
+        else
+            st->window += inc;
+    }
+    pump(c);
+    return 0;
+}
+
+/* on_frame - act on one frame; PRIORITY and unknown types are ignored */
+static int on_frame(struct conn *c, int type, int flags, int id,
+        unsigned char *payload, size_t len) {
+    struct h2 *h = c->h2;
+
+    /* Nothing may come between a header block's frames */
+    if (h->block_stream && (type != CONTINUATION || id != h->block_stream))
+        return send_goaway(c, PROTOCOL_ERROR);
+    switch (type) {
+    case DATA:
+        /* Request bodies are dropped, but their bytes are given back */
+        if (id == 0)
+            return send_goaway(c, PROTOCOL_ERROR);
+        if (len > 0)
+            send_window_update(c, 0, len);
+        break;
+    case HEADERS:
+        return on_headers(c, payload, len, flags, id);
+    case CONTINUATION:
+        if (!h->block_stream)
+            return send_goaway(c, PROTOCOL_ERROR);
+        return add_block(c, payload, len, flags);
+    case RST_STREAM:
+        if (id == 0 || len != 4)
+            return send_goaway(c, id ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+        cancel(h, id);
+        break;
+    case SETTINGS:
+        return on_settings(c, payload, len, flags, id);
+    case PUSH_PROMISE:
+        return send_goaway(c, PROTOCOL_ERROR);
+    case PING:
+        if (id != 0 || len != 8)
+            return send_goaway(c, id ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        if (!(flags & ACK)) {
+            frame(c, 8, PING, ACK, 0);
+            conn_append(c, payload, 8);
+        }
+        break;
+    case GOAWAY:
+        h->goaway = 1;
+        break;
+    case WINDOW_UPDATE:
+        return on_window_update(c, payload, len, id);
+    }
+    return 0;
+}
+
+int h2_start(struct conn *c, h2_handler handler) {
+    struct h2 *h = Calloc(1, sizeof(struct h2));
+    unsigned char settings[12];
+
+    h->handler = handler;
+    h->preface = strlen(PREFACE_REST);
+    h->window = h->initial_window = DEFAULT_WINDOW;
+    h->dec.max = h->enc.max = TABLE_SIZE;
+    h->enc_update = -1;
+    c->h2 = h;
+    c->keepalive = 1;
+
+    /* Our SETTINGS go first */
+    settings[0] = 0;
+    settings[1] = SET_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SET_INITIAL_WINDOW_SIZE;
+    put32(settings + 8, RECV_WINDOW);
+    frame(c, sizeof(settings), SETTINGS, 0, 0);
+    conn_append(c, settings, sizeof(settings));
+    return 0;
+}
+
+/*
+ * h2_has_frame - is a whole frame buffered? A frame too large for the
+ *     buffer counts once its header is in, so that h2_process can refuse
+ *     it rather than leave the connection waiting for it.
+ */
+int h2_has_frame(struct conn *c) {
+    unsigned char *p = (unsigned char *)c->rio.rio_bufptr;
+    size_t n = c->rio.rio_cnt > 0 ? c->rio.rio_cnt : 0, len;
+
+    if (c->h2->preface)
+        return n >= (size_t)c->h2->preface;
+    if (n < FRAME_HDR)
+        return 0;
+    len = p[0] << 16 | p[1] << 8 | p[2];
+    return len > MAX_RECV_FRAME || n >= FRAME_HDR + len;
+}
+
+int h2_process(struct conn *c) {
+    struct h2 *h = c->h2;
+    unsigned char hdr[FRAME_HDR], payload[MAX_RECV_FRAME];
+    char rest[sizeof(PREFACE_REST)];
+    size_t len;
+    int type, flags, id;
+
+    if (h->preface) {
+        if (rio_readnb(&c->rio, rest, h->preface) != h->preface ||
+                memcmp(rest, PREFACE_REST, h->preface))
+            return -1;
+        h->preface = 0;
+        return 0;
+    }
+    if (rio_readnb(&c->rio, hdr, FRAME_HDR) != FRAME_HDR)
+        return -1;
+    len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+    type = hdr[3];
+    flags = hdr[4];
+    id = get32(hdr + 5) & MAX_WINDOW;
+    if (len > MAX_RECV_FRAME)
+        return send_goaway(c, FRAME_SIZE_ERROR);
+    if (len > 0 && rio_readnb(&c->rio, payload, len) != (ssize_t)len)
+        return -1;
+
+    if (on_frame(c, type, flags, id, payload, len) < 0)
+        return -1;
+    /* A client going away has its streams finished, then is let go */
+    if (h->goaway && h->nstreams == 0)
+        c->keepalive = 0;
+    return 0;
+}
+
+void h2_free(struct h2 *h) {
+    int i;
+
+    for (i = 0; i < h->nstreams; i++)
+        conn_free(h->streams[i].body);
+    if (h->scratch != NULL)
+        conn_free(h->scratch);
+    table_free(&h->dec);
+    table_free(&h->enc);
+    Free(h);
+}
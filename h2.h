@@ -0,0 +1,63 @@
+/*
+ * h2.h - HTTP/2 over cleartext TCP (h2c) for tiny
+ *
+ * A client that opens a connection with the HTTP/2 preface (prior
+ * knowledge, as curl --http2-prior-knowledge and most gateways do) gets
+ * an h2 session on it. The serving modes go on calling the request
+ * handler whenever conn_has_request says there is work; on an h2
+ * connection that means one complete frame, which h2_process reads and
+ * acts on. Once a stream's header block is in, its request is served by
+ * the h2_handler into a scratch connection exactly like an HTTP/1.1
+ * request, and the response queued there is re-framed: the header as an
+ * HPACK-compressed HEADERS frame, the body as DATA frames sent as fast
+ * as the stream's and the connection's flow-control windows allow. A
+ * body that does not fit waits with its stream until the client's
+ * WINDOW_UPDATE frames open the windows again.
+ *
+ * Response headers other than Content-length go into the HPACK dynamic
+ * table, so after the first response on a connection a repeated header
+ * costs a byte. Frames must fit in the connection's read buffer, and
+ * request bodies are ignored, as they are over HTTP/1.1.
+ */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+
+struct conn;
+struct h2;
+
+/* The request line the preface starts with */
+#define H2_PREFACE_LINE "PRI * HTTP/2.0\r\n"
+
+/* What tiny needs to know about a stream's request */
+struct h2_request {
+    int stream;
+    char method[MAXLINE];
+    char path[MAXLINE];
+    long deadline_ms;   /* x-deadline-ms, or 0 */
+};
+
+/* Serves req by queueing an HTTP/1.1 response on resp */
+typedef void (*h2_handler)(struct conn *resp, struct h2_request *req);
+
+/*
+ * Turns c into an h2 connection once H2_PREFACE_LINE has been read from
+ * it; the rest of the preface is checked by the next h2_process. Streams
+ * are served by handler. Returns 0.
+ */
+int h2_start(struct conn *c, h2_handler handler);
+
+/* Is the next frame (or the rest of the preface) buffered? */
+int h2_has_frame(struct conn *c);
+
+/*
+ * Acts on the next frame, queueing whatever it calls for on c. Returns
+ * -1 if the connection should be dropped at once; a protocol error
+ * instead queues a GOAWAY and clears c->keepalive.
+ */
+int h2_process(struct conn *c);
+
+void h2_free(struct h2 *h);
+
+#endif /* __H2_H__ */
@@ -0,0 +1,390 @@
+/*
+ * loadgen.c - closed-loop HTTP load generator for tiny
+ *
+ * Each client thread repeatedly opens a connection, sends one GET for
+ * uri, reads the response until the server closes and records the
+ * latency. With -k each thread instead keeps one HTTP/1.1 connection
+ * open and reads each response by its Content-length, reconnecting only
+ * when the server closes; -p N additionally pipelines N requests per
+ * write and then reads the N responses. Responses with status 503, which
+ * tiny sends when it sheds load, are counted apart and left out of the
+ * rate and latencies. -u path connects to tiny's AF_UNIX listener instead
+ * of host and port, which then only name the server in the Host header.
+ * -s speaks TLS to tiny's -s port, with a full handshake per connection;
+ * -R resumes each thread's previous session instead (by ticket or session
+ * ID), so the cost of a full and of a resumed handshake can be compared.
+ * After the run it prints one summary line:
+ *
+ *     <requests> reqs <errors> errors <shed> shed <rate> req/s p50 <us> p99 <us>
+ *
+ * and, with -s, a second one: tls: <n> handshakes <m> resumed
+ */
+#include "csapp.h"
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+struct client {
+    pthread_t tid;
+    int fd;             /* kept-alive connection, or -1 */
+    rio_t rio;
+    long nreqs;
+    long nerrs;
+    long nshed;
+    long *lat;          /* latencies in microseconds */
+    long nlat, caplat;
+    void *ssl;          /* the connection's SSL, with -s */
+    void *session;      /* SSL_SESSION to resume next, with -R */
+    long nhandshakes;
+    long nresumed;
+};
+
+static struct sockaddr_storage server;    /* AF_INET or, with -u, AF_UNIX */
+static socklen_t serverlen;
+static char *request;
+static double stop_at;
+static int keepalive;
+static int depth = 1;   /* requests pipelined per round trip */
+static int use_tls;
+static int resume;
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* is_shed - whether the status line in buf reports a 503 */
+static int is_shed(const char *buf, size_t len) {
+    return len >= 12 && strncmp(buf + 9, "503", 3) == 0;
+}
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_ctx;
+
+static void tls_setup(void) {
+    if ((tls_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+        app_error("SSL_CTX_new error");
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+}
+
+/* tls_start - handshake on fd, offering cl's saved session with -R */
+static int tls_start(struct client *cl, int fd) {
+    SSL *ssl;
+
+    if ((ssl = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ssl, fd) != 1)
+        app_error("SSL_new error");
+    if (resume && cl->session != NULL)
+        SSL_set_session(ssl, cl->session);
+    if (SSL_connect(ssl) != 1) {
+        SSL_free(ssl);
+        ERR_clear_error();
+        return -1;
+    }
+    cl->nhandshakes++;
+    cl->nresumed += SSL_session_reused(ssl);
+    cl->ssl = ssl;
+    return 0;
+}
+
+static ssize_t tls_read(void *ssl, void *buf, size_t n) {
+    int rc = SSL_read(ssl, buf, n);
+
+    if (rc > 0)
+        return rc;
+    rc = SSL_get_error(ssl, rc) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    ERR_clear_error();
+    return rc;
+}
+
+/*
+ * tls_end - shut down and free cl's SSL, first keeping its session for
+ *     -R. Under TLS 1.3 the ticket arrives after the handshake, so this
+ *     is the session the response was read in. Without the close_notify
+ *     of SSL_shutdown, SSL_free would mark the session unresumable.
+ */
+static void tls_end(struct client *cl) {
+    SSL_SESSION *sess;
+
+    SSL_shutdown(cl->ssl);
+    ERR_clear_error();
+    if (resume && (sess = SSL_get1_session(cl->ssl)) != NULL) {
+        if (SSL_SESSION_is_resumable(sess)) {
+            if (cl->session != NULL)
+                SSL_SESSION_free(cl->session);
+            cl->session = sess;
+        }
+        else
+            SSL_SESSION_free(sess);
+    }
+    SSL_free(cl->ssl);
+    cl->ssl = NULL;
+}
+#endif
+
+/* dial - connect to the server, over TLS with -s; returns the socket or -1 */
+static int dial(struct client *cl) {
+    int fd;
+
+    if ((fd = socket(server.ss_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&server, serverlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    rio_readinitb(&cl->rio, fd);
+#ifdef HAVE_OPENSSL
+    if (use_tls) {
+        if (tls_start(cl, fd) < 0) {
+            close(fd);
+            return -1;
+        }
+        cl->rio.rio_readfn = tls_read;
+        cl->rio.rio_ctx = cl->ssl;
+    }
+#endif
+    return fd;
+}
+
+static int send_request(struct client *cl, int fd) {
+#ifdef HAVE_OPENSSL
+    if (cl->ssl != NULL)
+        return SSL_write(cl->ssl, request, strlen(request)) > 0 ? 0 : -1;
+#endif
+    return rio_writen(fd, request, strlen(request)) < 0 ? -1 : 0;
+}
+
+static ssize_t recv_some(struct client *cl, int fd, char *buf, size_t n) {
+#ifdef HAVE_OPENSSL
+    if (cl->ssl != NULL)
+        return tls_read(cl->ssl, buf, n);
+#endif
+    return read(fd, buf, n);
+}
+
+static void hang_up(struct client *cl, int fd) {
+#ifdef HAVE_OPENSSL
+    if (cl->ssl != NULL)
+        tls_end(cl);
+#endif
+    close(fd);
+}
+
+/*
+ * one_request - connect, send the request and drain the response.
+ *     Returns 1 if it was shed, 0 if served and -1 on error.
+ */
+static int one_request(struct client *cl) {
+    char buf[MAXBUF];
+    ssize_t n;
+    int fd, shed;
+
+    if ((fd = dial(cl)) < 0)
+        return -1;
+    if (send_request(cl, fd) < 0) {
+        hang_up(cl, fd);
+        return -1;
+    }
+    n = recv_some(cl, fd, buf, sizeof(buf));
+    shed = n > 0 && is_shed(buf, n);
+    while (n > 0)
+        n = recv_some(cl, fd, buf, sizeof(buf));
+    hang_up(cl, fd);
+    return n < 0 ? -1 : shed;
+}
+
+/*
+ * ka_request - send depth copies of the request on cl's open connection
+ *     and read as many replies. Returns how many were shed, or -1.
+ */
+static int ka_request(struct client *cl) {
+    char buf[MAXBUF];
+    long len, n;
+    int i, shed = 0, closing = 0;
+
+    if (cl->fd < 0 && (cl->fd = dial(cl)) < 0)
+        return -1;
+    if (send_request(cl, cl->fd) < 0)
+        goto fail;
+    for (i = 0; i < depth; i++) {
+        len = -1;
+        if ((n = rio_readlineb(&cl->rio, buf, MAXBUF)) <= 0)
+            goto fail;
+        shed += is_shed(buf, n);
+        do {
+            if (rio_readlineb(&cl->rio, buf, MAXBUF) <= 0)
+                goto fail;
+            if (strncasecmp(buf, "Content-length:", 15) == 0)
+                len = atol(buf + 15);
+            if (strncasecmp(buf, "Connection: close", 17) == 0)
+                closing = 1;
+        } while (strcmp(buf, "\r\n"));
+        if (len < 0)
+            goto fail;
+        while (len > 0) {
+            n = len < MAXBUF ? len : MAXBUF;
+            if (rio_readnb(&cl->rio, buf, n) != n)
+                goto fail;
+            len -= n;
+        }
+        /* A server going away (say, draining for an upgrade) closes */
+        if (closing) {
+            hang_up(cl, cl->fd);
+            cl->fd = -1;
+            return i + 1 < depth ? -1 : shed;
+        }
+    }
+    return shed;
+
+ fail:
+    hang_up(cl, cl->fd);
+    cl->fd = -1;
+    return -1;
+}
+
+static void *client_thread(void *arg) {
+    struct client *cl = arg;
+    double start;
+    int shed;
+
+    while ((start = now()) < stop_at) {
+        if ((shed = keepalive ? ka_request(cl) : one_request(cl)) < 0) {
+            cl->nerrs++;
+            continue;
+        }
+        cl->nreqs += (keepalive ? depth : 1) - shed;
+        cl->nshed += shed;
+        if (shed > 0)
+            continue;
+        if (cl->nlat == cl->caplat) {
+            cl->caplat = cl->caplat ? 2 * cl->caplat : 1024;
+            cl->lat = Realloc(cl->lat, cl->caplat * sizeof(long));
+        }
+        cl->lat[cl->nlat++] = (long)((now() - start) * 1e6);
+    }
+    if (cl->fd >= 0)
+        hang_up(cl, cl->fd);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-k] [-p depth] [-t threads] [-d seconds] "
+            "[-u socket_path] [-s [-R]] <host> <port> <uri>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct client *clients;
+    struct hostent *hp;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&server;
+    struct sockaddr_un *sun = (struct sockaddr_un *)&server;
+    char *unix_path = NULL;
+    long nreqs = 0, nerrs = 0, nshed = 0, nlat = 0, *lat;
+    long nhandshakes = 0, nresumed = 0;
+    int i, opt, nthreads = 8;
+    size_t n;
+    double secs = 5, start;
+
+    while ((opt = getopt(argc, argv, "kp:t:d:u:sR")) != -1) {
+        switch (opt) {
+        case 'k':
+            keepalive = 1;
+            break;
+        case 'p':
+            if ((depth = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            if ((nthreads = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((secs = atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'u':
+            if (strlen(unix_path = optarg) >= sizeof(sun->sun_path))
+                usage(argv[0]);
+            break;
+        case 'R':
+            resume = 1;
+            /* fall through */
+        case 's':
+            use_tls = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 3)
+        usage(argv[0]);
+
+    bzero(&server, sizeof(server));
+    if (unix_path != NULL) {
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, unix_path);
+        serverlen = sizeof(struct sockaddr_un);
+    }
+    else {
+        hp = Gethostbyname(argv[optind]);
+        sin->sin_family = AF_INET;
+        bcopy(hp->h_addr_list[0], &sin->sin_addr.s_addr, hp->h_length);
+        sin->sin_port = htons(atoi(argv[optind + 1]));
+        serverlen = sizeof(struct sockaddr_in);
+    }
+    if (depth > 1 && !keepalive)
+        usage(argv[0]);
+    if (use_tls) {
+#ifdef HAVE_OPENSSL
+        tls_setup();
+#else
+        fprintf(stderr, "%s: built without OpenSSL, -s unavailable\n",
+                argv[0]);
+        exit(1);
+#endif
+    }
+    request = Malloc(depth * MAXLINE);
+    sprintf(request, "GET %s HTTP/1.%d\r\nHost: %s\r\n\r\n",
+            argv[optind + 2], keepalive, argv[optind]);
+    for (i = 1, n = strlen(request); i < depth; i++)
+        memcpy(request + i * n, request, n);
+    request[depth * n] = '\0';
+
+    Signal(SIGPIPE, SIG_IGN);
+    clients = Calloc(nthreads, sizeof(struct client));
+    start = now();
+    stop_at = start + secs;
+    for (i = 0; i < nthreads; i++) {
+        clients[i].fd = -1;
+        Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(clients[i].tid, NULL);
+        nreqs += clients[i].nreqs;
+        nerrs += clients[i].nerrs;
+        nshed += clients[i].nshed;
+        nhandshakes += clients[i].nhandshakes;
+        nresumed += clients[i].nresumed;
+    }
+    secs = now() - start;
+
+    lat = Malloc((nreqs + 1) * sizeof(long));
+    for (i = 0; i < nthreads; i++) {
+        memcpy(lat + nlat, clients[i].lat, clients[i].nlat * sizeof(long));
+        nlat += clients[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(long), cmp_long);
+    printf("%ld reqs %ld errors %ld shed %.0f req/s p50 %ld us p99 %ld us\n",
+            nreqs, nerrs, nshed, nreqs / secs,
+            nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0);
+    if (use_tls)
+        printf("tls: %ld handshakes %ld resumed\n", nhandshakes, nresumed);
+    return 0;
+}
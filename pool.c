@@ -0,0 +1,263 @@
+/*
+ * pool.c - fixed-size worker pool with per-worker deques and work stealing
+ */
+#include "pool.h"
+
+#define DEQUE_INIT 64
+#define POOL_MAX_WORKERS 1024
+
+struct task {
+    pool_fn fn;
+    void *arg;
+};
+
+/*
+ * A growable ring of tasks. The owner pushes and pops at the bottom;
+ * thieves take from the top. Each deque has its own lock, so workers
+ * only contend when one of them is stealing.
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct task *buf;
+    int cap;
+    int top;        /* index of the oldest task */
+    int count;
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+    int fresh;          /* the first thread in its slot sets up the deque */
+    sem_t *ready;
+};
+
+/*
+ * Worker slots below nworkers take new tasks. A slot keeps its deque
+ * when the pool shrinks, so the slots below ndeques are all scanned by
+ * thieves, and tasks left on a retired worker's deque still get run.
+ */
+struct pool {
+    volatile int nworkers;
+    volatile int ndeques;   /* slots whose deque has been set up */
+    struct deque *deques;   /* POOL_MAX_WORKERS of them */
+    char *alive;            /* whether a slot has a thread */
+    pool_start_fn start;
+    pthread_mutex_t resize_lock;
+    sem_t items;        /* counts queued tasks across all deques */
+    unsigned next;      /* round-robin cursor for submit */
+    int queued;         /* tasks submitted and not yet taken */
+    volatile int max_queued;    /* bound for pool_try_submit; 0 = none */
+};
+
+static void deque_init(struct deque *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->cap = DEQUE_INIT;
+    d->buf = Malloc(d->cap * sizeof(struct task));
+    d->top = d->count = 0;
+}
+
+static void deque_push(struct deque *d, struct task t) {
+    int i;
+    struct task *buf;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        buf = Malloc(2 * d->cap * sizeof(struct task));
+        for (i = 0; i < d->count; i++)
+            buf[i] = d->buf[(d->top + i) % d->cap];
+        Free(d->buf);
+        d->buf = buf;
+        d->top = 0;
+        d->cap *= 2;
+    }
+    d->buf[(d->top + d->count) % d->cap] = t;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* deque_pop - owner side: take the newest task */
+static int deque_pop(struct deque *d, struct task *t) {
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        d->count--;
+        *t = d->buf[(d->top + d->count) % d->cap];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* deque_steal - thief side: take the oldest task */
+static int deque_steal(struct deque *d, struct task *t) {
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        *t = d->buf[d->top];
+        d->top = (d->top + 1) % d->cap;
+        d->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/*
+ * next_task - a successful P on items reserves one queued task, so the
+ *     scan below always ends up finding one.
+ */
+static void next_task(struct pool *p, int id, struct task *t) {
+    int i, n;
+
+    P(&p->items);
+    __sync_fetch_and_sub(&p->queued, 1);
+    while (1) {
+        if (deque_pop(&p->deques[id], t))
+            return;
+        n = p->ndeques;
+        for (i = 1; i < n; i++)
+            if (deque_steal(&p->deques[(id + i) % n], t))
+                return;
+    }
+}
+
+/*
+ * retire - whether the worker in slot id was removed by pool_resize; if
+ *     so its slot is marked free before its thread exits
+ */
+static int retire(struct pool *p, int id) {
+    int gone;
+
+    pthread_mutex_lock(&p->resize_lock);
+    if ((gone = id >= p->nworkers))
+        p->alive[id] = 0;
+    pthread_mutex_unlock(&p->resize_lock);
+    return gone;
+}
+
+/*
+ * worker_thread - run start, then set up the worker's own deque, so that
+ *     a worker start has pinned allocates it on its own NUMA node. A
+ *     worker the pool shrank away from exits after its current task.
+ */
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct pool *p = w->pool;
+    struct task t;
+
+    Pthread_detach(Pthread_self());
+    if (p->start != NULL)
+        p->start(w->id);
+    if (w->fresh)
+        deque_init(&p->deques[w->id]);
+    V(w->ready);
+    while (1) {
+        next_task(p, w->id, &t);
+        t.fn(t.arg);
+        if (w->id >= p->nworkers && retire(p, w->id))
+            break;
+    }
+    Free(w);
+    return NULL;
+}
+
+struct pool *pool_create(int nworkers, int max_queued) {
+    return pool_create_on(nworkers, max_queued, NULL);
+}
+
+/* pool_create_on - returns once every worker is ready for tasks */
+struct pool *pool_create_on(int nworkers, int max_queued, pool_start_fn start) {
+    struct pool *p = Malloc(sizeof(struct pool));
+
+    p->nworkers = 0;
+    p->ndeques = 0;
+    p->next = 0;
+    p->queued = 0;
+    p->max_queued = max_queued;
+    p->start = start;
+    p->deques = Malloc(POOL_MAX_WORKERS * sizeof(struct deque));
+    p->alive = Calloc(POOL_MAX_WORKERS, 1);
+    pthread_mutex_init(&p->resize_lock, NULL);
+    Sem_init(&p->items, 0, 0);
+    if (pool_resize(p, nworkers) < 0)
+        app_error("pool_create: bad worker count");
+    return p;
+}
+
+/*
+ * pool_resize - start threads for the slots up to nworkers that have
+ *     none, or lower nworkers and let the workers above it retire. A
+ *     retired worker that is idle only notices once it has taken one
+ *     more task. Returns once every new worker is ready for tasks.
+ */
+int pool_resize(struct pool *p, int nworkers) {
+    struct worker *w;
+    pthread_t tid;
+    sem_t ready;
+    int i, started = 0;
+
+    if (nworkers < 1 || nworkers > POOL_MAX_WORKERS)
+        return -1;
+    pthread_mutex_lock(&p->resize_lock);
+    Sem_init(&ready, 0, 0);
+    for (i = p->nworkers; i < nworkers; i++) {
+        if (p->alive[i])
+            continue;
+        w = Malloc(sizeof(struct worker));
+        w->pool = p;
+        w->id = i;
+        w->fresh = i >= p->ndeques;
+        w->ready = &ready;
+        p->alive[i] = 1;
+        Pthread_create(&tid, NULL, worker_thread, w);
+        started++;
+    }
+    for (i = 0; i < started; i++)
+        P(&ready);
+    sem_destroy(&ready);
+    if (nworkers > p->ndeques)
+        p->ndeques = nworkers;
+    p->nworkers = nworkers;
+    pthread_mutex_unlock(&p->resize_lock);
+    return 0;
+}
+
+int pool_size(struct pool *p) {
+    return p->nworkers;
+}
+
+void pool_set_max_queued(struct pool *p, int max_queued) {
+    p->max_queued = max_queued;
+}
+
+int pool_max_queued(struct pool *p) {
+    return p->max_queued;
+}
+
+/* push - queue a task that has already been counted in p->queued */
+static void push(struct pool *p, pool_fn fn, void *arg) {
+    struct task t;
+    unsigned i = __sync_fetch_and_add(&p->next, 1);
+
+    t.fn = fn;
+    t.arg = arg;
+    deque_push(&p->deques[i % p->nworkers], t);
+    V(&p->items);
+}
+
+void pool_submit(struct pool *p, pool_fn fn, void *arg) {
+    __sync_fetch_and_add(&p->queued, 1);
+    push(p, fn, arg);
+}
+
+int pool_try_submit(struct pool *p, pool_fn fn, void *arg) {
+    if (__sync_add_and_fetch(&p->queued, 1) > p->max_queued &&
+            p->max_queued > 0) {
+        __sync_fetch_and_sub(&p->queued, 1);
+        return -1;
+    }
+    push(p, fn, arg);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * pool.h - fixed-size worker pool with per-worker deques and work stealing
+ *
+ * The accept loop hands each connection to pool_submit, which pushes it
+ * onto one worker's deque in round-robin order. A worker pops its own
+ * deque from the bottom and, when that is empty, steals the oldest task
+ * from the top of another worker's deque, so a worker stuck on a slow
+ * request cannot strand the connections queued behind it.
+ *
+ * A pool may bound the number of tasks queued across its deques, so that
+ * one class of work cannot build an unbounded backlog; pool_try_submit
+ * then refuses new work instead of queueing it.
+ *
+ * Both the worker count and the bound can be changed while the pool is
+ * serving, e.g. from tiny's admin socket.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+typedef void (*pool_fn)(void *arg);
+
+/* Runs first on each new worker thread; id counts the workers from 0 */
+typedef void (*pool_start_fn)(int id);
+
+struct pool;
+
+/* Starts nworkers detached worker threads; max_queued 0 means unbounded */
+struct pool *pool_create(int nworkers, int max_queued);
+
+/*
+ * Like pool_create, but each worker calls start(id) before it takes any
+ * task, e.g. to pin itself to a CPU; start may be NULL
+ */
+struct pool *pool_create_on(int nworkers, int max_queued, pool_start_fn start);
+
+/*
+ * Grows or shrinks the pool to nworkers (1 to 1024). Removed workers
+ * finish what they are running first; their queued tasks are stolen by
+ * the others. Returns -1 if nworkers is out of range.
+ */
+int pool_resize(struct pool *p, int nworkers);
+
+int pool_size(struct pool *p);
+
+/* Changes the bound of pool_try_submit; 0 means unbounded */
+void pool_set_max_queued(struct pool *p, int max_queued);
+
+int pool_max_queued(struct pool *p);
+
+/* Queues fn(arg) to run on some worker, regardless of the bound */
+void pool_submit(struct pool *p, pool_fn fn, void *arg);
+
+/* Queues fn(arg) unless max_queued tasks are waiting; then returns -1 */
+int pool_try_submit(struct pool *p, pool_fn fn, void *arg);
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,162 @@
+/*
+ * prefork.c - worker processes and their shared segment (-m prefork)
+ */
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "prefork.h"
+#include "timer.h"
+
+#define RESTART_BACKOFF_MS 1000 /* a worker that lived less waits this long */
+
+struct prefork_shm *prefork;
+int prefork_id = -1;
+
+static long started[PREFORK_MAX];  /* ms clock value of each fork */
+
+/* lock - take the directory lock, repairing it if its holder died */
+static void lock(void) {
+    if (pthread_mutex_lock(&prefork->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&prefork->lock);
+}
+
+static void unlock(void) {
+    pthread_mutex_unlock(&prefork->lock);
+}
+
+/* spawn - fork the worker of slot id; the child never returns */
+static void spawn(int id, void (*work)(int id), sigset_t *mask) {
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = Fork()) == 0) {
+        prefork_id = id;
+        /* Workers go with the parent, which alone could replace them */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            exit(0);
+        pthread_sigmask(SIG_UNBLOCK, mask, NULL);
+        work(id);
+        exit(0);
+    }
+    prefork->workers[id].pid = pid;
+    started[id] = clock_ms();
+}
+
+/*
+ * retire - account for the dead worker of slot id: fold its counters
+ *     into the totals and clear its bit in the directory
+ */
+static void retire(int id) {
+    struct prefork_worker *w = &prefork->workers[id];
+    uint64_t bit = (uint64_t)1 << id;
+    int i;
+
+    for (i = 0; i < PREFORK_COUNTERS; i++) {
+        prefork->retired[i] += w->counters[i];
+        w->counters[i] = 0;
+    }
+    lock();
+    for (i = 0; i < prefork->nfunctions; i++)
+        prefork->functions[i].where &= ~bit;
+    unlock();
+    w->restarts++;
+}
+
+/* reap - replace every worker that has exited */
+static void reap(void (*work)(int id), sigset_t *mask) {
+    int id, status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (id = 0; id < prefork->nworkers; id++)
+            if (prefork->workers[id].pid == pid)
+                break;
+        if (id == prefork->nworkers)
+            continue;
+        if (WIFSIGNALED(status))
+            printf("prefork: worker %d (pid %d) killed by signal %d\n", id,
+                    pid, WTERMSIG(status));
+        else
+            printf("prefork: worker %d (pid %d) exited with status %d\n", id,
+                    pid, WEXITSTATUS(status));
+        retire(id);
+        if (clock_ms() - started[id] < RESTART_BACKOFF_MS)
+            usleep(RESTART_BACKOFF_MS * 1000);
+        spawn(id, work, mask);
+    }
+    fflush(stdout);
+}
+
+void prefork_run(int nworkers, void (*work)(int id), void (*report)(void)) {
+    pthread_mutexattr_t attr;
+    sigset_t mask;
+    int i, sig;
+
+    if (nworkers < 1 || nworkers > PREFORK_MAX)
+        app_error("prefork: bad worker count");
+    prefork = mmap(NULL, sizeof(struct prefork_shm), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (prefork == MAP_FAILED)
+        unix_error("mmap error");
+    prefork->nworkers = nworkers;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&prefork->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    /* Blocked before the first fork, so no exit goes unnoticed */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    for (i = 0; i < nworkers; i++)
+        spawn(i, work, &mask);
+    while (1) {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1)
+            report();
+        else
+            reap(work, &mask);
+    }
+}
+
+void prefork_note(char *name, int loaded) {
+    struct prefork_function *f = NULL;
+    uint64_t bit;
+    int i;
+
+    if (prefork_id < 0 || strlen(name) >= PREFORK_NAME)
+        return;
+    bit = (uint64_t)1 << prefork_id;
+    lock();
+    for (i = 0; i < prefork->nfunctions; i++)
+        if (!strcmp(prefork->functions[i].name, name)) {
+            f = &prefork->functions[i];
+            break;
+        }
+    if (f == NULL && loaded && prefork->nfunctions < PREFORK_FUNCTIONS) {
+        f = &prefork->functions[prefork->nfunctions++];
+        strcpy(f->name, name);
+        f->where = 0;
+    }
+    if (f != NULL) {
+        if (loaded)
+            f->where |= bit;
+        else
+            f->where &= ~bit;
+    }
+    unlock();
+}
+
+int prefork_directory(struct prefork_function *out) {
+    int n;
+
+    lock();
+    n = prefork->nfunctions;
+    memcpy(out, prefork->functions, n * sizeof(struct prefork_function));
+    unlock();
+    return n;
+}
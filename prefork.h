@@ -0,0 +1,68 @@
+/*
+ * prefork.h - worker processes and their shared segment (-m prefork)
+ *
+ * In prefork mode the parent opens the listening sockets, maps one
+ * shared anonymous segment and forks the workers, which all accept on
+ * the same sockets. A function that crashes takes down only the worker
+ * that ran it: the parent reaps it, folds its counters into the retired
+ * totals, drops it from the function directory and forks a replacement
+ * into the same slot. Workers are forked once, not per request as in
+ * tiny_baseline, so a request pays for no fork.
+ *
+ * The segment holds each worker's counters, which only that worker
+ * writes, and a directory of the functions loaded in some worker, each
+ * with a bit per worker that has it. The directory is guarded by a
+ * robust process-shared mutex, so a worker dying while it holds the lock
+ * does not wedge the others.
+ */
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define PREFORK_MAX 64          /* workers; one directory bit each */
+#define PREFORK_COUNTERS 16     /* longs of counters per worker */
+#define PREFORK_FUNCTIONS 256   /* directory entries */
+#define PREFORK_NAME 64         /* longer function names are not listed */
+
+struct prefork_worker {
+    pid_t pid;
+    int restarts;               /* times this slot's worker was replaced */
+    long counters[PREFORK_COUNTERS];
+} __attribute__((aligned(64)));
+
+struct prefork_function {
+    char name[PREFORK_NAME];
+    uint64_t where;             /* bit i: loaded in worker i */
+};
+
+struct prefork_shm {
+    int nworkers;
+    long retired[PREFORK_COUNTERS];     /* summed counters of dead workers */
+    pthread_mutex_t lock;               /* guards the directory */
+    int nfunctions;
+    struct prefork_function functions[PREFORK_FUNCTIONS];
+    struct prefork_worker workers[PREFORK_MAX];
+};
+
+/* The segment, or NULL outside prefork mode */
+extern struct prefork_shm *prefork;
+
+/* This process's worker slot; -1 in the parent and outside prefork mode */
+extern int prefork_id;
+
+/*
+ * Forks nworkers workers running work(id), which should never return,
+ * and supervises them: a worker that exits is replaced. SIGUSR1 calls
+ * report in the parent. Never returns.
+ */
+void prefork_run(int nworkers, void (*work)(int id), void (*report)(void));
+
+/* In a worker: records that it loaded (1) or evicted (0) function name */
+void prefork_note(char *name, int loaded);
+
+/* Copies the directory, under its lock; returns the entry count */
+int prefork_directory(struct prefork_function *out);
+
+#endif /* __PREFORK_H__ */
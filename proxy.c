@@ -3,8 +3,15 @@
  * Authors: Vijay Jayaram (vijayj@andrew.cmu.edu)
  * 			Anand Pattabiraman (apattabi@andrew.cmu.edu)
  *
- * Our proxy server creates and detaches a thread for each client GET request.
+ * Our proxy server hands each client connection to a fixed pool of worker
+ * threads (see pool.h); idle workers steal queued connections from busy ones.
  * While worker threads process requests, the main thread waits for new ones.
+ * With -m coro, each connection instead runs the same handler as a coroutine
+ * (see coro.h) on one of -n epoll scheduler threads, suspending whenever the
+ * client or server socket would block.
+ * A client gets -H seconds to send its request line and -B seconds for the
+ * rest of the exchange; a watchdog (see timer.h) shuts down both sockets of
+ * one that runs over, which fails whatever read or write was stuck on them.
  * If the request is for less than MAX_OBJECT_SIZE amount of data, we cache it.
  * Our cache is a FIFO linked list; here, LRU eviction is NOT implemented.
  * A readers-writer lock is used to handle multiple calls to read/write in cache.
@@ -14,11 +21,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "csapp.h"
+#include "pool.h"
+#include "coro.h"
+#include "timer.h"
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_HEADERS_SIZE 50000
 #define MAX_OBJECT_SIZE 102400
 #define GIVEN_PORT 32726
+#define DEFAULT_WORKERS 16
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 60
 
 /* Here, we implement our cache as a queue of cache objects. 
  * 		key = 'hostname + path'
@@ -54,6 +67,17 @@ struct cache_queue* cache;
 
 sem_t mutex;
 
+/* One client connection and the server connection opened for it */
+struct session {
+	struct timer timer;
+	int clientfd;
+	int serverfd;	/* -1 until connected */
+};
+
+struct wheel *watchdog;
+int header_ms = DEFAULT_HEADER_TIMEOUT * 1000;
+int body_ms = DEFAULT_BODY_TIMEOUT * 1000;
+
 /* 	Cache functions
  *
  * 		void init_cache():
@@ -91,21 +115,24 @@ void unlock();
 
 
 /*Parses request*/
-void* handle_request(void* fd_addr);
-void parseit(void* fd_addr);
+void handle_request(void* fd_addr);
+void parseit(int fd);
+
+/*Watchdog callback: shuts down the sockets of a session past its deadline*/
+void expire_session(struct timer *t);
 
 /*In the case of exit, closes two fd's*/
 void cleanup(int firstfd, int secondfd);
 
 /*Forwards the client request to the appropriate host*/
-int forwardit(char * host, char * path, int port, int fd, rio_t *rio, char* key); 
+int forwardit(char * host, char * path, int port, struct session *sn,
+		rio_t *rio, char* key); 
 
 /*Extracts the additional request headers.*/
-void read_requesthdrs(rio_t * client_rio, char * full_request, char *host, 
-                        int hostfd);
+void read_requesthdrs(char * full_request, char *host);
 
 /*Extracts the additional response headers.*/
-void read_responsehdrs(rio_t *rp, int clientfd, char* key);
+int read_responsehdrs(rio_t *rp, int clientfd, char* key);
 
 /*Global constants regarding client*/
 static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
@@ -116,24 +143,57 @@ static const char *proxy_s = "Proxy-Connection: close\r\n";
 static const char *finish_request = "\r\n";
 int connectioncount = 0;
 
+void usage() {
+	fprintf(stderr, "usage: ./proxy [-m pool|coro] [-w workers] [-n threads] "
+			"[-H header_secs] [-B body_secs] <port>\n");
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
-    int listenfd, port, *connfd;
+    int listenfd, port, *connfd, opt;
+    int nworkers = DEFAULT_WORKERS, use_coro = 0, nthreads = 1;
 	socklen_t clientlen = sizeof(struct sockaddr_in);
     struct sockaddr_in clientaddr;
-	pthread_t tid;
+	struct pool *workers;
 
     printf("%s%s%s", user_agent, accept_s, accept_encoding);
 
     Signal(SIGPIPE, SIG_IGN);
 
     /* Check command line args */
-	if(argc == 1) port = GIVEN_PORT;
-	else if (argc == 2) port = atoi(argv[1]);
-	else {
-		fprintf(stderr, "usage: ./proxy <port>\n");
-		exit(1);
+	while ((opt = getopt(argc, argv, "m:w:n:H:B:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "coro"))
+				use_coro = 1;
+			else if (strcmp(optarg, "pool"))
+				usage();
+			break;
+		case 'w':
+			if ((nworkers = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'n':
+			if ((nthreads = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'H':
+			if ((header_ms = atoi(optarg) * 1000) < 0)
+				usage();
+			break;
+		case 'B':
+			if ((body_ms = atoi(optarg) * 1000) < 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
 	}
+	if(optind == argc) port = GIVEN_PORT;
+	else if (optind == argc - 1) port = atoi(argv[optind]);
+	else
+		usage();
 		
 	if (port < 0 || port > 65535) {
 		fprintf(stderr, "Port Invalid: Must be between 0 and 65535\n");
@@ -143,19 +203,24 @@ int main(int argc, char **argv)
 	sem_init(&mutex, 0 , 1);
     init_cache();	
     listenfd = Open_listenfd(port);
+	watchdog = wheel_watchdog();
+	if (use_coro)
+		coro_run(&listenfd, 1, nthreads, parseit);
+    workers = pool_create(nworkers, 0);
     while (1) {
         clientlen = sizeof(clientaddr);
 		connfd = Malloc(sizeof(int));
         *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
         printf("Connection made. #%d\n", connectioncount++);
-		Pthread_create(&tid, NULL, handle_request, (void*) connfd);
+		pool_submit(workers, handle_request, connfd);
     }
     return 0;
 }
-/*Small wrapper to parse/forward the request that fits Pthread specs*/
-void* handle_request(void* connfd) {
-	parseit(connfd);
-	return NULL;
+/*Small wrapper to parse/forward the request that fits pool_fn specs*/
+void handle_request(void* connfd) {
+	int fd = *((int*) connfd);
+	Free(connfd);
+	parseit(fd);
 }
 
 void request_error(char *msg) /* application error */
@@ -171,9 +236,7 @@ void request_error(char *msg) /* application error */
  *      Note: 
  *          <> - indicates optional fields.
  */
-void parseit(void* fd_addr) {
-	int fd = *((int*) fd_addr);
-	Free(fd_addr);
+void parseit(int fd) {
     int port = -1;
     int numParsed;
     char buf[MAXLINE] = {0}; 
@@ -181,23 +244,35 @@ void parseit(void* fd_addr) {
     char host[MAXLINE] = {0};
     char path[MAXLINE] = {0};
     char version[MAXLINE] = {0};
-    char protocol[7] = {0};
+    char protocol[8] = {0};
     const char* http = "http://";
     const char* versIntro = "HTTP/";
     char* movingbuf;
-
-	Pthread_detach(Pthread_self());
+    struct session sn;
 
     rio_t rio;
     Rio_readinitb(&rio, fd);
 
+    sn.clientfd = fd;
+    sn.serverfd = -1;
+    timer_init(&sn.timer, expire_session, &sn);
+    wheel_arm(watchdog, &sn.timer, header_ms);
+
     /* Reads the GET request from the fd */
-    Rio_readlineb(&rio, buf, MAXLINE);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        request_error("Error reading request.");
+		wheel_cancel(&sn.timer);
+		cleanup(fd, -1);
+        return;
+    }
+    /* The rest of the exchange runs against the body deadline */
+    wheel_arm(watchdog, &sn.timer, body_ms);
 
     if((numParsed = sscanf(buf, "%s %s %s", method, host, version)) < 2){
         request_error("Error parsing request: Not enough arguments.");
         printf("%s\n", buf);
         printf("Numparsed: %d\n", numParsed);
+		wheel_cancel(&sn.timer);
 		cleanup(fd, -1);
         return;
     }
@@ -206,6 +281,7 @@ void parseit(void* fd_addr) {
     strncpy(protocol, version, 5);
     if (strcmp(protocol, versIntro)) {
         request_error("Error parsing request: Invalid HTTP version.");
+		wheel_cancel(&sn.timer);
 		cleanup(fd, -1);
 		return;
     }
@@ -213,6 +289,7 @@ void parseit(void* fd_addr) {
     /* Checks that it's a GET request */
     if (strcasecmp(method, "GET")) {
         request_error("Error parsing request: Not a GET request.");
+		wheel_cancel(&sn.timer);
 		cleanup(fd, -1);
         return;
     }
@@ -221,6 +298,7 @@ void parseit(void* fd_addr) {
     strncpy(protocol, host, 7);
     if (strcmp(protocol, http)) {
         request_error("Error parsing request: Not http:// domain.");
+		wheel_cancel(&sn.timer);
 		cleanup(fd, -1);
         return;
     }
@@ -229,6 +307,7 @@ void parseit(void* fd_addr) {
     movingbuf = strchr((host + 7), '/');
     if(movingbuf == NULL){
         request_error("Error parsing request: No path found.");
+		wheel_cancel(&sn.timer);
 		cleanup(fd, -1);
         return;
     }
@@ -242,6 +321,7 @@ void parseit(void* fd_addr) {
         printf("%s\n", movingbuf + 1);
         port = atoi(movingbuf + 1);
         if((port < 0) || (port > 65535)){
+			wheel_cancel(&sn.timer);
 			cleanup(fd, -1);
             request_error("Error parsing request: Invalid port found.");
             return; 
@@ -264,9 +344,10 @@ void parseit(void* fd_addr) {
 
 	/*If requested object not in cache, forward request to host*/
 	if (search_cache(key, fd)) {
-		forwardit(host, path, port, fd, &rio, key);
+		forwardit(host, path, port, &sn, &rio, key);
 	}
-	cleanup(fd, -1);
+	wheel_cancel(&sn.timer);
+	cleanup(fd, sn.serverfd);
 	Free(key);
     return;
 }
@@ -276,9 +357,11 @@ void parseit(void* fd_addr) {
  *          host should be http://host...
  *          path should be /...
  *          port should be -1 if no port found, otherwise port in url
- *          fd should the the connection file descriptor
+ *          sn holds the client connection; the server one is left in it
+ *          for the caller to close
  */
-int forwardit(char *host, char *path, int port, int fd, rio_t *rio, char* key){
+int forwardit(char *host, char *path, int port, struct session *sn,
+		rio_t *rio, char* key){
     int hostfd;
     int pathlength;
     char buf[MAXLINE] = {0};
@@ -300,34 +383,36 @@ int forwardit(char *host, char *path, int port, int fd, rio_t *rio, char* key){
     }
 
     /* Open the connection to the web server using the host. */
-    hostfd = Open_clientfd(host+7, port);
+    hostfd = open_clientfd(host+7, port);
     if(hostfd < 0){
 		request_error("Error getting host.\n");
-		cleanup(fd, hostfd);
         return hostfd;
     }
+    /* Hand hostfd to the watchdog: once cancelled the callback is not
+     * running, and re-arming takes the lock that it runs under */
+    wheel_cancel(&sn->timer);
+    sn->serverfd = hostfd;
+    wheel_arm(watchdog, &sn->timer, body_ms);
     
     /* Write the request to the server */
     strcpy(full_request, buf);
            // printf("Formed string to send: %s\n", buf);  
 
     /* This function sends all the appropriate headers to the server. */
-    read_requesthdrs(rio, full_request, host + 7, hostfd);
+    read_requesthdrs(full_request, host + 7);
     
     /* Use for debugging: Prints the fully formed request. */
     //printf("\n\nFull Request:\n\n%s\n\n", full_request);
 
     /* Send all of it as one big request*/
-    Rio_writen(hostfd, full_request, strlen(full_request));
+    if (rio_writen(hostfd, full_request, strlen(full_request)) < 0)
+        return -1;
 
     /* Reads the response from the hostfd (the host server) */
     Rio_readinitb(&hostrio, hostfd);
 
     /* This function extracts all of the appropriate response headers. */
-    read_responsehdrs(&hostrio, fd, key);
-    Close(hostfd);
-
-    return 0;
+    return read_responsehdrs(&hostrio, sn->clientfd, key);
 }
     
 /*
@@ -337,8 +422,7 @@ int forwardit(char *host, char *path, int port, int fd, rio_t *rio, char* key){
  *                    Ignore all of the headers sent by browser and send our 
  *                    own.
  */
-void read_requesthdrs(rio_t * client_rio, char *full_request,
-                       char *host, int hostfd)
+void read_requesthdrs(char *full_request, char *host)
 {
     char hdrHost[MAXLINE] = {0};
 
@@ -360,8 +444,9 @@ void read_requesthdrs(rio_t * client_rio, char *full_request,
  *  read_responsehdrs - read and parse HTTP request headers
  *                      at this point, the HTTP 200.OK has already been read
  *                      out of the buffer.
+ *                      Returns -1, caching nothing, if either side fails.
  *   */
-void read_responsehdrs(rio_t *rp, int clientfd, char* key)
+int read_responsehdrs(rio_t *rp, int clientfd, char* key)
 {
     char buf[MAXLINE];
     char content[10000];
@@ -372,35 +457,40 @@ void read_responsehdrs(rio_t *rp, int clientfd, char* key)
 	int size = 0;
     int numbytesread = 0;
 
-    numbytesread = Rio_readlineb(rp, buf, MAXLINE);
-    if(numbytesread >= 0){
-        size = numbytesread;
-	    strncpy(headersbuf, buf, numbytesread);
-        Rio_writen(clientfd, buf, numbytesread);
-    }
+    numbytesread = rio_readlineb(rp, buf, MAXLINE);
+    if(numbytesread <= 0)
+        return -1;
+    size = numbytesread;
+    strncpy(headersbuf, buf, numbytesread);
+    if (rio_writen(clientfd, buf, numbytesread) < 0)
+        return -1;
 
     while(strcmp(buf, "\r\n")) {
-        numbytesread = Rio_readlineb(rp, buf, MAXLINE);
+        numbytesread = rio_readlineb(rp, buf, MAXLINE);
 
-        if(numbytesread < 0){break;}
+        if(numbytesread <= 0)
+            return -1;
 
-		if ((headers_buf_valid) && (size <= MAX_HEADERS_SIZE)){
+		if (headers_buf_valid && size + numbytesread <= MAX_HEADERS_SIZE){
 			memcpy(headersbuf+size, buf, numbytesread); 
         }
         else
             headers_buf_valid = 0;
 
         size += numbytesread;
-        Rio_writen(clientfd, buf, numbytesread);
+        if (rio_writen(clientfd, buf, numbytesread) < 0)
+            return -1;
     }
 
     size = 0; 
-    while((numbytesread = Rio_readnb(rp, content, 10000))){
-        if(numbytesread < 0){ break; }
+    while((numbytesread = rio_readnb(rp, content, 10000))){
+        if(numbytesread < 0)
+            return -1;
 
-        Rio_writen(clientfd, content, numbytesread);
+        if (rio_writen(clientfd, content, numbytesread) < 0)
+            return -1;
 
-		if (cache_buf_valid && (size <= MAX_OBJECT_SIZE)){
+		if (cache_buf_valid && size + numbytesread <= MAX_OBJECT_SIZE){
 			memcpy(cachebuf+size, content, numbytesread);
         }
         else{
@@ -421,14 +511,21 @@ void read_responsehdrs(rio_t *rp, int clientfd, char* key)
         }
         */
 	}
-    return;
+    return 0;
+}
+
+void expire_session(struct timer *t) {
+	struct session *sn = t->arg;
+
+	shutdown(sn->clientfd, SHUT_RDWR);
+	if (sn->serverfd >= 0)
+		shutdown(sn->serverfd, SHUT_RDWR);
 }
 
-/*Frees up descriptors in use*/
+/*Frees up descriptors in use; the worker thread lives on*/
 void cleanup(int firstfd, int secondfd) {
 	if (firstfd >= 0) Close(firstfd);
 	if (secondfd >= 0) Close(secondfd);
-	Pthread_exit(NULL);
 }
 
 /******* CACHE FUNCTIONS ******/
@@ -478,25 +575,47 @@ void add_to_cache(char* key, char* hdrs, char* data, int size) {
 }
 
 int search_cache(char* key, int clientfd) {
+	char *hdrs, *data;
+	int size;
+
 	read_lock();
 	cache_obj cur = cache->front->next;
 	cache_obj prev = cache->front;
 	for (; cur; cur = cur->next) {
 		/*If next matches key, object is found */
 		if (!strcmp(cur->key,key)) {
-			/*Serve object to client*/
-			Rio_writen(clientfd, cur->hdrs, strlen(cur->hdrs));
-		    Rio_writen(clientfd, cur->data, cur->size);
-			P(&mutex);
+			/* Copy the object out: writing to the client may block, or
+			 * suspend a coroutine, and must not happen under the lock */
+			hdrs = strdup(cur->hdrs);
+			size = cur->size;
+			data = Malloc(size);
+			memcpy(data, cur->data, size);
+			/* Drop the read lock before taking mutex; another hit may
+			 * already hold mutex and be waiting for the write lock. */
 			unlock();
-			/*Crazy stuff here*/
+			P(&mutex);
 			write_lock();
-			prev->next = cur->next;
-			cache->back->next = cur;
-			cache->back = cur;
-			cur->next = NULL;
+			/* The object may have moved or been evicted meanwhile */
+			for (prev = cache->front, cur = prev->next; cur;
+					prev = cur, cur = cur->next) {
+				if (!strcmp(cur->key, key)) {
+					if (cur != cache->back) {
+						prev->next = cur->next;
+						cache->back->next = cur;
+						cache->back = cur;
+						cur->next = NULL;
+					}
+					break;
+				}
+			}
 			unlock();
 			V(&mutex);
+
+			/*Serve object to client; a failed write just ends it*/
+			if (rio_writen(clientfd, hdrs, strlen(hdrs)) >= 0)
+				rio_writen(clientfd, data, size);
+			free(hdrs);
+			Free(data);
 			return 0;
 		}
 		prev = cur;
@@ -0,0 +1,94 @@
+/*
+ * shm.h - shared-memory call rings between tiny and same-host callers
+ *
+ * A caller creates a memfd holding one struct shm_ring, maps it and
+ * passes the descriptor to tiny over tiny's -r AF_UNIX socket with
+ * SCM_RIGHTS. From then on calls to lib/ functions go through the ring's
+ * slots with no socket in between:
+ *
+ *   caller                              tiny's ring thread
+ *   FREE -> CLAIMED (CAS)
+ *   write "function\0args\0" to data
+ *   state = REQUEST, bump doorbell  ->  sees REQUEST, state = BUSY
+ *                                       runs the function
+ *   sees DONE, reads status, data   <-  writes status, data; state = DONE
+ *   state = FREE
+ *
+ * Both sides spin on the shared words for a while (if there is a CPU to
+ * spare) before sleeping on them with a futex; a side only makes the
+ * wake-up syscall when the other has said it is asleep (sleeping,
+ * waiting). So while calls keep coming, neither side enters the kernel
+ * to pass a request or a reply. A caller that finds every slot taken
+ * sleeps the same way until one of its own calls frees a slot.
+ * The control socket stays open for the life of the ring; tiny drops
+ * the ring once it is closed.
+ */
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define SHM_MAGIC 0x796e6974    /* "tiny" */
+#define SHM_SLOTS 16
+#define SHM_DATA 65536          /* request, then response, bytes per slot */
+#define SHM_SPIN 20000          /* polls before sleeping, given a spare CPU */
+
+/* Slot states */
+#define SHM_FREE 0
+#define SHM_CLAIMED 1           /* a caller is writing a request */
+#define SHM_REQUEST 2           /* ready for tiny */
+#define SHM_BUSY 3              /* tiny is running it */
+#define SHM_DONE 4              /* the response is ready for the caller */
+
+struct shm_slot {
+    uint32_t state;             /* futex word for the caller */
+    uint32_t waiting;           /* the caller sleeps on state */
+    int32_t deadline_ms;        /* caller's budget; 0 = function's default */
+    int32_t status;             /* 200, 404, 503, or 500 if it overflowed */
+    uint32_t len;               /* bytes of data in use */
+    char data[SHM_DATA];
+} __attribute__((aligned(64)));
+
+struct shm_ring {
+    uint32_t magic;
+    uint32_t nslots;
+    uint32_t doorbell __attribute__((aligned(64)));  /* bumped per request */
+    uint32_t sleeping;          /* tiny sleeps on doorbell */
+    struct shm_slot slots[SHM_SLOTS];
+};
+
+/* shm_wait - sleep while *word is val, for at most ms if ms > 0 */
+static inline void shm_wait(uint32_t *word, uint32_t val, long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    syscall(SYS_futex, word, FUTEX_WAIT, val, ms > 0 ? &ts : NULL, NULL, 0);
+}
+
+static inline void shm_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * shm_spin - how long to poll before sleeping. With one CPU the other
+ *     side cannot make progress while we spin, so sleep straight away.
+ */
+static inline long shm_spin(void) {
+    static long spin = -1;
+
+    if (spin < 0)
+        spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    return spin;
+}
+
+/* shm_relax - pause briefly inside a spin loop */
+static inline void shm_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif /* __SHM_H__ */
@@ -0,0 +1,130 @@
+/*
+ * shmcall.c - closed-loop load generator for tiny's shared-memory rings
+ *
+ * Each thread attaches its own ring to tiny's -r socket and calls
+ * function(args) back to back through libtinyshm, recording latencies.
+ * It prints the same summary line as loadgen, so the numbers line up
+ * with HTTP over TCP and over AF_UNIX:
+ *
+ *     <requests> reqs <errors> errors <shed> shed <rate> req/s p50 <us> p99 <us>
+ */
+#include "csapp.h"
+#include "tinyshm.h"
+
+struct caller {
+    pthread_t tid;
+    long nreqs;
+    long nerrs;
+    long nshed;
+    long *lat;          /* latencies in microseconds */
+    long nlat, caplat;
+};
+
+static char *path, *function, *args;
+static double stop_at;
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *caller_thread(void *arg) {
+    struct caller *cl = arg;
+    struct tinyshm *t;
+    char buf[MAXBUF];
+    size_t len;
+    double start;
+    int status;
+
+    if ((t = tinyshm_open(path)) == NULL) {
+        fprintf(stderr, "tinyshm_open %s: %s\n", path, strerror(errno));
+        cl->nerrs++;
+        return NULL;
+    }
+    while ((start = now()) < stop_at) {
+        len = sizeof(buf);
+        status = tinyshm_call(t, function, args, 0, buf, &len);
+        if (status == 503) {
+            cl->nshed++;
+            continue;
+        }
+        if (status != 200) {
+            cl->nerrs++;
+            if (status < 0)
+                break;
+            continue;
+        }
+        cl->nreqs++;
+        if (cl->nlat == cl->caplat) {
+            cl->caplat = cl->caplat ? 2 * cl->caplat : 4096;
+            cl->lat = Realloc(cl->lat, cl->caplat * sizeof(long));
+        }
+        cl->lat[cl->nlat++] = (long)((now() - start) * 1e6);
+    }
+    tinyshm_close(t);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] <ring_socket> "
+            "<function> [args]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct caller *callers;
+    long nreqs = 0, nerrs = 0, nshed = 0, nlat = 0, *lat;
+    int i, opt, nthreads = 1;
+    double secs = 5, start;
+
+    while ((opt = getopt(argc, argv, "t:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            if ((nthreads = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((secs = atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 && optind != argc - 3)
+        usage(argv[0]);
+    path = argv[optind];
+    function = argv[optind + 1];
+    args = optind + 2 < argc ? argv[optind + 2] : "";
+
+    callers = Calloc(nthreads, sizeof(struct caller));
+    start = now();
+    stop_at = start + secs;
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&callers[i].tid, NULL, caller_thread, &callers[i]);
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(callers[i].tid, NULL);
+        nreqs += callers[i].nreqs;
+        nerrs += callers[i].nerrs;
+        nshed += callers[i].nshed;
+    }
+    secs = now() - start;
+
+    lat = Malloc((nreqs + 1) * sizeof(long));
+    for (i = 0; i < nthreads; i++) {
+        memcpy(lat + nlat, callers[i].lat, callers[i].nlat * sizeof(long));
+        nlat += callers[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(long), cmp_long);
+    printf("%ld reqs %ld errors %ld shed %.0f req/s p50 %ld us p99 %ld us\n",
+            nreqs, nerrs, nshed, nreqs / secs,
+            nlat ? lat[nlat / 2] : 0, nlat ? lat[nlat * 99 / 100] : 0);
+    return 0;
+}
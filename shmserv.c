@@ -0,0 +1,205 @@
+/*
+ * shmserv.c - tiny's side of the shared-memory call rings
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "shmserv.h"
+#include "shm.h"
+#include "conn.h"
+#include "upgrade.h"
+
+#define CHECK_MS 1000   /* how often a sleeping ring looks for its caller */
+
+struct attach {
+    int listenfd;
+    shm_handler handler;
+};
+
+/* One attached caller */
+struct ringconn {
+    int ctlfd;              /* the caller's control socket */
+    struct shm_ring *ring;
+    shm_handler handler;
+};
+
+/* recv_fd - receive the ring's memfd over SCM_RIGHTS; -1 if none came */
+static int recv_fd(int sock) {
+    char byte, cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* caller_gone - whether the caller closed its control socket */
+static int caller_gone(int ctlfd) {
+    char byte;
+    ssize_t n = recv(ctlfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/*
+ * serve_slot - run one request. The request is copied out of the shared
+ *     slot before it is parsed, so a caller scribbling on the slot
+ *     cannot change it in between.
+ */
+static void serve_slot(struct ringconn *rc, struct shm_slot *s, int capfd) {
+    char function_name[MAXLINE], args[MAXLINE];
+    size_t len = s->len, n, size;
+    int status = 400;
+
+    if (len <= SHM_DATA) {
+        n = strnlen(s->data, len);
+        if (n < MAXLINE && n < len) {
+            memcpy(function_name, s->data, n);
+            function_name[n] = '\0';
+            len -= n + 1;
+            if ((size = strnlen(s->data + n + 1, len)) < MAXLINE && size < len) {
+                memcpy(args, s->data + n + 1, size);
+                args[size] = '\0';
+                status = rc->handler(function_name, args, s->deadline_ms, capfd);
+            }
+        }
+    }
+    size = conn_capture_size(capfd);
+    if (status == 200 && size > SHM_DATA)
+        status = 500;
+    s->len = conn_take_capture(capfd, s->data, status == 200 ? size : 0);
+    s->status = status;
+    __atomic_store_n(&s->state, SHM_DONE, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST))
+        shm_wake(&s->state);
+}
+
+/*
+ * ring_thread - poll the ring for requests; after shm_spin() empty polls
+ *     say so in sleeping and sleep on the doorbell until a caller rings
+ *     it. The doorbell is read before each poll, so a request that lands
+ *     after the poll changes it and the futex wait returns at once.
+ */
+static void *ring_thread(void *arg) {
+    struct ringconn *rc = arg;
+    struct shm_ring *r = rc->ring;
+    int i, found, capfd = conn_capture_fd();
+    uint32_t seen;
+    long idle = 0;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        seen = __atomic_load_n(&r->doorbell, __ATOMIC_ACQUIRE);
+        for (i = found = 0; i < SHM_SLOTS; i++) {
+            if (__atomic_load_n(&r->slots[i].state, __ATOMIC_ACQUIRE) !=
+                    SHM_REQUEST)
+                continue;
+            r->slots[i].state = SHM_BUSY;
+            serve_slot(rc, &r->slots[i], capfd);
+            found = 1;
+        }
+        if (found || ++idle < shm_spin()) {
+            if (found)
+                idle = 0;
+            else
+                shm_relax();
+            continue;
+        }
+        __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+        shm_wait(&r->doorbell, seen, CHECK_MS);
+        __atomic_store_n(&r->sleeping, 0, __ATOMIC_SEQ_CST);
+        idle = 0;
+        if (caller_gone(rc->ctlfd))
+            break;
+    }
+    munmap(r, sizeof(struct shm_ring));
+    Close(rc->ctlfd);
+    Free(rc);
+    return NULL;
+}
+
+/*
+ * attach - map the ring a new caller sends and start serving it. The
+ *     memfd must be sealed against shrinking, or the caller could make
+ *     tiny fault on a page it truncated away.
+ */
+static void attach(struct attach *a, int ctlfd) {
+    struct ringconn *rc;
+    struct shm_ring *r;
+    struct stat st;
+    pthread_t tid;
+    int memfd, seals;
+
+    if ((memfd = recv_fd(ctlfd)) < 0) {
+        Close(ctlfd);
+        return;
+    }
+    r = MAP_FAILED;
+    seals = fcntl(memfd, F_GET_SEALS);
+    if (fstat(memfd, &st) == 0 &&
+            st.st_size >= (off_t)sizeof(struct shm_ring) &&
+            seals >= 0 && (seals & F_SEAL_SHRINK))
+        r = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE,
+                MAP_SHARED, memfd, 0);
+    Close(memfd);
+    if (r == MAP_FAILED || r->magic != SHM_MAGIC) {
+        if (r != MAP_FAILED)
+            munmap(r, sizeof(struct shm_ring));
+        Close(ctlfd);
+        return;
+    }
+    rc = Malloc(sizeof(struct ringconn));
+    rc->ctlfd = ctlfd;
+    rc->ring = r;
+    rc->handler = a->handler;
+    Pthread_create(&tid, NULL, ring_thread, rc);
+    /* Tell the caller its ring is being served */
+    send(ctlfd, "", 1, MSG_NOSIGNAL);
+}
+
+/*
+ * attach_thread - attach callers until this tiny hands the socket over
+ *     (-U); the rings already attached are served until it exits
+ */
+static void *attach_thread(void *arg) {
+    struct attach *a = arg;
+    int ctlfd;
+
+    Pthread_detach(Pthread_self());
+    upgrade_accepting();
+    while (1) {
+        if ((ctlfd = accept(a->listenfd, NULL, NULL)) < 0) {
+            if (upgrade_draining())
+                break;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ring accept error: %s\n", strerror(errno));
+            continue;
+        }
+        attach(a, ctlfd);
+    }
+    return NULL;
+}
+
+void shmserv_start(int listenfd, shm_handler handler) {
+    struct attach *a = Malloc(sizeof(struct attach));
+    pthread_t tid;
+
+    a->listenfd = listenfd;
+    a->handler = handler;
+    Pthread_create(&tid, NULL, attach_thread, a);
+}
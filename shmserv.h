@@ -0,0 +1,23 @@
+/*
+ * shmserv.h - tiny's side of the shared-memory call rings (see shm.h)
+ *
+ * An attach thread accepts callers on an AF_UNIX socket and gives each
+ * ring it is handed a thread of its own, which polls the ring's slots
+ * and runs each request through the handler.
+ */
+#ifndef __SHMSERV_H__
+#define __SHMSERV_H__
+
+#include "csapp.h"
+
+/*
+ * Runs function_name(fd, args) for a ring request and returns the HTTP
+ * status of the outcome; a 200's body is whatever was written to fd.
+ */
+typedef int (*shm_handler)(char *function_name, char *args, int deadline_ms,
+        int fd);
+
+/* Starts accepting rings on listenfd and returns */
+void shmserv_start(int listenfd, shm_handler handler);
+
+#endif /* __SHMSERV_H__ */
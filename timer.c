@@ -0,0 +1,129 @@
+/*
+ * timer.c - hashed timing wheel for connection deadlines
+ */
+#include "timer.h"
+
+long clock_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void timer_init(struct timer *t, timer_fn fn, void *arg) {
+    t->prev = t->next = NULL;
+    t->w = NULL;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void wheel_init(struct wheel *w) {
+    int i;
+
+    for (i = 0; i < WHEEL_SLOTS; i++)
+        w->slots[i].prev = w->slots[i].next = &w->slots[i];
+    w->start = clock_ms();
+    w->tick = 0;
+    w->count = 0;
+    w->shared = 0;
+    pthread_mutex_init(&w->lock, NULL);
+}
+
+static void unlink_timer(struct timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->w->count--;
+}
+
+void wheel_arm(struct wheel *w, struct timer *t, int ms) {
+    struct timer *slot;
+    long ticks;
+
+    if (w->shared)
+        pthread_mutex_lock(&w->lock);
+    if (t->next != NULL)
+        unlink_timer(t);
+    if (ms > 0) {
+        /* Round up, so a timer never fires early */
+        ticks = (clock_ms() - w->start + ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        if (ticks <= w->tick)
+            ticks = w->tick + 1;
+        t->expires = ticks;
+        t->w = w;
+        slot = &w->slots[ticks % WHEEL_SLOTS];
+        t->prev = slot->prev;
+        t->next = slot;
+        slot->prev->next = t;
+        slot->prev = t;
+        w->count++;
+    }
+    if (w->shared)
+        pthread_mutex_unlock(&w->lock);
+}
+
+void wheel_cancel(struct timer *t) {
+    struct wheel *w = t->w;
+
+    if (w == NULL)
+        return;
+    if (w->shared)
+        pthread_mutex_lock(&w->lock);
+    if (t->next != NULL)
+        unlink_timer(t);
+    if (w->shared)
+        pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * wheel_advance - walk the slots of every tick that has passed and fire
+ *     the timers due on each. A callback may re-arm or free its own timer.
+ */
+int wheel_advance(struct wheel *w) {
+    struct timer *t, *next, *slot;
+    long now = clock_ms() - w->start;
+
+    while (w->count > 0 && (w->tick + 1) * WHEEL_TICK_MS <= now) {
+        w->tick++;
+        slot = &w->slots[w->tick % WHEEL_SLOTS];
+        for (t = slot->next; t != slot; t = next) {
+            next = t->next;
+            if (t->expires > w->tick)
+                continue;   /* due in a later rotation */
+            unlink_timer(t);
+            t->fn(t);
+        }
+    }
+    if (w->count == 0) {
+        /* Nothing to walk; jump the clock forward */
+        w->tick = now / WHEEL_TICK_MS;
+        return -1;
+    }
+    return (w->tick + 1) * WHEEL_TICK_MS - now;
+}
+
+static void *watchdog_thread(void *arg) {
+    struct wheel *w = arg;
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = WHEEL_TICK_MS * 1000000L;
+    while (1) {
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&w->lock);
+        wheel_advance(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+struct wheel *wheel_watchdog(void) {
+    struct wheel *w = Malloc(sizeof(struct wheel));
+    pthread_t tid;
+
+    wheel_init(w);
+    w->shared = 1;
+    Pthread_create(&tid, NULL, watchdog_thread, w);
+    Pthread_detach(tid);
+    return w;
+}
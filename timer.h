@@ -0,0 +1,73 @@
+/*
+ * timer.h - hashed timing wheel for connection deadlines
+ *
+ * A wheel is a ring of slots, each a list of timers, and a clock that
+ * advances one slot per tick. A timer lands in the slot of the tick it
+ * expires on, so arming and cancelling are a list insert and unlink, and
+ * advancing the clock only looks at the slots it passes. Timers more
+ * than one rotation away stay put until their round comes up.
+ *
+ * A wheel belongs to one thread, which arms timers and calls
+ * wheel_advance from its event loop. A watchdog wheel is shared instead:
+ * it has its own thread that advances it, and arm and cancel take the
+ * wheel's lock. Watchdog callbacks run under that lock, so once
+ * wheel_cancel returns the callback is not running and will not run.
+ * A callback may re-arm or free its own timer but not touch any other
+ * (and, on a watchdog, must not arm through wheel_arm, which locks).
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "csapp.h"
+
+#define WHEEL_TICK_MS 100
+#define WHEEL_SLOTS 1024    /* one rotation is about 100 seconds */
+
+struct timer;
+typedef void (*timer_fn)(struct timer *t);
+
+struct timer {
+    struct timer *prev;     /* slot list; NULL while not armed */
+    struct timer *next;
+    long expires;           /* tick the timer fires on */
+    struct wheel *w;
+    timer_fn fn;
+    void *arg;
+};
+
+struct wheel {
+    struct timer slots[WHEEL_SLOTS];    /* list sentinels */
+    long tick;              /* last tick processed */
+    long start;             /* ms clock value at tick 0 */
+    int count;              /* armed timers */
+    int shared;             /* a watchdog: lock on arm and cancel */
+    pthread_mutex_t lock;
+};
+
+/* Per-connection deadlines, in ms; 0 disables one */
+struct timeouts {
+    int header_ms;  /* from the first byte of a request to its last */
+    int body_ms;    /* to write out one batch of responses */
+    int idle_ms;    /* between requests on a kept-alive connection */
+};
+
+/* The monotonic clock, in ms, that wheels and deadlines run on */
+long clock_ms(void);
+
+void timer_init(struct timer *t, timer_fn fn, void *arg);
+void wheel_init(struct wheel *w);
+
+/* Starts a thread that runs a shared wheel's callbacks */
+struct wheel *wheel_watchdog(void);
+
+/* (Re)arms t to fire after ms; ms <= 0 just cancels it */
+void wheel_arm(struct wheel *w, struct timer *t, int ms);
+void wheel_cancel(struct timer *t);
+
+/*
+ * Runs the callbacks of every timer that has expired and returns the ms
+ * until the next tick, or -1 if no timer is armed.
+ */
+int wheel_advance(struct wheel *w);
+
+#endif /* __TIMER_H__ */
@@ -1,167 +1,1284 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.1 Web server that uses the GET method to
+ *     serve static content, and dynamic content from the functions in
+ *     ./lib, which it loads and caches. Each feature is described in its
+ *     module's header and the options in README.md.
+ *
+ *     Modes (-m): thread (default), epoll, uring, coro, core, prefork.
  */
+#define _GNU_SOURCE
+#include <poll.h>
 #include "csapp.h"
+#include "conn.h"
+#include "evloop.h"
+#include "coro.h"
+#include "pool.h"
+#include "uring.h"
+#include "timer.h"
+#include "admit.h"
+#include "bulkhead.h"
+#include "edf.h"
+#include "topo.h"
+#include "shmserv.h"
+#include "h2.h"
+#include "tls.h"
+#include "upgrade.h"
+#include "admin.h"
+#include "prefork.h"
+#include "fcache.h"
 
-#define MAX_CACHE_SIZE 20000
-typedef struct cache_object* cache_obj;
-
-/* Cache struct */
-struct cache_object {
-	char* name;
-    void* handle;
-	cache_obj next;
-	int size;
-};
+#define DEFAULT_CACHE_SIZE 20000
+#define DEFAULT_WORKERS 16
+#define DEFAULT_WORKER_QUEUE 1024
+#define DEFAULT_FUNCTION_QUEUE 64
+#define DEFAULT_IDLE_TIMEOUT 5
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 60
+#define DEFAULT_MAX_QUEUED 64
+#define DEFAULT_QUEUE_TARGET 100    /* ms */
+#define DEFAULT_BULKHEAD_QUEUE 8
+#define MAX_BUDGETS 64
+typedef struct fcache_entry* cache_obj;
 
+/*
+ * Cache struct. The index (fcache.h) finds a function without a lock and
+ * notes the hit in the entry's own stamp, so hits on a shared shard
+ * write nothing another thread reads. The function is resolved once,
+ * when its library is loaded.
+ *
+ * Functions run inside the epoch section of the lookup that found them,
+ * so an evicted entry's library is only closed once no call is still
+ * running it.
+ */
 struct cache_queue {
-	cache_obj front;
-	cache_obj back;
-	int size;
-	pthread_rwlock_t lock;
+	struct fcache index;
+	int shared;     /* 0 for a core's private shard, which takes no locks */
+	pthread_mutex_t loader;         /* serializes loads into a shared shard */
+	struct admit admit;     /* dynamic requests admitted to this shard */
+	struct bulkheads *bulkheads;    /* per-function in-flight limits */
+	struct cache_queue *next;       /* in all_caches */
 };
 
 /*Global cache variable that is initialized with init_cache()*/
 struct cache_queue* cache;
-char scratch[MAXLINE];
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+struct pool *workers;           /* thread mode: connections, static requests */
+struct pool *function_workers;  /* thread mode: dynamic requests, or NULL */
+struct edf calls;               /* dynamic requests waiting for them */
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;    /* seconds; 0 disables keep-alive */
+struct timeouts timeouts;                   /* all three deadlines, in ms */
+struct wheel *watchdog;                     /* deadlines of doit's connections */
+struct evloop *parking;     /* thread mode: connections between requests */
+int max_queued = DEFAULT_MAX_QUEUED;        /* admission bound per shard */
+int queue_target = DEFAULT_QUEUE_TARGET;    /* CoDel target, ms; 0 = no shedding */
+int verbose = 1;                            /* log every request (-q clears) */
+char *upgrade_path;                         /* -U socket, or NULL */
+char *admin_path;                           /* -M socket, or NULL */
+int cache_capacity = DEFAULT_CACHE_SIZE;    /* bytes per cache shard */
+struct fcache_policy *eviction;             /* -E; lru by default */
+
+/* Every cache shard, so the admin socket can reach them all */
+struct cache_queue *all_caches;
+pthread_mutex_t all_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Thread placement (-c, -A); an empty set leaves threads unpinned */
+cpu_set_t worker_cpus;
+cpu_set_t acceptor_cpus;
+int nacceptors_started;
+struct cache_queue *node_caches[TOPO_MAX_NODES];   /* pinned workers' shards */
+pthread_mutex_t node_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Default latency budgets of dynamic functions (-T); "*" names the rest */
+struct budget {
+    char name[MAXLINE];
+    int ms;
+} budgets[MAX_BUDGETS];
+int nbudgets;
+
+/*
+ * Request counters, kept per thread so that counting shares nothing. A
+ * prefork worker publishes its copy as its PREFORK_COUNTERS longs.
+ * Counting goes through thread_stats, which lists each thread's copy in
+ * counted the first time, so SIGUSR1 can sum them in every mode.
+ */
+struct stats {
+    long requests;
+    long static_reqs;
+    long dynamic_reqs;
+    long cache_hits;
+    long cache_misses;
+    long errors;
+    long shed;      /* turned away by admission control */
+    long expired;   /* dropped because their deadline had passed */
+};
+__thread struct stats stats;
+__thread int counting;      /* this thread's stats are in counted */
+
+#define MAX_COUNTED 4096
+struct stats *counted[MAX_COUNTED];
+int ncounted;
+struct stats retired_stats;     /* of counted threads that have exited */
+pthread_mutex_t counted_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t counted_key;      /* its destructor retires a thread's stats */
+
+/* The listening sockets every prefork worker accepts on */
+int prefork_fds[3];
+int prefork_nfds;
+
+/* This thread's function cache shard (-m core); NULL means the global one */
+__thread struct cache_queue *local_cache;
 
-void* handle_request(void* arg);
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+/* One thread of the shared-nothing mode */
+struct core {
+    int cpu;
+    int listenfds[3];       /* its own TCP and TLS sockets, the shared -u one */
+    int nlisten;
+    struct cache_queue *cache;
+    struct stats *stats;    /* the core thread's own counters */
+};
+
+/* What tiny cares about in the request headers */
+struct reqhdrs {
+    int conn_close;         /* Connection: close */
+    int conn_keepalive;     /* Connection: keep-alive */
+    long content_length;
+    long deadline_ms;       /* X-Deadline-Ms: budget from arrival, or 0 */
+};
+
+/* process_request handed the connection to the function workers */
+#define REQUEST_MOVED 1
+
+/* Outcomes of call_dynamic */
+#define CALL_OK 0
+#define CALL_NOT_FOUND 1
+#define CALL_SHED 2         /* turned away by admission control */
+#define CALL_EXPIRED 3      /* its deadline passed before it could run */
+
+/* A dynamic request on its way to the function workers */
+struct function_call {
+    struct conn *c;
+    struct bulkhead *b;     /* the function's bulkhead, or NULL */
+    struct admit *admit;    /* the admission queue it joined */
+    long queued;            /* clock_ms() when it joined */
+    char function_name[MAXLINE];
+    char cgiargs[MAXLINE];
+};
+
+void* accept_loop(void* arg);
+void start_worker(int id);
+void report_placement(char *what, int nthreads, cpu_set_t *cpus);
+int listen_on(int role, int port, char *path, int reuseport);
+void start_upgrades(void);
+void stop_accepting(void);
+void start_admin(int thread_mode, int function_mode);
+void trim_caches(void);
+void configure_admission(void);
+char *cached_functions(void);
+void note_loaded(char *name, int delta);
+int warm_cache(struct cache_queue *q);
+void handle_request(void* arg);
+int request_ready(struct conn *c);
+void serve_parked(void* arg);
+void handle_coro(int fd);
+void resume_request(void* arg);
+void turn_away(struct conn *c);
+void doit(struct conn *c);
+int finish_request(struct conn *c);
+void shutdown_conn(struct timer *t);
+int wait_request(struct conn *c);
+void header_done(struct conn *c);
+int flush_response(struct conn *c);
+int process_request(struct conn *c);
+void serve_stream(struct conn *resp, struct h2_request *req);
+int serve_uri(struct conn *c, char *uri, long deadline_ms, int may_move);
+int read_requesthdrs(rio_t *rp, struct reqhdrs *hdrs);
 int parse_uri(char *uri, char *function_name, char *cgiargs);
-void serve_static(int fd, char *function_name, int filesize);
+void serve_static(struct conn *c, char *function_name, int filesize);
 void get_filetype(char *function_name, char *filetype);
-void serve_dynamic(int fd, char *function_name, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
+int dispatch_dynamic(struct conn *c, char *function_name, char *cgiargs);
+void serve_inline(struct conn *c, struct bulkhead *b, char *function_name,
+        char *cgiargs);
+void call_next(void* arg);
+void call_function(void* arg);
+int parse_budget(char *arg);
+long request_due(long arrival, char *function_name, long deadline_ms);
+struct bulkhead *function_bulkhead(struct cache_queue *q, char *function_name);
+void release_bulkhead(struct bulkhead *b);
+int join_admission(struct cache_queue *q);
+void serve_dynamic(struct conn *c, struct admit *a, long queued,
+        char *function_name, char *cgiargs);
+int call_dynamic(struct admit *a, long queued, char *function_name,
+        char *cgiargs, int fd, long due);
+int ring_call(char *function_name, char *args, int deadline_ms, int fd);
+int run_function(struct cache_queue *q, char *function_name, int fd,
+        char *cgiargs);
+void service_unavailable(struct conn *c);
+void deadline_expired(struct conn *c);
+void send_unavailable(struct conn *c);
+void clienterror(struct conn *c, char *cause, char *errnum, 
         char *shortmsg, char *longmsg);
-void cleanup(int fd);
-void init_cache();
-void* add_to_cache(char* name, void* handle, int size);
-void* search_cache(char* name, int fd, char* cgiargs);
-cache_obj create_node(char* name, void* handle, int size);
-void evict_lru();
+char *connection_hdr(struct conn *c);
+void run_cores(int port, int tls_port, int unixfd, int ncores);
+void* core_main(void* arg);
+void report_stats(struct core *cores, int ncores);
+struct stats *thread_stats(void);
+void retire_stats(void *arg);
+void start_reporter(void);
+void *reporter(void *arg);
+void report_totals(void);
+void print_stats(char *label, struct stats *st);
+void print_hit_rate(struct stats *st);
+void add_stats(struct stats *sum, struct stats *st);
+void run_prefork(int port, int tls_port, int unixfd, int nworkers);
+void prefork_worker(int id);
+int prefork_request(struct conn *c);
+void report_prefork(void);
+struct cache_queue* init_cache(int shared);
+cache_obj add_to_cache(struct cache_queue* q, char* name, void* handle,
+        dynamic_fn function, int size);
+cache_obj search_cache(struct cache_queue* q, char* name);
+cache_obj load_function(struct cache_queue* q, char* name);
+void unload_function(cache_obj obj);
+void evict_function(struct cache_queue* q);
 /*Lock wrapper functions*/
-void init_lock(pthread_rwlock_t* lock);
-void read_lock();
-void write_lock();
-void unlock();
+void write_lock(struct cache_queue* q);
+void unlock(struct cache_queue* q);
+void loader_lock(struct cache_queue* q);
+void loader_unlock(struct cache_queue* q);
+
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-m thread|epoll|uring|coro|core|prefork] "
+            "[-n loops] "
+            "[-w workers[:queue]] [-W workers[:queue]] [-a acceptors] "
+            "[-k idle_secs] [-H header_secs] [-B body_secs] [-Q max_queued] "
+            "[-D target_ms] [-F function=limit[:queue]] [-T function=ms] "
+            "[-c cpus] [-A cpus] [-u socket_path] [-r ring_socket_path] "
+            "[-s tls_port -C cert -K key] [-U upgrade_socket] "
+            "[-M admin_socket] [-E lru|clock|lfu|arc|2q] [-q] "
+            "<port>\n", prog);
+    exit(1);
+}
 
+/* parse_pool - read a "workers[:queue]" pool size; -1 if malformed */
+int parse_pool(char *arg, int *nworkers, int *max_queued) {
+    if (sscanf(arg, "%d:%d", nworkers, max_queued) < 1)
+        return -1;
+    return *nworkers < 0 || *max_queued < 0 ? -1 : 0;
+}
 
 int main(int argc, char **argv) 
 {
-    int listenfd, port, clientlen;
-    int* connfd_ptr;
-    struct sockaddr_in clientaddr;
+    int i, port, opt;
+    int *listenfds, nlisten, unixfd = -1, tls_port = 0;
+    char *unix_path = NULL, *ring_path = NULL, *cert = NULL, *key = NULL;
+    int use_epoll = 0, use_uring = 0, use_coro = 0, use_cores = 0, nloops = 0;
+    int use_prefork = 0;
+    int nworkers = DEFAULT_WORKERS, worker_queue = DEFAULT_WORKER_QUEUE;
+    int nfunctions = sysconf(_SC_NPROCESSORS_ONLN);
+    int function_queue = DEFAULT_FUNCTION_QUEUE;
+    int nacceptors = 1;
+    int header_timeout = DEFAULT_HEADER_TIMEOUT;
+    int body_timeout = DEFAULT_BODY_TIMEOUT;
     pthread_t tid;
-    
-    printf("%x\n", mutex);
 
-    init_cache();
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "m:n:w:W:a:k:H:B:Q:D:F:T:c:A:u:r:s:C:K:U:M:E:q")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "epoll"))
+                use_epoll = 1;
+            else if (!strcmp(optarg, "uring"))
+                use_uring = 1;
+            else if (!strcmp(optarg, "coro"))
+                use_coro = 1;
+            else if (!strcmp(optarg, "core"))
+                use_cores = 1;
+            else if (!strcmp(optarg, "prefork"))
+                use_prefork = 1;
+            else if (strcmp(optarg, "thread"))
+                usage(argv[0]);
+            break;
+        case 'n':
+            if ((nloops = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if (parse_pool(optarg, &nworkers, &worker_queue) < 0 ||
+                    nworkers == 0)
+                usage(argv[0]);
+            break;
+        case 'W':   /* 0 runs functions on the connection workers */
+            if (parse_pool(optarg, &nfunctions, &function_queue) < 0)
+                usage(argv[0]);
+            break;
+        case 'a':
+            if ((nacceptors = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if ((idle_timeout = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'H':
+            if ((header_timeout = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'B':
+            if ((body_timeout = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'Q':
+            if ((max_queued = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'D':
+            if ((queue_target = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'F':   /* repeatable; "*" names every other function */
+            if (bulkhead_configure(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'T':   /* repeatable; "*" names every other function */
+            if (parse_budget(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            if (topo_parse(optarg, &worker_cpus) < 0)
+                usage(argv[0]);
+            break;
+        case 'A':
+            if (topo_parse(optarg, &acceptor_cpus) < 0)
+                usage(argv[0]);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'r':
+            ring_path = optarg;
+            break;
+        case 's':
+            if ((tls_port = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'C':
+            cert = optarg;
+            break;
+        case 'K':
+            key = optarg;
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'E':
+            if ((eviction = fcache_policy(optarg)) == NULL) {
+                fprintf(stderr, "unknown eviction policy %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'M':
+            admin_path = optarg;
+            break;
+        case 'q':
+            verbose = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    port = atoi(argv[optind]);
+    if (tls_port > 0 && (cert == NULL || key == NULL || tls_port == port))
+        usage(argv[0]);
+    if ((tls_port > 0 || upgrade_path != NULL) && use_uring) {
+        fprintf(stderr, "%s: -s and -U are not supported with -m uring\n",
+                argv[0]);
+        exit(1);
+    }
+    /* Their threads would live in the parent, which serves nothing */
+    if ((upgrade_path != NULL || admin_path != NULL || ring_path != NULL) &&
+            use_prefork) {
+        fprintf(stderr, "%s: -U, -M and -r are not supported with -m "
+                "prefork\n", argv[0]);
+        exit(1);
+    }
+    /* HTTP/2 needs persistent connections, as for h2c */
+    if (tls_port > 0 && tls_init(tls_port, cert, key, idle_timeout > 0) < 0)
+        exit(1);
+    timeouts.header_ms = header_timeout * 1000;
+    timeouts.body_ms = body_timeout * 1000;
+    timeouts.idle_ms = idle_timeout * 1000;
+    bulkhead_default(nfunctions > 1 ? nfunctions / 2 : 1,
+            DEFAULT_BULKHEAD_QUEUE);
+    if (eviction == NULL)
+        eviction = fcache_policies[0];
+    cache = init_cache(1);
+    topo_init();
+    topo_report();
+
+    /* A client hanging up mid-response must not kill the server */
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* SIGUSR1 prints the counters; core and prefork mode wait for it */
+    pthread_key_create(&counted_key, retire_stats);
+    if (!use_cores && !use_prefork)
+        start_reporter();
+
+    /* Take over from the tiny already running, if there is one */
+    if (upgrade_path != NULL && upgrade_inherit(upgrade_path)) {
+        printf("upgrade: loaded %d functions\n", warm_cache(cache));
+        fflush(stdout);
+    }
+
+    if (unix_path != NULL)
+        unixfd = listen_on(UPGRADE_UNIX, 0, unix_path, 0);
+    if (ring_path != NULL)
+        shmserv_start(listen_on(UPGRADE_RING, 0, ring_path, 0), ring_call);
+    /* Thread mode's pools get settings too, once they exist */
+    if (admin_path != NULL && (use_epoll || use_uring || use_coro || use_cores))
+        start_admin(0, 0);
+    if (use_prefork)
+        run_prefork(port, tls_port, unixfd, nloops ? nloops :
+                sysconf(_SC_NPROCESSORS_ONLN));
+    if (use_cores)
+        run_cores(port, tls_port, unixfd, nloops ? nloops : CPU_COUNT(&worker_cpus) ?
+                CPU_COUNT(&worker_cpus) : sysconf(_SC_NPROCESSORS_ONLN));
+    if (nloops == 0)
+        nloops = 1;
+
+    /* The AF_UNIX and TLS listeners are just more listening sockets */
+    nlisten = nacceptors + (unixfd >= 0) + (tls_port > 0);
+    listenfds = Malloc(nlisten * sizeof(int));
+    for (i = 0; i < nacceptors; i++)
+        listenfds[i] = listen_on(UPGRADE_TCP, port, NULL, nacceptors > 1);
+    if (unixfd >= 0)
+        listenfds[nacceptors] = unixfd;
+    if (tls_port > 0)
+        listenfds[nlisten - 1] = listen_on(UPGRADE_TLS, tls_port, NULL, 0);
+    start_upgrades();
+    if (use_epoll)
+        evloop_run(listenfds, nlisten, nloops, &timeouts, process_request);
+    if (use_uring) {
+#ifdef HAVE_LIBURING
+        uring_run(listenfds, nlisten, nloops, &timeouts, process_request);
+#else
+        fprintf(stderr, "%s: built without liburing, -m uring unavailable\n",
+                argv[0]);
         exit(1);
+#endif
     }
-    port = atoi(argv[1]);
 
-    listenfd = Open_listenfd(port);
+    watchdog = wheel_watchdog();
+    if (use_coro)
+        coro_run(listenfds, nlisten, nloops, handle_coro);
+    workers = pool_create_on(nworkers, worker_queue, start_worker);
+    parking = evloop_parking(nloops, &timeouts, request_ready);
+    report_placement("acceptors", nlisten, &acceptor_cpus);
+    report_placement("connection workers", nworkers, &worker_cpus);
+    if (nfunctions > 0) {
+        /* The EDF queue holds waiting calls and enforces the bound */
+        function_workers = pool_create_on(nfunctions, 0, start_worker);
+        edf_init(&calls, function_queue);
+        report_placement("function workers", nfunctions, &worker_cpus);
+    }
+    if (admin_path != NULL)
+        start_admin(1, nfunctions > 0);
+    fflush(stdout);
+    for (i = 1; i < nlisten; i++)
+        Pthread_create(&tid, NULL, accept_loop, &listenfds[i]);
+    accept_loop(&listenfds[0]);
+    return 0;
+}
+/* $end tinymain */
+
+/*
+ * accept_loop - park every connection on one listening socket until its
+ *     first request header is in; request_ready then hands it to the
+ *     pool. The thread exits once the socket is handed to a new tiny
+ *     (-U). Since the socket may then be shared with an event loop that
+ *     made it non-blocking, EAGAIN just means waiting for the next
+ *     connection.
+ */
+void* accept_loop(void* listenfd_ptr) {
+    int listenfd = *((int*) listenfd_ptr);
+    struct pollfd pfd = { listenfd, POLLIN, 0 };
+    struct conn *c;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    int fd, id = __sync_fetch_and_add(&nacceptors_started, 1);
+
+    if (CPU_COUNT(&acceptor_cpus) > 0 &&
+            topo_pin(topo_nth(&acceptor_cpus, id)) < 0)
+        fprintf(stderr, "could not pin acceptor %d\n", id);
+    upgrade_accepting();
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfd_ptr = (int*) Malloc(sizeof(int));
-        *connfd_ptr = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        printf("Connection made.\n");
-        Pthread_create(&tid, NULL, handle_request, (void*) connfd_ptr);
+        if ((fd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            if (upgrade_draining())
+                pthread_exit(NULL);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                poll(&pfd, 1, -1);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                unix_error("Accept error");
+            continue;
+        }
+        c = conn_accept(fd);
+        if (verbose)
+            printf("Connection made.\n");
+        c->deadline = DEADLINE_HEADER;
+        evloop_park(parking, c);
     }
+    return NULL;
 }
-/* $end tinymain */
 
-/*Small wrapper to parse/forward the request that fits Pthread specs*/
-void* handle_request(void* connfd_ptr) {
-    int fd = *((int*) connfd_ptr);
-    Free(connfd_ptr);
-	doit(fd);
-	return NULL;
+/*
+ * start_worker - pin a pool worker to its CPU of -c and adopt its node's
+ *     cache shard. The first worker on a node creates the shard, so the
+ *     shard and the functions loaded into it live on that node.
+ */
+void start_worker(int id) {
+    int cpu, node;
+
+    if (CPU_COUNT(&worker_cpus) == 0)
+        return;
+    cpu = topo_nth(&worker_cpus, id);
+    if (topo_pin(cpu) < 0)
+        fprintf(stderr, "could not pin a worker to CPU %d\n", cpu);
+    node = topo_node(cpu);
+    pthread_mutex_lock(&node_caches_lock);
+    if (node_caches[node] == NULL) {
+        node_caches[node] = init_cache(1);
+        warm_cache(node_caches[node]);
+    }
+    pthread_mutex_unlock(&node_caches_lock);
+    local_cache = node_caches[node];
+}
+
+/* report_placement - print where a group of threads may run */
+void report_placement(char *what, int nthreads, cpu_set_t *cpus) {
+    char cpubuf[MAXLINE], nodebuf[MAXLINE];
+    cpu_set_t nodes;
+    int cpu;
+
+    if (CPU_COUNT(cpus) == 0) {
+        printf("%s: %d, unpinned\n", what, nthreads);
+        return;
+    }
+    CPU_ZERO(&nodes);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, cpus))
+            CPU_SET(topo_node(cpu), &nodes);
+    printf("%s: %d on cpus %s, node %s\n", what, nthreads,
+            topo_format(cpus, cpubuf, sizeof(cpubuf)),
+            topo_format(&nodes, nodebuf, sizeof(nodebuf)));
+}
+
+/*
+ * listen_on - a listening socket for role on port (or path, for AF_UNIX):
+ *     the one the tiny being upgraded from handed over, if it had one,
+ *     otherwise a new one. Either way it is handed over in turn.
+ */
+int listen_on(int role, int port, char *path, int reuseport) {
+    int fd;
+
+    if ((fd = upgrade_take(role, port, path)) < 0) {
+        if (path != NULL)
+            fd = Open_unix_listenfd(path);
+        else
+            fd = reuseport ? Open_listenfd_reuseport(port) : Open_listenfd(port);
+    }
+    upgrade_listener(fd, role);
+    return fd;
+}
+
+/*
+ * start_upgrades - with -U, release the tiny taken over from, if any, and
+ *     wait for a successor. A drain lasts as long as a connection can
+ *     take to send a request, take its response and go idle.
+ */
+void start_upgrades(void) {
+    static struct upgrade_ops ops = { cached_functions, stop_accepting };
+
+    if (upgrade_path != NULL)
+        upgrade_serve(upgrade_path, &ops,
+                timeouts.header_ms + timeouts.body_ms + timeouts.idle_ms);
+}
+
+/*
+ * stop_accepting - leave the handed-over sockets to the new tiny. Thread
+ *     mode's acceptors are interrupted by upgrade.c itself.
+ */
+void stop_accepting(void) {
+    evloop_stop_accepting();
+    coro_stop_accepting();
+}
+
+/*
+ * Settings of the admin socket (-M). Each setter checks the value and
+ * applies it to the structures already serving; see start_admin.
+ */
+int get_cache_size(void) { return cache_capacity; }
+int get_max_queued(void) { return max_queued; }
+int get_queue_target(void) { return queue_target; }
+int get_verbose(void) { return verbose; }
+int get_workers(void) { return pool_size(workers); }
+int get_worker_queue(void) { return pool_max_queued(workers); }
+int get_functions(void) { return pool_size(function_workers); }
+int get_function_queue(void) { return calls.max_queued; }
+
+int set_cache_size(int v) {
+    if (v < 0)
+        return -1;
+    cache_capacity = v;
+    trim_caches();
+    return 0;
+}
+
+int set_max_queued(int v) {
+    if (v < 0)
+        return -1;
+    max_queued = v;
+    configure_admission();
+    return 0;
+}
+
+int set_queue_target(int v) {
+    if (v < 0)
+        return -1;
+    queue_target = v;
+    configure_admission();
+    return 0;
+}
+
+int set_verbose(int v) {
+    if (v != 0 && v != 1)
+        return -1;
+    verbose = v;
+    return 0;
+}
+
+int set_workers(int v) {
+    return pool_resize(workers, v);
+}
+
+int set_worker_queue(int v) {
+    if (v < 0)
+        return -1;
+    pool_set_max_queued(workers, v);
+    return 0;
+}
+
+int set_functions(int v) {
+    return pool_resize(function_workers, v);
+}
+
+int set_function_queue(int v) {
+    if (v < 0)
+        return -1;
+    pthread_mutex_lock(&calls.lock);
+    calls.max_queued = v;
+    pthread_mutex_unlock(&calls.lock);
+    return 0;
+}
+
+/* The settings every mode has come first, then thread mode's pools */
+struct admin_setting admin_settings[] = {
+    { "cache_size", get_cache_size, set_cache_size },
+    { "max_queued", get_max_queued, set_max_queued },
+    { "queue_target", get_queue_target, set_queue_target },
+    { "verbose", get_verbose, set_verbose },
+    { "workers", get_workers, set_workers },
+    { "worker_queue", get_worker_queue, set_worker_queue },
+    { "functions", get_functions, set_functions },
+    { "function_queue", get_function_queue, set_function_queue },
+};
+
+/* start_admin - serve the settings that exist in this mode */
+void start_admin(int thread_mode, int function_mode) {
+    int n = 4;
+
+    if (thread_mode)
+        n += function_mode ? 4 : 2;
+    admin_serve(admin_path, admin_settings, n);
+}
+
+/*
+ * turn_away - answer a connection the pool has no room for with a 503.
+ *     What has arrived of its request is read first, so that closing
+ *     does not reset the connection before the client sees the answer.
+ *     A TLS connection is just closed: answering would take a handshake,
+ *     which could block the acceptor.
+ */
+void turn_away(struct conn *c) {
+    char buf[MAXBUF];
+
+    if (c->tls != NULL) {
+        conn_free(c);
+        return;
+    }
+    while (recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    service_unavailable(c);
+    flush_response(c);
+    conn_free(c);
+}
+
+/*
+ * run_cores - start the shared-nothing mode and never return. Each core
+ *     gets its own listening socket, so the kernel's SO_REUSEPORT hash
+ *     picks the core for a new connection and it stays there. AF_UNIX
+ *     has no SO_REUSEPORT, so every core watches the one -u socket and
+ *     whichever accepts a connection keeps it. The TLS port, like the TCP
+ *     one, gets a socket per core. The main thread serves nothing; it
+ *     waits for SIGUSR1 to report the stats.
+ */
+void run_cores(int port, int tls_port, int unixfd, int ncores) {
+    struct core *cores = Calloc(ncores, sizeof(struct core));
+    int i, sig, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t mask;
+    pthread_t tid;
+
+    /* Block SIGUSR1 before the cores start so they inherit the mask */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    for (i = 0; i < ncores; i++) {
+        cores[i].cpu = CPU_COUNT(&worker_cpus) > 0 ?
+            topo_nth(&worker_cpus, i) : i % ncpus;
+        cores[i].listenfds[0] = listen_on(UPGRADE_TCP, port, NULL, 1);
+        cores[i].nlisten = 1;
+        if (tls_port > 0)
+            cores[i].listenfds[cores[i].nlisten++] =
+                listen_on(UPGRADE_TLS, tls_port, NULL, 1);
+        if (unixfd >= 0)
+            cores[i].listenfds[cores[i].nlisten++] = unixfd;
+        printf("core %d: cpu %d, node %d\n", i, cores[i].cpu,
+                topo_node(cores[i].cpu));
+    }
+    start_upgrades();
+    for (i = 0; i < ncores; i++)
+        Pthread_create(&tid, NULL, core_main, &cores[i]);
+    fflush(stdout);
+    while (1)
+        if (sigwait(&mask, &sig) == 0)
+            report_stats(cores, ncores);
+}
+
+/*
+ * core_main - pin to the core's CPU, create its cache shard there so it
+ *     is allocated on the core's node, and run its loop
+ */
+void* core_main(void* arg) {
+    struct core *core = arg;
+
+    if (topo_pin(core->cpu) < 0)
+        fprintf(stderr, "could not pin a core to CPU %d\n", core->cpu);
+    local_cache = core->cache = init_cache(0);
+    warm_cache(core->cache);
+    core->stats = &stats;
+    evloop_run(core->listenfds, core->nlisten, 1, &timeouts, process_request);
+    return NULL;
+}
+
+/*
+ * report_stats - print each core's counters, then the totals. The
+ *     counters are read without synchronization, so a report may lag
+ *     slightly.
+ */
+void report_stats(struct core *cores, int ncores) {
+    char label[MAXLINE];
+    int i;
+
+    for (i = 0; i < ncores; i++) {
+        if (cores[i].stats == NULL)
+            continue;
+        sprintf(label, "core %d (cpu %d)", i, cores[i].cpu);
+        print_stats(label, cores[i].stats);
+    }
+    report_totals();
+}
+
+void print_stats(char *label, struct stats *st) {
+    printf("%s: %ld requests %ld static %ld dynamic %ld hits %ld misses "
+            "%ld errors %ld shed %ld expired\n", label, st->requests,
+            st->static_reqs, st->dynamic_reqs, st->cache_hits,
+            st->cache_misses, st->errors, st->shed, st->expired);
+}
+
+/* print_hit_rate - how well the eviction policy did on st's lookups */
+void print_hit_rate(struct stats *st) {
+    long lookups = st->cache_hits + st->cache_misses;
+
+    printf("cache: %s eviction, %.1f%% hits\n", eviction->name,
+            lookups > 0 ? 100.0 * st->cache_hits / lookups : 0.0);
+}
+
+/*
+ * thread_stats - this thread's counters, listed in counted on first use
+ *     so that report_totals sees every thread that served anything
+ */
+struct stats *thread_stats(void) {
+    if (!counting) {
+        counting = 1;
+        pthread_mutex_lock(&counted_lock);
+        if (ncounted < MAX_COUNTED) {
+            counted[ncounted++] = &stats;
+            pthread_setspecific(counted_key, &stats);
+        }
+        pthread_mutex_unlock(&counted_lock);
+    }
+    return &stats;
+}
+
+/* retire_stats - a counted thread is exiting (ring threads do) */
+void retire_stats(void *arg) {
+    struct stats *st = arg;
+    int i;
+
+    pthread_mutex_lock(&counted_lock);
+    add_stats(&retired_stats, st);
+    for (i = 0; counted[i] != st; i++)
+        ;
+    counted[i] = counted[--ncounted];
+    pthread_mutex_unlock(&counted_lock);
+}
+
+/*
+ * start_reporter - report the totals on SIGUSR1 from a thread of its own.
+ *     The signal is blocked before any other thread starts, so they all
+ *     inherit the mask and only the reporter takes it.
+ */
+void start_reporter(void) {
+    static sigset_t mask;
+    pthread_t tid;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, reporter, &mask);
+}
+
+void *reporter(void *arg) {
+    int sig;
+
+    while (1)
+        if (sigwait(arg, &sig) == 0)
+            report_totals();
+    return NULL;
+}
+
+/* report_totals - print every thread's counters summed, and the hit rate */
+void report_totals(void) {
+    struct stats sum;
+    int i;
+
+    pthread_mutex_lock(&counted_lock);
+    memcpy(&sum, &retired_stats, sizeof(sum));
+    for (i = 0; i < ncounted; i++)
+        add_stats(&sum, counted[i]);
+    pthread_mutex_unlock(&counted_lock);
+    print_stats("total", &sum);
+    print_hit_rate(&sum);
+    fflush(stdout);
+}
+
+void add_stats(struct stats *sum, struct stats *st) {
+    sum->requests += st->requests;
+    sum->static_reqs += st->static_reqs;
+    sum->dynamic_reqs += st->dynamic_reqs;
+    sum->cache_hits += st->cache_hits;
+    sum->cache_misses += st->cache_misses;
+    sum->errors += st->errors;
+    sum->shed += st->shed;
+    sum->expired += st->expired;
+}
+
+/*
+ * run_prefork - the multi-process mode (see prefork.h). The parent opens
+ *     one socket per listener, which every worker accepts on, and then
+ *     only supervises the workers and reports on SIGUSR1.
+ */
+void run_prefork(int port, int tls_port, int unixfd, int nworkers) {
+    prefork_fds[prefork_nfds++] = listen_on(UPGRADE_TCP, port, NULL, 0);
+    if (tls_port > 0)
+        prefork_fds[prefork_nfds++] = listen_on(UPGRADE_TLS, tls_port, NULL, 0);
+    if (unixfd >= 0)
+        prefork_fds[prefork_nfds++] = unixfd;
+    printf("prefork: %d workers\n", nworkers);
+    prefork_run(nworkers, prefork_worker, report_prefork);
+}
+
+/*
+ * prefork_worker - a worker process: pinned to its CPU of -c if given,
+ *     with its own cache shard and a single event loop, like a core of
+ *     -m core but in a process of its own
+ */
+void prefork_worker(int id) {
+    if (CPU_COUNT(&worker_cpus) > 0 &&
+            topo_pin(topo_nth(&worker_cpus, id)) < 0)
+        fprintf(stderr, "could not pin worker %d\n", id);
+    local_cache = init_cache(0);
+    evloop_run(prefork_fds, prefork_nfds, 1, &timeouts, prefork_request);
+}
+
+/*
+ * prefork_request - process_request, then publish the worker's counters
+ *     to its slot, so they outlive it if a later request crashes it
+ */
+int prefork_request(struct conn *c) {
+    int rc = process_request(c);
+
+    memcpy(prefork->workers[prefork_id].counters, &stats, sizeof(stats));
+    return rc;
+}
+
+/*
+ * report_prefork - print each worker's counters, the retired ones and
+ *     the total, then which workers have each function loaded
+ */
+void report_prefork(void) {
+    static struct prefork_function dir[PREFORK_FUNCTIONS];
+    struct prefork_worker *w;
+    struct stats sum;
+    char label[MAXLINE];
+    int i, j, n;
+
+    memcpy(&sum, prefork->retired, sizeof(sum));
+    print_stats("retired workers", &sum);
+    for (i = 0; i < prefork->nworkers; i++) {
+        w = &prefork->workers[i];
+        sprintf(label, "worker %d (pid %d, %d restarts)", i, w->pid,
+                w->restarts);
+        print_stats(label, (struct stats *)w->counters);
+        add_stats(&sum, (struct stats *)w->counters);
+    }
+    print_stats("total", &sum);
+    print_hit_rate(&sum);
+    n = prefork_directory(dir);
+    for (i = 0; i < n; i++) {
+        if (dir[i].where == 0)
+            continue;
+        printf("function %s: workers", dir[i].name);
+        for (j = 0; j < prefork->nworkers; j++)
+            if (dir[i].where & ((uint64_t)1 << j))
+                printf(" %d", j);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/*Small wrapper to parse/forward the request that fits pool_fn specs*/
+void handle_request(void* arg) {
+    struct conn *c = arg;
+
+    timer_init(&c->timer, shutdown_conn, c);
+    c->deadline = DEADLINE_HEADER;
+    wheel_arm(watchdog, &c->timer, timeouts.header_ms);
+    doit(c);
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * request_ready - a parked connection has a whole request header: queue
+ *     it for a worker, or answer 503 if the pool has no room
+ */
+int request_ready(struct conn *c) {
+    if (pool_try_submit(workers, serve_parked, c) < 0)
+        turn_away(c);
+    return 0;
+}
+
+/* Pool task for a connection the parking loops found a request on */
+void serve_parked(void* arg) {
+    struct conn *c = arg;
+
+    timer_init(&c->timer, shutdown_conn, c);
+    doit(c);
+}
+
+/* The coroutine entry point */
+void handle_coro(int fd) {
+    handle_request(conn_accept(fd));
+}
+
+/* Pool task for a connection whose dynamic request has been served */
+void resume_request(void* arg) {
+    struct conn *c = arg;
+
+    if (finish_request(c) < 0 || !c->keepalive) {
+        conn_free(c);
+        return;
+    }
+    doit(c);
+}
+
+/*
+ * doit - handle the HTTP requests of one connection, on a blocking socket
+ *     (thread mode) or as a coroutine (coro mode). The connection's timer
+ *     on the watchdog counts down the header deadline while a request
+ *     arrives, the body deadline while responses go out and the idle
+ *     deadline in between; if it expires, shutdown_conn wakes whatever
+ *     read or write is stuck. No deadline runs while a request is
+ *     served, since a slow function is not a slow client. Responses
+ *     queue up while further pipelined requests are already buffered and
+ *     are flushed together before the next read that could block. In
+ *     thread mode that read never happens on a worker: a connection with
+ *     no whole request buffered goes back to the parking loops. A request
+ *     handed to the function workers takes the connection with it;
+ *     resume_request continues.
  */
 /* $begin doit */
-void doit(int fd) 
+void doit(struct conn *c) 
+{
+    int rc;
+
+    do {
+        if (parking != NULL && !conn_has_request(c)) {
+            wheel_cancel(&c->timer);
+            evloop_park(parking, c);
+            return;
+        }
+        if (wait_request(c) <= 0)
+            break;
+        header_done(c);
+        if ((rc = process_request(c)) < 0)
+            break;
+        if (rc == REQUEST_MOVED)
+            return;
+        if (finish_request(c) < 0)
+            break;
+    } while (c->keepalive);
+    conn_free(c);
+}
+/* $end doit */
+
+/*
+ * finish_request - flush the responses queued so far, unless another
+ *     pipelined request is already buffered, and start the deadline of
+ *     whatever the connection waits for next.
+ */
+int finish_request(struct conn *c)
+{
+    if (c->keepalive && conn_has_request(c))
+        return 0;
+    c->deadline = DEADLINE_BODY;
+    wheel_arm(watchdog, &c->timer, timeouts.body_ms);
+    if (flush_response(c) < 0)
+        return -1;
+    /* Leftover bytes are the start of the next request */
+    if (c->rio.rio_cnt > 0) {
+        c->deadline = DEADLINE_HEADER;
+        wheel_arm(watchdog, &c->timer, timeouts.header_ms);
+    }
+    else {
+        c->deadline = DEADLINE_IDLE;
+        wheel_arm(watchdog, &c->timer, timeouts.idle_ms);
+    }
+    return 0;
+}
+
+/* shutdown_conn - watchdog callback for a connection past its deadline */
+void shutdown_conn(struct timer *t)
+{
+    struct conn *c = t->arg;
+
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/*
+ * wait_request - wait until a whole request header (or h2 frame) is
+ *     buffered on c. Its first byte ends the idle deadline and starts the
+ *     header one. Returns the count buffered, 0 if the client hung up and
+ *     -1 on error, a header too big for the buffer included.
+ */
+int wait_request(struct conn *c)
+{
+    ssize_t n;
+
+    while (!conn_has_request(c)) {
+        if ((n = conn_fill(c)) == 0)
+            return 0;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if (io_block == NULL || io_block(c->fd, 0) < 0)
+                return -1;
+            continue;
+        }
+        if (c->deadline == DEADLINE_IDLE) {
+            c->deadline = DEADLINE_HEADER;
+            wheel_arm(watchdog, &c->timer, timeouts.header_ms);
+        }
+    }
+    return c->rio.rio_cnt;
+}
+
+/*
+ * header_done - the request header is in, so its deadline stops;
+ *     finish_request starts the body deadline once there is a response
+ */
+void header_done(struct conn *c)
+{
+    c->deadline = DEADLINE_NONE;
+    wheel_cancel(&c->timer);
+}
+
+/*
+ * flush_response - write all of c's queued output. Only a coroutine's
+ *     non-blocking socket can fill up; io_block then waits for room.
+ */
+int flush_response(struct conn *c)
+{
+    int rc;
+
+    while ((rc = conn_flush(c)) == 1)
+        if (io_block == NULL || io_block(c->fd, 1) < 0)
+            return -1;
+    return rc;
+}
+
+/*
+ * process_request - read, parse and serve one request from c's Rio
+ *     buffer, queueing the response on c. The event loops only call this
+ *     once the whole header is buffered, so it never blocks there.
+ *     Returns -1 if the connection should be dropped without a response,
+ *     or REQUEST_MOVED if the function workers now own it.
+ */
+int process_request(struct conn *c)
 {
-    int is_static;
-    struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char function_name[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    struct reqhdrs hdrs;
 
-    /* This thread doesn't have to be joined */
-    Pthread_detach(Pthread_self());
+    if (c->h2 != NULL)
+        return h2_process(c);
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    /* Read request line and headers; the request arrives with its header */
+    c->keepalive = 0;
+    c->arrival = clock_ms();
+    if (rio_readlineb(&c->rio, buf, MAXLINE) <= 0)
+        return -1;
+    /* An h2c client with prior knowledge; h2 needs a persistent connection */
+    if (idle_timeout > 0 && !strcmp(buf, H2_PREFACE_LINE))
+        return h2_start(c, serve_stream);
+    thread_stats()->requests++;
+    strcpy(version, "HTTP/1.0");
+    if (sscanf(buf, "%s %s %s", method, uri, version) < 2) {
+        clienterror(c, buf, "400", "Bad Request",
+                "Tiny couldn't parse the request");
+        return 0;
+    }
 
-    printf("Scanned input. %s\n", buf);
+    if (verbose)
+        printf("Scanned input. %s\n", buf);
     if (strcasecmp(method, "GET")) { 
-        clienterror(fd, method, "501", "Not Implemented",
+        clienterror(c, method, "501", "Not Implemented",
+                "Tiny does not implement this method");
+        return 0;
+    }
+    if (read_requesthdrs(&c->rio, &hdrs) < 0)
+        return -1;
+
+    /*
+     * HTTP/1.1 connections persist unless the client says close; 1.0
+     * ones only if it asks for keep-alive. A GET carrying a body is not
+     * worth reading past, so such a connection closes after the response.
+     */
+    if (idle_timeout > 0 && hdrs.content_length == 0) {
+        if (!strcmp(version, "HTTP/1.1"))
+            c->keepalive = !hdrs.conn_close;
+        else
+            c->keepalive = hdrs.conn_keepalive;
+    }
+    /* A tiny handing over to its successor closes connections as it goes */
+    if (upgrade_draining())
+        c->keepalive = 0;
+
+    return serve_uri(c, uri, hdrs.deadline_ms, 1);
+}
+
+/*
+ * serve_stream - the h2 handler: serve one stream's request into resp
+ *     like process_request serves an HTTP/1.1 one. Its dynamic requests
+ *     run here; the connection cannot go to the function workers while
+ *     its other streams are live.
+ */
+void serve_stream(struct conn *resp, struct h2_request *req)
+{
+    thread_stats()->requests++;
+    if (verbose)
+        printf("Scanned stream %d. %s %s\n", req->stream, req->method,
+                req->path);
+    if (strcasecmp(req->method, "GET")) {
+        clienterror(resp, req->method, "501", "Not Implemented",
                 "Tiny does not implement this method");
-        cleanup(fd);
         return;
     }
-    read_requesthdrs(&rio);
+    serve_uri(resp, req->path, req->deadline_ms, 0);
+}
+
+/*
+ * serve_uri - serve a GET of uri on c. A dynamic request goes through
+ *     dispatch_dynamic if it may take c to the function workers, else it
+ *     runs on this thread. Returns 0 or REQUEST_MOVED.
+ */
+int serve_uri(struct conn *c, char *uri, long deadline_ms, int may_move)
+{
+    int is_static;
+    struct stat sbuf;
+    char function_name[MAXLINE], cgiargs[MAXLINE];
+    struct cache_queue *q = local_cache ? local_cache : cache;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, function_name, cgiargs);
     if (stat(function_name, &sbuf) < 0 && is_static) {
-        clienterror(fd, function_name, "404", "Not found",
+        clienterror(c, function_name, "404", "Not found",
                 "Tiny couldn't find this file");
-        cleanup(fd);
-        return;
+        return 0;
     }
     if (is_static) { /* Serve static content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            clienterror(fd, function_name, "403", "Forbidden",
+            clienterror(c, function_name, "403", "Forbidden",
                     "Tiny couldn't read the file");
-            cleanup(fd);
-            return;
+            return 0;
         }
-        serve_static(fd, function_name, sbuf.st_size);
+        serve_static(c, function_name, sbuf.st_size);
     }
     else { /* Serve dynamic content */
-        #ifdef OLD
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            clienterror(fd, function_name, "403", "Forbidden",
-                    "Tiny couldn't run the CGI program");
-            cleanup(fd);
-            return;
-        }
-        #endif
-        serve_dynamic(fd, function_name, cgiargs);
+        c->due = request_due(c->arrival, function_name, deadline_ms);
+        if (may_move)
+            return dispatch_dynamic(c, function_name, cgiargs);
+        serve_inline(c, function_bulkhead(q, function_name), function_name,
+                cgiargs);
     }
-    cleanup(fd);
+    return 0;
 }
-/* $end doit */
 
 /*
  * read_requesthdrs - read and parse HTTP request headers
+ *     Returns -1 if the client hung up before the blank line.
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, struct reqhdrs *hdrs) 
 {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
-    }
-    return;
+    memset(hdrs, 0, sizeof(struct reqhdrs));
+    do {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+            return -1;
+        if (verbose)
+            printf("%s", buf);
+        if (!strncasecmp(buf, "Connection:", 11)) {
+            hdrs->conn_close = strcasestr(buf + 11, "close") != NULL;
+            hdrs->conn_keepalive = strcasestr(buf + 11, "keep-alive") != NULL;
+        }
+        else if (!strncasecmp(buf, "Content-length:", 15))
+            hdrs->content_length = atol(buf + 15);
+        else if (!strncasecmp(buf, "X-Deadline-Ms:", 14))
+            hdrs->deadline_ms = atol(buf + 14);
+    } while (strcmp(buf, "\r\n"));
+    return 0;
 }
 /* $end read_requesthdrs */
 
@@ -190,10 +1307,9 @@ int parse_uri(char *uri, char *function_name, char *cgiargs)
         }
         else 
             strcpy(cgiargs, "");
-        //strcpy(function_name, ".");
 
         // Skip the "/cgi-bin/" portion and jump to the program
-        strcat(function_name, uri+9);
+        strcpy(function_name, uri+9);
         return 0;
     }
 }
@@ -203,25 +1319,27 @@ int parse_uri(char *uri, char *function_name, char *cgiargs)
  * serve_static - copy a file back to the client 
  */
 /* $begin serve_static */
-void serve_static(int fd, char *function_name, int filesize) 
+void serve_static(struct conn *c, char *function_name, int filesize) 
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char filetype[32], buf[MAXBUF];
 
-    /* Send response headers to client */
+    /* Queue response headers */
+    thread_stats()->static_reqs++;
     get_filetype(function_name, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+            "Server: Tiny Web Server\r\n"
+            "Connection: %s\r\n"
+            "Content-length: %d\r\n"
+            "Content-type: %s\r\n\r\n",
+            connection_hdr(c), filesize, filetype);
+    conn_append(c, buf, strlen(buf));
 
-    /* Send response body to client */
+    /* Queue the open file; the output queue reads or sends it and closes it */
+    if (filesize == 0)
+        return;
     srcfd = Open(function_name, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    conn_append_file(c, srcfd, filesize);
 }
 
 /*
@@ -247,237 +1365,640 @@ size_t getfilesize(char* filename) {
 }
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * dispatch_dynamic - serve a dynamic request here, or hand it and its
+ *     connection to the function workers if there are any. The request
+ *     joins admission control first, so its wait in the function's
+ *     bulkhead and on the EDF queue is what admit_start judges. A request
+ *     the bulkhead parks is handed on later by the call that frees a
+ *     slot. Returns REQUEST_MOVED once c belongs to the function workers.
  */
-/* $begin serve_dynamic */
-void serve_dynamic(int fd, char *function_name, char *cgiargs) 
+int dispatch_dynamic(struct conn *c, char *function_name, char *cgiargs)
+{
+    struct function_call *call;
+    struct cache_queue *q = local_cache ? local_cache : cache;
+    struct bulkhead *b = function_bulkhead(q, function_name);
+
+    if (function_workers == NULL) {
+        serve_inline(c, b, function_name, cgiargs);
+        return 0;
+    }
+    if (join_admission(q) < 0) {
+        service_unavailable(c);
+        return 0;
+    }
+    call = Malloc(sizeof(struct function_call));
+    call->c = c;
+    call->b = b;
+    call->admit = &q->admit;
+    call->queued = clock_ms();
+    strcpy(call->function_name, function_name);
+    strcpy(call->cgiargs, cgiargs);
+    if (b != NULL) {
+        switch (bulkhead_enter(b, call)) {
+        case BULKHEAD_WAIT:
+            return REQUEST_MOVED;
+        case BULKHEAD_FULL:
+            goto refuse;
+        }
+    }
+    if (edf_try_push(&calls, c->due ? c->due : EDF_NEVER, call) < 0) {
+        if (b != NULL)
+            release_bulkhead(b);
+        goto refuse;
+    }
+    pool_submit(function_workers, call_next, NULL);
+    return REQUEST_MOVED;
+ refuse:
+    admit_leave(call->admit);
+    Free(call);
+    service_unavailable(c);
+    return 0;
+}
+
+/*
+ * serve_inline - serve a dynamic request on this thread. Nothing can
+ *     wait here, so its bulkhead b (NULL if none) runs it or turns it away.
+ *     The slot may pass to a call parked by thread mode, so it goes back
+ *     through release_bulkhead.
+ */
+void serve_inline(struct conn *c, struct bulkhead *b, char *function_name,
+        char *cgiargs)
+{
+    struct cache_queue *q = local_cache ? local_cache : cache;
+    long queued = clock_ms();
+
+    if (join_admission(q) < 0) {
+        service_unavailable(c);
+        return;
+    }
+    if (b != NULL && bulkhead_enter(b, NULL) != BULKHEAD_RUN) {
+        admit_leave(&q->admit);
+        service_unavailable(c);
+        return;
+    }
+    serve_dynamic(c, &q->admit, queued, function_name, cgiargs);
+    if (b != NULL)
+        release_bulkhead(b);
+}
+
+/*
+ * call_next - function worker task. Every call queued on calls comes with
+ *     one of these, so whichever worker runs it takes the call due first
+ *     rather than the one it was submitted with.
+ */
+void call_next(void* arg)
+{
+    (void)arg;
+    call_function(edf_pop(&calls));
+}
+
+/* call_function - run a call on a function worker; a connection worker sends the result */
+void call_function(void* arg)
+{
+    struct function_call *call = arg;
+
+    serve_dynamic(call->c, call->admit, call->queued, call->function_name,
+            call->cgiargs);
+    if (call->b != NULL)
+        release_bulkhead(call->b);
+    pool_submit(workers, resume_request, call->c);
+    Free(call);
+}
+
+/*
+ * function_bulkhead - the bulkhead of function_name, or NULL if ./lib has
+ *     no such function. Only real functions get one, so requests for
+ *     made-up names cannot grow the table.
+ */
+struct bulkhead *function_bulkhead(struct cache_queue *q, char *function_name)
+{
+    char path[MAXLINE];
+    struct bulkhead *b;
+
+    if ((b = bulkhead_find(q->bulkheads, function_name)) != NULL)
+        return b;
+    snprintf(path, MAXLINE, "./lib/%s.so", function_name);
+    if (access(path, R_OK) < 0)
+        return NULL;
+    return bulkhead_add(q->bulkheads, function_name);
+}
+
+/*
+ * release_bulkhead - give up a slot; a parked call that inherits it goes
+ *     to the function workers, past their queue limit since it was
+ *     already admitted
+ */
+void release_bulkhead(struct bulkhead *b)
+{
+    struct function_call *next;
+
+    if ((next = bulkhead_leave(b)) != NULL) {
+        edf_push(&calls, next->c->due ? next->c->due : EDF_NEVER, next);
+        pool_submit(function_workers, call_next, NULL);
+    }
+}
+
+/* parse_budget - record a "name=ms" default deadline; -1 if malformed */
+int parse_budget(char *arg)
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    struct budget *bg;
+    char *eq = strchr(arg, '=');
 
-    void *handle;
-    void (*function)(int, char*);
-    char *error; 
+    if (eq == NULL || eq == arg || eq - arg >= MAXLINE ||
+            nbudgets == MAX_BUDGETS)
+        return -1;
+    bg = &budgets[nbudgets];
+    memcpy(bg->name, arg, eq - arg);
+    bg->name[eq - arg] = '\0';
+    if (sscanf(eq + 1, "%d", &bg->ms) < 1 || bg->ms < 0)
+        return -1;
+    nbudgets++;
+    return 0;
+}
+
+/*
+ * request_due - when the client stops waiting for a dynamic request:
+ *     its own budget if it sent one, else its function's default, both
+ *     counted from arrival. 0 means no deadline.
+ */
+long request_due(long arrival, char *function_name, long deadline_ms)
+{
+    int i, star = -1;
+
+    if (deadline_ms <= 0) {
+        /* Later -T flags override earlier ones */
+        for (i = nbudgets - 1; i >= 0; i--) {
+            if (!strcmp(budgets[i].name, function_name))
+                break;
+            if (star < 0 && !strcmp(budgets[i].name, "*"))
+                star = i;
+        }
+        if (i < 0)
+            i = star;
+        if (i < 0 || budgets[i].ms == 0)
+            return 0;
+        deadline_ms = budgets[i].ms;
+    }
+    return arrival + deadline_ms;
+}
+
+/*
+ * serve_dynamic - run a library function on behalf of the client
+ *     The function writes into this thread's capture file rather than
+ *     the socket, so its output can be framed with a Content-length and
+ *     queued like any other response. Admission control sits in front
+ *     of the function: a request it turns away costs a 503 and nothing else.
+ *     The request joined admission queue a at ms clock value queued.
+ */
+/* $begin serve_dynamic */
+void serve_dynamic(struct conn *c, struct admit *a, long queued,
+        char *function_name, char *cgiargs) 
+{
+    char buf[MAXLINE];
     size_t size;
+    int fd = conn_capture_fd();
 
-    sprintf(buf, "Hello\n");
-    write(fd, buf, strlen(buf));
-
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    write(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    write(fd, buf, strlen(buf));
-    
-    //#ifdef OLD
-    /* search_cache finds and evaluates function if cached */
-    if ((function = search_cache(function_name, fd, cgiargs)) == NULL) {
-        /* else... add to cache and execute here */
-        pthread_mutex_lock(&mutex);
-        printf("Didn't find in cache, opening file\n");
-        /* DL_Open the corresponding .so file */
-        sprintf(buf, "./lib/%s.so", function_name);
-        size = getfilesize(buf);
-        if ((handle = dlopen(buf, RTLD_LAZY)) == NULL) {
-            sprintf(buf, "%s\n", dlerror());
-            write(fd, buf, strlen(buf));
-            return;
+    switch (call_dynamic(a, queued, function_name, cgiargs, fd, c->due)) {
+    case CALL_SHED:
+        service_unavailable(c);
+        return;
+    case CALL_EXPIRED:
+        deadline_expired(c);
+        return;
+    case CALL_NOT_FOUND:
+        clienterror(c, function_name, "404", "Not found",
+                "Tiny couldn't find this function");
+        return;
+    }
+    if (verbose)
+        printf("served client\n");
+
+    /* Frame the captured output */
+    size = conn_capture_size(fd);
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+            "Server: Tiny Web Server\r\n"
+            "Connection: %s\r\n"
+            "Content-length: %d\r\n"
+            "Content-type: text/html\r\n\r\n",
+            connection_hdr(c), (int)size);
+    conn_append(c, buf, strlen(buf));
+    conn_append_capture(c, fd, size);
+}
+
+/*
+ * join_admission - take a place in q's admission queue for a dynamic
+ *     request; -1 if the queue is full
+ */
+int join_admission(struct cache_queue *q)
+{
+    thread_stats()->dynamic_reqs++;
+    return admit_join(&q->admit);
+}
+
+/*
+ * call_dynamic - run function_name with output to fd for a request that
+ *     joined admission queue a at ms clock value queued, unless it waited
+ *     there too long or is past due (0 for no deadline), then leave the
+ *     queue. Returns one of the CALL_ outcomes; only after CALL_OK is
+ *     there output in fd.
+ */
+int call_dynamic(struct admit *a, long queued, char *function_name,
+        char *cgiargs, int fd, long due)
+{
+    int rc;
+    struct cache_queue *q = local_cache ? local_cache : cache;
+
+    /* About to run; shed the request if it went stale in the queue */
+    rc = CALL_SHED;
+    if (admit_start(a, queued) < 0)
+        goto done;
+    /* Nobody is waiting for an answer past its deadline */
+    rc = CALL_EXPIRED;
+    if (due > 0 && clock_ms() > due)
+        goto done;
+    rc = run_function(q, function_name, fd, cgiargs) < 0 ?
+        CALL_NOT_FOUND : CALL_OK;
+ done:
+    admit_leave(a);
+    return rc;
+}
+
+/*
+ * ring_call - the handler for shared-memory ring requests (-r). A ring
+ *     thread runs functions itself, so like the inline modes it can hold
+ *     a bulkhead slot but not wait for one. The slot goes back through
+ *     release_bulkhead, since a parked thread-mode call may inherit it.
+ */
+int ring_call(char *function_name, char *args, int deadline_ms, int fd)
+{
+    struct bulkhead *b = function_bulkhead(cache, function_name);
+    long arrival = clock_ms();
+    int rc;
+
+    if (join_admission(cache) < 0) {
+        thread_stats()->shed++;
+        return 503;
+    }
+    if (b != NULL && bulkhead_enter(b, NULL) != BULKHEAD_RUN) {
+        admit_leave(&cache->admit);
+        thread_stats()->shed++;
+        return 503;
+    }
+    rc = call_dynamic(&cache->admit, arrival, function_name, args, fd,
+            request_due(arrival, function_name, deadline_ms));
+    if (b != NULL)
+        release_bulkhead(b);
+    switch (rc) {
+    case CALL_SHED:
+        thread_stats()->shed++;
+        return 503;
+    case CALL_EXPIRED:
+        thread_stats()->expired++;
+        return 503;
+    case CALL_NOT_FOUND:
+        thread_stats()->errors++;
+        return 404;
+    }
+    return 200;
+}
+
+/*
+ * run_function - run function_name with output to fd, loading it into q
+ *     on a miss. Any number of threads may run functions at once; only
+ *     loading is serialized, and a thread that waited for the loader
+ *     looks again first, since the thread before it may have loaded the
+ *     same function. The lookup's epoch section lasts until the function
+ *     returns, which keeps its library loaded. Returns -1 if the function
+ *     cannot be found.
+ */
+int run_function(struct cache_queue *q, char *function_name, int fd,
+        char *cgiargs)
+{
+    cache_obj obj;
+
+    fcache_read_begin(&q->index);
+    if ((obj = search_cache(q, function_name)) != NULL)
+        thread_stats()->cache_hits++;
+    else {
+        loader_lock(q);
+        if ((obj = search_cache(q, function_name)) != NULL)
+            thread_stats()->cache_hits++;
+        else {
+            thread_stats()->cache_misses++;
+            if (verbose)
+                printf("Didn't find in cache, opening file\n");
+            obj = load_function(q, function_name);
         }
+        loader_unlock(q);
+    }
+    if (obj != NULL)
+        obj->function(fd, cgiargs);
+    fcache_read_end(&q->index);
+    return obj != NULL ? 0 : -1;
+}
+
+/*
+ * unload_function - close an evicted entry's library once no reader can
+ *     reach it
+ */
+void unload_function(cache_obj obj)
+{
+    /* unload the shared library */
+    if (dlclose(obj->handle) < 0) {
+        fprintf(stderr, "%s\n", dlerror());
+    }
+    free(obj->name);
+    free(obj);
+}
 
+/*
+ * load_function - dlopen function_name's library into q and return its
+ *     entry, or NULL if it cannot be found. A library without
+ *     the function is closed again rather than cached. Called with q's
+ *     loader lock held.
+ */
+cache_obj load_function(struct cache_queue* q, char* function_name)
+{
+    char buf[MAXLINE];
+    void *handle, *function;
+    char *error;
+    size_t size;
+
+    /* DL_Open the corresponding .so file */
+    sprintf(buf, "./lib/%s.so", function_name);
+    size = getfilesize(buf);
+    if ((handle = dlopen(buf, RTLD_LAZY)) == NULL) {
+        printf("%s\n", dlerror());
+        return NULL;
+    }
+
+    if (verbose)
         printf("Opened file and got handle to function\n");
-        /* Get the function (from dlysm) and add to cache */
-        function = (void (*)(int, char*)) add_to_cache(function_name, handle, size);
+    /* Resolve the function once; hits call it straight from the cache */
+    dlerror();
+    function = dlsym(handle, function_name);
+    if ((error = dlerror()) != NULL || function == NULL) {
+        printf("Invalid function error: %s %s\n", function_name,
+                error != NULL ? error : "is NULL");
+        dlclose(handle);
+        return NULL;
+    }
+    return add_to_cache(q, function_name, handle, (dynamic_fn)function, size);
+}
 
-        if ((error = dlerror()) != NULL) {
-            printf("Invalid function error: %s %s\n", function_name, error);
-            sprintf(buf, "Invalid function %s\n", function_name);
-            Rio_writen(fd, buf, strlen(buf));
-            return;
-        }
-        
-        /* Execute the function */
-        if (function != NULL) {
-           function(fd, cgiargs);
-        }
+/*
+ * warm_cache - load into q the functions the tiny upgraded from had
+ *     cached (-U), so their first requests find them. Returns how many
+ *     were loaded.
+ */
+int warm_cache(struct cache_queue *q)
+{
+    char **names;
+    int i, n, loaded = 0;
 
-        /* At this point the function is complete and in the cache */
-        pthread_mutex_unlock(&mutex);
-        printf("released mutex, served client\n");
+    names = upgrade_functions(&n);
+    for (i = 0; i < n; i++) {
+        loader_lock(q);
+        if (load_function(q, names[i]) != NULL)
+            loaded++;
+        loader_unlock(q);
     }
-    //#endif
+    return loaded;
 }
 /* $end serve_dynamic */
 
-/* cleanup -- Frees up descriptors in use and ends thread */
-void cleanup(int fd) {
-    Close(fd);
-	Pthread_exit(NULL);
+/*
+ * service_unavailable - the cheap answer for a request that admission
+ *     control or a bulkhead turned away
+ */
+void service_unavailable(struct conn *c)
+{
+    thread_stats()->shed++;
+    send_unavailable(c);
+}
+
+/* deadline_expired - the answer for a request dropped past its deadline */
+void deadline_expired(struct conn *c)
+{
+    thread_stats()->expired++;
+    send_unavailable(c);
+}
+
+/* send_unavailable - queue a bodiless 503 asking the client to come back */
+void send_unavailable(struct conn *c)
+{
+    char buf[MAXLINE];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 503 Service Unavailable\r\n"
+            "Connection: %s\r\n"
+            "Retry-After: 1\r\n"
+            "Content-length: 0\r\n\r\n",
+            connection_hdr(c));
+    conn_append(c, buf, strlen(buf));
+}
+
+/* connection_hdr - value of the Connection header for c's response */
+char *connection_hdr(struct conn *c)
+{
+    return c->keepalive ? "keep-alive" : "close";
 }
 
 /*
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(struct conn *c, char *cause, char *errnum, 
         char *shortmsg, char *longmsg) 
 {
     char buf[MAXLINE], body[MAXBUF];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    thread_stats()->errors++;
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %s\r\n"
+            "<hr><em>The Tiny Web server</em>\r\n",
+            errnum, shortmsg, longmsg, cause);
+
+    /* Queue the HTTP response */
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s %s\r\n"
+            "Connection: %s\r\n"
+            "Content-type: text/html\r\n"
+            "Content-length: %d\r\n\r\n",
+            errnum, shortmsg, connection_hdr(c), (int)strlen(body));
+    conn_append(c, buf, strlen(buf));
+    conn_append(c, body, strlen(body));
 }
 /* $end clienterror */
 
 /******* CACHE FUNCTIONS ******/
-void init_cache() {
-	/*Create dummy node, initialize all fields to NULL or 0 */
-	cache_obj dummy_node = Calloc(1, sizeof(struct cache_object));
-    dummy_node->name = NULL;
-    dummy_node->handle = NULL;
-    dummy_node->next = NULL;
-    dummy_node->size = 0;
-	
+struct cache_queue* init_cache(int shared) {
+	struct cache_queue* cache;
+
 	cache = Malloc(sizeof(struct cache_queue));
-	cache->front = dummy_node;
-	cache->back = dummy_node;
-	cache->size = 0;
-	init_lock(&cache->lock);
+	fcache_init(&cache->index, shared, eviction, unload_function);
+	cache->shared = shared;
+	pthread_mutex_init(&cache->loader, NULL);
+	admit_init(&cache->admit, max_queued, queue_target, shared);
+	cache->bulkheads = bulkheads_create(shared);
+	pthread_mutex_lock(&all_caches_lock);
+	cache->next = all_caches;
+	all_caches = cache;
+	pthread_mutex_unlock(&all_caches_lock);
+	return cache;
 }
 
-/* Always called under protection of mutex */
-void evict_lru() {
-    cache_obj first = cache->front->next;
-    cache->front->next = first->next;
-    if (first == cache->back)
-        cache->back = cache->front;
-    cache->size -= first->size;
+/*
+ * trim_caches - evict from every shared shard down to cache_capacity. A
+ *     function still running keeps its library until it returns. A
+ *     core's private shard is only touched by its own core, so it
+ *     shrinks on its next load instead.
+ */
+void trim_caches(void) {
+	struct cache_queue *q;
 
-    printf("Evicting %s from the cache.\n", first->name);
-    /* unload the shared library */
-    if (dlclose(first->handle) < 0) {
-        fprintf(stderr, "%s\n", dlerror());
-    }
+	pthread_mutex_lock(&all_caches_lock);
+	for (q = all_caches; q != NULL; q = q->next) {
+		if (!q->shared)
+			continue;
+		write_lock(q);
+		while (q->index.size > cache_capacity)
+			evict_function(q);
+		unlock(q);
+	}
+	pthread_mutex_unlock(&all_caches_lock);
+}
+
+/* configure_admission - apply max_queued and queue_target to every shard */
+void configure_admission(void) {
+	struct cache_queue *q;
+
+	pthread_mutex_lock(&all_caches_lock);
+	for (q = all_caches; q != NULL; q = q->next)
+		admit_configure(&q->admit, max_queued, queue_target);
+	pthread_mutex_unlock(&all_caches_lock);
+}
+
+/*
+ * evict_function - drop the entry the eviction policy picks; its library
+ *     is closed once no running call can reach it. Called under
+ *     write_lock.
+ */
+void evict_function(struct cache_queue* q) {
+    cache_obj first = fcache_victim(&q->index);
 
-    free(first->name);
-    free(first);
+    if (verbose)
+        printf("Evicting %s from the cache.\n", first->name);
+    note_loaded(first->name, -1);
+    fcache_remove(&q->index, first);
 }
 
-cache_obj create_node(char* name, void* handle, int size) {
-	cache_obj new_node = Malloc(sizeof(struct cache_object));
+/* add_to_cache - returns the new entry; under the loader lock */
+cache_obj add_to_cache(struct cache_queue* q, char* name, void* handle,
+        dynamic_fn function, int size) {
+    cache_obj new_node;
 
-    new_node->name = Calloc(strlen(name)+1, sizeof(char));
-    strncpy(new_node->name, name, strlen(name));
+    write_lock(q);
+    if (verbose)
+        printf("Adding %s to cache.\n", name);
+    /*Evicts if necessary until there is enough space to cache */
+    while (q->index.size > cache_capacity)
+        evict_function(q);
 
-	new_node->handle = handle;
-	new_node->size = size;
-	new_node->next = NULL;
-	
+    new_node = fcache_entry_new(name, handle, function, size);
+    note_loaded(name, 1);
+    fcache_insert(&q->index, new_node);
+    unlock(q);
+
+    if (verbose)
+        printf("Done adding %s to cache\n", name);
     return new_node;
 }
 
-/* Always called under protection of mutex */
-void* add_to_cache(char* name, void* handle, int size) {
-    void* function;
-	write_lock();
-    printf("Adding %s to cache.\n", name);
-	/*Evicts if necessary until there is enough space to cache */
-	while (cache->size > MAX_CACHE_SIZE) 
-        evict_lru();
-
-    /* Create new node and add to back of cache */
-    cache_obj new_node = create_node(name, handle, size);
-	cache->back->next = new_node;
-	cache->back = new_node;
-	cache->size += size;
-	unlock();
-
-    /* Open the shared library containing function name */
-    sprintf(scratch, "./lib/%s.so", name);
-    
-    /* Resolve the function */
-    function = dlsym(handle, name);
-    printf("Done adding %s to cache\n", name);
-    return function;
-}
-
-void* search_cache(char* name, int fd, char* cgiargs) {
-    void (*function)(int, char*);
-
-	read_lock();
-	cache_obj cur = cache->front->next;
-    cache_obj prev = cache->front;
-	for (; cur; cur = cur->next) {
-		/*If next matches key, object is found */
-		if (!strcmp(cur->name, name)) {
-			pthread_mutex_lock(&mutex);
-			unlock(); /* Unlocks the read lock*/
-            if (cur != cache->back) {
-                /* Takes the write lock to move to the end of the cache */
-                write_lock();
-                prev->next = cur->next;
-                cache->back->next = cur;
-                cache->back = cur;
-                cur->next = NULL;
-                unlock(); /* Unlocks the write lock */
-            }
-            
-            /* Found in the cache, get and execute function */
-            function = dlsym(cur->handle, name);
-
-            if (dlerror() != NULL) {
-                sprintf(scratch, "Invalid function %s\n", name);
-                Rio_writen(fd, scratch, strlen(scratch));
-                return NULL;
-            }
+/*
+ * search_cache - find name in q without a lock, or NULL. Only between
+ *     fcache_read_begin and fcache_read_end on q's index.
+ */
+cache_obj search_cache(struct cache_queue* q, char* name) {
+	return fcache_find(&q->index, name);
+}
 
-            function(fd, cgiargs);
-            pthread_mutex_unlock(&mutex);
-			return cur->handle;
-		}
-        prev = cur;
-	}
-	/*If reached here, key not found in cache. */
-	unlock();
-	return NULL;
+/*
+ * Every function loaded in some cache shard, with how many shards hold
+ * it, so an upgrade (-U) can list them without walking the private
+ * shards of other cores. Only loads and evictions touch it.
+ */
+struct loaded_function {
+    char *name;
+    int count;
+    struct loaded_function *next;
+};
+struct loaded_function *loaded_functions;
+pthread_mutex_t loaded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* note_loaded - count a shard loading (1) or evicting (-1) name */
+void note_loaded(char *name, int delta) {
+    struct loaded_function *f;
+
+    pthread_mutex_lock(&loaded_lock);
+    for (f = loaded_functions; f != NULL; f = f->next)
+        if (!strcmp(f->name, name))
+            break;
+    if (f == NULL) {
+        f = Calloc(1, sizeof(struct loaded_function));
+        f->name = strdup(name);
+        f->next = loaded_functions;
+        loaded_functions = f;
+    }
+    f->count += delta;
+    pthread_mutex_unlock(&loaded_lock);
+    /* A prefork worker's one shard also answers for it in the directory */
+    prefork_note(name, delta > 0);
+}
+
+/* cached_functions - a Malloc'd list of the loaded functions, one per line */
+char *cached_functions(void) {
+    struct loaded_function *f;
+    size_t len = 1;
+    char *buf;
+
+    pthread_mutex_lock(&loaded_lock);
+    for (f = loaded_functions; f != NULL; f = f->next)
+        if (f->count > 0)
+            len += strlen(f->name) + 1;
+    buf = Malloc(len);
+    buf[0] = '\0';
+    for (f = loaded_functions; f != NULL; f = f->next)
+        if (f->count > 0) {
+            strcat(buf, f->name);
+            strcat(buf, "\n");
+        }
+    pthread_mutex_unlock(&loaded_lock);
+    return buf;
 }
 
 /******* LOCK WRAPPER FUNCTIONS ******/
-void init_lock(pthread_rwlock_t* lock) {
-	if (pthread_rwlock_init(lock, NULL) != 0) {
-		fprintf(stderr, "Error: Init lock failed.\n");
-		exit(-1);
-	}
+/* write_lock - serialize changes to q's index; free in a private shard */
+void write_lock(struct cache_queue* q) {
+	fcache_lock(&q->index);
 }
 
-void write_lock() {
-	if (pthread_rwlock_wrlock((pthread_rwlock_t*) (&cache->lock)) != 0) {
-		fprintf(stderr, "Error: Write lock failed.\n");
-		exit(-1);
-	}
+void unlock(struct cache_queue* q) {
+	fcache_unlock(&q->index);
 }
 
-void read_lock() {
-	if (pthread_rwlock_rdlock((pthread_rwlock_t*) (&cache->lock)) != 0) {
-		fprintf(stderr, "Error: Read lock failed.\n");
-		exit(-1);
-	}
+/*
+ * loader_lock - serialize loading functions into a shared shard. Each
+ *     shard has its own loader lock, so a load in one node's shard does
+ *     not hold up loads in another's.
+ */
+void loader_lock(struct cache_queue* q) {
+	if (q->shared)
+		pthread_mutex_lock(&q->loader);
 }
 
-void unlock() {
-	if (pthread_rwlock_unlock((pthread_rwlock_t*) (&cache->lock)) != 0) {
-		fprintf(stderr, "Error: Unlock failed.\n");
-		exit(-1);
-	}
+void loader_unlock(struct cache_queue* q) {
+	if (q->shared)
+		pthread_mutex_unlock(&q->loader);
 }
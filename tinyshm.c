@@ -0,0 +1,205 @@
+/*
+ * tinyshm.c - client library for tiny's shared-memory call rings
+ *
+ * Depends only on libc, so callers need not link csapp.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shm.h"
+#include "tinyshm.h"
+
+#define CHECK_MS 1000   /* how often a sleeping caller looks for tiny */
+
+struct tinyshm {
+    int ctlfd;
+    struct shm_ring *ring;
+    unsigned next;      /* where the next slot search starts */
+    uint32_t freed;     /* bumped as a slot is freed; claim sleeps on it */
+    uint32_t claimers;  /* threads asleep in claim */
+};
+
+/* send_fd - pass fd to tiny over the control socket with SCM_RIGHTS */
+static int send_fd(int sock, int fd) {
+    char byte = 0, cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/*
+ * tinyshm_open - create the ring in a memfd sealed against shrinking,
+ *     hand it to tiny and wait for tiny to say it is serving it
+ */
+struct tinyshm *tinyshm_open(const char *path) {
+    struct tinyshm *t;
+    struct sockaddr_un addr;
+    int memfd, err;
+    char ack;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if ((t = calloc(1, sizeof(struct tinyshm))) == NULL)
+        return NULL;
+    t->ctlfd = -1;
+    t->ring = MAP_FAILED;
+    if ((memfd = memfd_create("tinyshm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        goto fail;
+    if (ftruncate(memfd, sizeof(struct shm_ring)) < 0 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+        goto fail;
+    t->ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED, memfd, 0);
+    if (t->ring == MAP_FAILED)
+        goto fail;
+    t->ring->magic = SHM_MAGIC;
+    t->ring->nslots = SHM_SLOTS;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((t->ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            connect(t->ctlfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            send_fd(t->ctlfd, memfd) < 0)
+        goto fail;
+    if (recv(t->ctlfd, &ack, 1, 0) != 1) {
+        errno = ECONNREFUSED;
+        goto fail;
+    }
+    close(memfd);
+    return t;
+
+ fail:
+    err = errno;
+    if (memfd >= 0)
+        close(memfd);
+    tinyshm_close(t);
+    errno = err;
+    return NULL;
+}
+
+/* tiny_gone - whether tiny closed the control socket */
+static int tiny_gone(struct tinyshm *t) {
+    char byte;
+    ssize_t n = recv(t->ctlfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/*
+ * claim - take a free slot. If every slot is in use, sweep again for a
+ *     while, then sleep until a call frees one, looking for tiny every
+ *     CHECK_MS. A slot freed after the sweep changes freed, so the sleep
+ *     cannot miss it. Returns NULL with ECONNRESET once tiny is gone,
+ *     since the slots it holds will never come back.
+ */
+static struct shm_slot *claim(struct tinyshm *t) {
+    struct shm_slot *s;
+    uint32_t expect, freed;
+    unsigned i, start = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+    long sweeps;
+
+    for (sweeps = 0; ; sweeps++) {
+        freed = __atomic_load_n(&t->freed, __ATOMIC_SEQ_CST);
+        for (i = start; i < start + SHM_SLOTS; i++) {
+            s = &t->ring->slots[i % SHM_SLOTS];
+            expect = SHM_FREE;
+            if (__atomic_compare_exchange_n(&s->state, &expect, SHM_CLAIMED,
+                        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return s;
+        }
+        if (sweeps < shm_spin()) {
+            shm_relax();
+            continue;
+        }
+        __atomic_fetch_add(&t->claimers, 1, __ATOMIC_SEQ_CST);
+        shm_wait(&t->freed, freed, CHECK_MS);
+        __atomic_fetch_sub(&t->claimers, 1, __ATOMIC_SEQ_CST);
+        if (tiny_gone(t)) {
+            errno = ECONNRESET;
+            return NULL;
+        }
+    }
+}
+
+int tinyshm_call(struct tinyshm *t, const char *function, const char *args,
+        int deadline_ms, char *buf, size_t *len) {
+    size_t flen = strlen(function) + 1, alen = strlen(args) + 1, n;
+    struct shm_ring *r = t->ring;
+    struct shm_slot *s;
+    uint32_t state;
+    long spins;
+    int status;
+
+    if (flen + alen > SHM_DATA) {
+        errno = E2BIG;
+        return -1;
+    }
+    if ((s = claim(t)) == NULL)
+        return -1;
+    memcpy(s->data, function, flen);
+    memcpy(s->data + flen, args, alen);
+    s->len = flen + alen;
+    s->deadline_ms = deadline_ms;
+    s->waiting = 0;
+    __atomic_store_n(&s->state, SHM_REQUEST, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&r->doorbell, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST))
+        shm_wake(&r->doorbell);
+
+    /* Spin for the reply, then sleep until tiny sees waiting and wakes us */
+    for (spins = 0; __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SHM_DONE;
+            spins++) {
+        if (spins < shm_spin()) {
+            shm_relax();
+            continue;
+        }
+        __atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+        state = __atomic_load_n(&s->state, __ATOMIC_SEQ_CST);
+        if (state == SHM_DONE)
+            break;
+        shm_wait(&s->state, state, CHECK_MS);
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SHM_DONE &&
+                tiny_gone(t)) {
+            errno = ECONNRESET;
+            return -1;      /* the slot stays taken; the ring is dead */
+        }
+    }
+    n = s->len < *len ? s->len : *len;
+    memcpy(buf, s->data, n);
+    *len = s->len;
+    status = s->status;
+    __atomic_store_n(&s->state, SHM_FREE, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&t->freed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&t->claimers, __ATOMIC_SEQ_CST))
+        shm_wake(&t->freed);
+    return status;
+}
+
+void tinyshm_close(struct tinyshm *t) {
+    if (t->ctlfd >= 0)
+        close(t->ctlfd);
+    if (t->ring != MAP_FAILED)
+        munmap(t->ring, sizeof(struct shm_ring));
+    free(t);
+}
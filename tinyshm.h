@@ -0,0 +1,35 @@
+/*
+ * tinyshm.h - client library for calling tiny's lib/ functions over a
+ *     shared-memory ring (see shm.h) instead of HTTP
+ *
+ *     struct tinyshm *t = tinyshm_open("/tmp/tiny.ring");
+ *     char out[256];
+ *     size_t len = sizeof(out);
+ *     int status = tinyshm_call(t, "adder", "1&2", 0, out, &len);
+ *
+ * A handle may be shared by up to SHM_SLOTS threads calling at once;
+ * more sleep until a slot frees up. Link with libtinyshm.a.
+ */
+#ifndef __TINYSHM_H__
+#define __TINYSHM_H__
+
+#include <stddef.h>
+
+struct tinyshm;
+
+/* Attaches a new ring to tiny's -r socket at path; NULL and errno on error */
+struct tinyshm *tinyshm_open(const char *path);
+
+/*
+ * Runs function(args) in tiny, within deadline_ms if that is positive.
+ * Copies up to *len bytes of its output to buf and sets *len to the full
+ * output length. Returns the HTTP status (200, 404, 503, or 500 if the
+ * output overflowed a slot), or -1 and errno if the call could not be
+ * made or tiny went away.
+ */
+int tinyshm_call(struct tinyshm *t, const char *function, const char *args,
+        int deadline_ms, char *buf, size_t *len);
+
+void tinyshm_close(struct tinyshm *t);
+
+#endif /* __TINYSHM_H__ */
@@ -0,0 +1,227 @@
+/*
+ * tls.c - TLS termination for tiny
+ */
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define SESSION_CACHE_SIZE 20480    /* sessions kept for resumption by ID */
+#define SESSION_TIMEOUT 300         /* seconds a session can be resumed */
+#define TICKETS 1                   /* TLS 1.3 tickets sent per handshake */
+
+struct tls {
+    SSL *ssl;
+    int ready;          /* the handshake has completed */
+    int failed;         /* a fatal error; no close_notify */
+    int kernel_send;    /* kTLS encrypts writes to the socket */
+};
+
+static SSL_CTX *ctx;
+static int tls_port;
+static int offer_h2;
+static int reported;    /* whether the kTLS state was printed */
+
+/* ALPN protocol lists, each name prefixed with its length */
+static const unsigned char alpn_h2[] = "\002h2\010http/1.1";
+static const unsigned char alpn_http1[] = "\010http/1.1";
+
+/* select_alpn - pick the client's first protocol that tiny serves */
+static int select_alpn(SSL *ssl, const unsigned char **out,
+        unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+        void *arg) {
+    const unsigned char *protos = offer_h2 ? alpn_h2 : alpn_http1;
+    unsigned int len = offer_h2 ? sizeof(alpn_h2) - 1 : sizeof(alpn_http1) - 1;
+
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, len,
+                in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(int port, char *cert, char *key, int h2) {
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* A client closing without close_notify is just EOF, as over TCP */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "tls: cannot use certificate %s and key %s\n",
+                cert, key);
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"tiny", 4);
+    SSL_CTX_set_num_tickets(ctx, TICKETS);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    tls_port = port;
+    offer_h2 = h2;
+    return 0;
+}
+
+struct tls *tls_accept(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct tls *t;
+    int port;
+
+    if (ctx == NULL || getsockname(fd, (SA *)&addr, &len) < 0)
+        return NULL;
+    if (addr.ss_family == AF_INET)
+        port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    else if (addr.ss_family == AF_INET6)
+        port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    else
+        return NULL;
+    if (port != tls_port)
+        return NULL;
+
+    t = Calloc(1, sizeof(struct tls));
+    if ((t->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(t->ssl, fd) != 1)
+        app_error("SSL_new error");
+    SSL_set_accept_state(t->ssl);
+    return t;
+}
+
+/*
+ * fail - map an SSL call's failure to a read-like result: -1 with errno
+ *     EAGAIN if the socket would block, 0 on a clean close, otherwise -1
+ *     with errno set and the session marked failed. The thread's error
+ *     queue is cleared, since SSL_get_error on the next connection the
+ *     thread serves would otherwise see these errors.
+ */
+static ssize_t fail(struct tls *t, int rc) {
+    switch (SSL_get_error(t->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0 || errno == EAGAIN)
+            errno = ECONNRESET;
+        break;
+    default:
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    t->failed = 1;
+    return -1;
+}
+
+/*
+ * handshake - push the handshake as far as the socket allows. Returns 1
+ *     once it is complete, otherwise as fail. The first completed
+ *     handshake prints whether the kernel took over encryption.
+ */
+static int handshake(struct tls *t) {
+    int rc;
+
+    if ((rc = SSL_do_handshake(t->ssl)) != 1)
+        return fail(t, rc);
+    t->ready = 1;
+    t->kernel_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    if (!reported && __sync_bool_compare_and_swap(&reported, 0, 1)) {
+        printf("tls: %s, %s\n", SSL_get_version(t->ssl), t->kernel_send ?
+                "kernel TLS sends" : "no kernel TLS, encrypting in user space");
+        fflush(stdout);
+    }
+    return 1;
+}
+
+ssize_t tls_read(void *arg, void *buf, size_t n) {
+    struct tls *t = arg;
+    int rc;
+
+    if (t->failed) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (!t->ready && (rc = handshake(t)) <= 0)
+        return rc;
+    if ((rc = SSL_read(t->ssl, buf, n > INT_MAX ? INT_MAX : n)) > 0)
+        return rc;
+    return fail(t, rc);
+}
+
+ssize_t tls_write(struct tls *t, const void *buf, size_t n) {
+    int rc;
+
+    if (t->failed) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (!t->ready && (rc = handshake(t)) <= 0) {
+        if (rc == 0)
+            errno = EPIPE;
+        return -1;
+    }
+    if ((rc = SSL_write(t->ssl, buf, n > INT_MAX ? INT_MAX : n)) > 0)
+        return rc;
+    if (fail(t, rc) == 0)
+        errno = EPIPE;
+    return -1;
+}
+
+int tls_kernel_send(struct tls *t) {
+    return t->kernel_send;
+}
+
+int tls_pending(struct tls *t) {
+    return SSL_pending(t->ssl);
+}
+
+void tls_free(struct tls *t) {
+    if (t->ready && !t->failed)
+        SSL_shutdown(t->ssl);
+    SSL_free(t->ssl);
+    ERR_clear_error();
+    Free(t);
+}
+
+#else /* !HAVE_OPENSSL: no connection ever gets a session */
+
+int tls_init(int port, char *cert, char *key, int h2) {
+    fprintf(stderr, "tls: built without OpenSSL\n");
+    return -1;
+}
+
+struct tls *tls_accept(int fd) {
+    return NULL;
+}
+
+ssize_t tls_read(void *t, void *buf, size_t n) {
+    errno = EBADF;
+    return -1;
+}
+
+ssize_t tls_write(struct tls *t, const void *buf, size_t n) {
+    errno = EBADF;
+    return -1;
+}
+
+int tls_kernel_send(struct tls *t) {
+    return 0;
+}
+
+int tls_pending(struct tls *t) {
+    return 0;
+}
+
+void tls_free(struct tls *t) {
+}
+
+#endif /* HAVE_OPENSSL */
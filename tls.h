@@ -0,0 +1,56 @@
+/*
+ * tls.h - TLS termination for tiny
+ *
+ * Connections accepted on the TLS port (-s) get a server session from
+ * tls_accept. The handshake is run lazily by the first tls_read or
+ * tls_write, so it goes through whatever blocking, coroutine or event
+ * loop machinery the serving mode already has for the socket: both
+ * return -1 with errno EAGAIN when the socket would block, like read and
+ * write on a non-blocking socket.
+ *
+ * The context asks OpenSSL for kernel TLS. When the kernel has the tls
+ * module and the negotiated cipher suits it, the kernel takes over record
+ * encryption on the send side after the handshake (tls_kernel_send), and
+ * conn_flush keeps writing the socket directly, sendfile included, so
+ * static files still leave without being copied through user space.
+ * Otherwise the connection's output goes through tls_write.
+ *
+ * Resumed handshakes skip the certificate and key exchange: the server
+ * keeps a session cache for session IDs and also issues session tickets
+ * (TLS 1.3 and 1.2). ALPN offers h2 when tiny serves HTTP/2 and
+ * http/1.1 always.
+ *
+ * Only built when OpenSSL is found (HAVE_OPENSSL); otherwise tls_init
+ * fails and tiny rejects -s.
+ */
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include "csapp.h"
+
+struct tls;
+
+/*
+ * Sets up the server context for connections accepted on port, from a
+ * PEM certificate chain and private key. h2 offers HTTP/2 through ALPN.
+ * Returns -1, after printing why, on failure.
+ */
+int tls_init(int port, char *cert, char *key, int h2);
+
+/* A session for the socket fd if it was accepted on the TLS port, or NULL */
+struct tls *tls_accept(int fd);
+
+/* Read and write through the session; t is a struct tls * */
+ssize_t tls_read(void *t, void *buf, size_t n);
+ssize_t tls_write(struct tls *t, const void *buf, size_t n);
+
+/* Has the kernel taken over encrypting what is written to the socket? */
+int tls_kernel_send(struct tls *t);
+
+/* Decrypted bytes the session holds that the socket will not signal */
+int tls_pending(struct tls *t);
+
+/* Sends close_notify if the handshake completed, and frees t */
+void tls_free(struct tls *t);
+
+#endif /* __TLS_H__ */
@@ -0,0 +1,121 @@
+/*
+ * topo.c - CPU and NUMA node topology, and thread placement
+ */
+#include "topo.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+static int nnodes = 1;
+static int node_of[CPU_SETSIZE];
+static cpu_set_t node_cpus[TOPO_MAX_NODES];
+
+/* topo_init - read each node's cpulist; CPUs never listed stay on node 0 */
+void topo_init(void) {
+    char path[MAXLINE], list[MAXBUF];
+    FILE *fp;
+    int node, cpu;
+
+    CPU_ZERO(&node_cpus[0]);
+    for (cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF) && cpu < CPU_SETSIZE; cpu++)
+        CPU_SET(cpu, &node_cpus[0]);
+    for (node = 0; node < TOPO_MAX_NODES; node++) {
+        sprintf(path, NODE_DIR "/node%d/cpulist", node);
+        if ((fp = fopen(path, "r")) == NULL)
+            break;
+        if (fgets(list, sizeof(list), fp) == NULL ||
+                topo_parse(list, &node_cpus[node]) < 0)
+            CPU_ZERO(&node_cpus[node]);     /* a node without CPUs */
+        fclose(fp);
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &node_cpus[node]))
+                node_of[cpu] = node;
+    }
+    if (node > 1)
+        nnodes = node;
+}
+
+int topo_nnodes(void) {
+    return nnodes;
+}
+
+int topo_node(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE ? node_of[cpu] : 0;
+}
+
+int topo_parse(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*p && *p != '\n') {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* topo_format - print set as ranges, e.g. "0-3,8" */
+char *topo_format(const cpu_set_t *set, char *buf, size_t len) {
+    int cpu, start, n = 0;
+
+    buf[0] = '\0';
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        for (start = cpu; cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, set); cpu++)
+            ;
+        if (start == cpu)
+            n += snprintf(buf + n, len - n, "%s%d", n ? "," : "", cpu);
+        else
+            n += snprintf(buf + n, len - n, "%s%d-%d", n ? "," : "", start, cpu);
+        if ((size_t)n >= len)
+            break;
+    }
+    return buf;
+}
+
+int topo_nth(const cpu_set_t *set, int n) {
+    int cpu;
+
+    n %= CPU_COUNT(set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    return -1;
+}
+
+int topo_pin(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+}
+
+void topo_report(void) {
+    char buf[MAXLINE];
+    int node;
+
+    printf("topology: %d node%s, %ld cpus online\n", nnodes,
+            nnodes > 1 ? "s" : "", sysconf(_SC_NPROCESSORS_ONLN));
+    for (node = 0; node < nnodes; node++)
+        printf("  node %d: cpus %s\n", node,
+                topo_format(&node_cpus[node], buf, sizeof(buf)));
+}
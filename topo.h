@@ -0,0 +1,43 @@
+/*
+ * topo.h - CPU and NUMA node topology, and thread placement
+ *
+ * The node of each CPU is read from sysfs at topo_init; a kernel without
+ * NUMA support is treated as a single node holding every CPU. Memory is
+ * not placed explicitly: Linux puts a page on the node of the thread
+ * that first touches it, so a pinned thread that allocates and fills its
+ * own buffers gets them node-local.
+ */
+#ifndef __TOPO_H__
+#define __TOPO_H__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include "csapp.h"
+
+#define TOPO_MAX_NODES 64
+
+void topo_init(void);
+
+int topo_nnodes(void);
+
+/* The node of cpu, or 0 if it is unknown */
+int topo_node(int cpu);
+
+/* Parses a cpu list such as "0-3,8,10-11"; -1 if malformed or empty */
+int topo_parse(const char *list, cpu_set_t *set);
+
+/* Formats set as a cpu list into buf of length len */
+char *topo_format(const cpu_set_t *set, char *buf, size_t len);
+
+/* The n-th CPU of set, counting round it as often as needed */
+int topo_nth(const cpu_set_t *set, int n);
+
+/* Pins the calling thread to cpu; -1 if that fails */
+int topo_pin(int cpu);
+
+/* Prints the nodes and their CPUs */
+void topo_report(void);
+
+#endif /* __TOPO_H__ */
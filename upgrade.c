@@ -0,0 +1,310 @@
+/*
+ * upgrade.c - handing a running tiny's sockets to a new binary (-U)
+ */
+#define _GNU_SOURCE
+#include <sys/un.h>
+#include "upgrade.h"
+#include "conn.h"
+
+#define MAX_HANDOFF 250         /* sockets per handoff; the kernel allows 253 */
+#define MAX_ACCEPTORS 256
+#define DRAIN_CHECK_MS 100      /* how often a draining tiny looks again */
+
+/* The first message of a handoff; the sockets ride along with it */
+struct handoff {
+    int nfds;
+    int roles[MAX_HANDOFF];
+};
+
+/* Listening sockets this tiny would hand over */
+static int fds[MAX_HANDOFF], roles[MAX_HANDOFF], nfds;
+static pthread_mutex_t fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the old tiny handed over; a taken socket's slot is set to -1 */
+static struct handoff inherited;
+static int inherited_fds[MAX_HANDOFF];
+static char **functions;
+static int nfunctions;
+static int ctlfd = -1;  /* to the old tiny, until it is told to go */
+
+/* Threads blocked in accept, to be interrupted by a handover */
+static pthread_t acceptors[MAX_ACCEPTORS];
+static int nacceptors;
+
+static volatile int draining;
+
+struct server {
+    int listenfd;
+    struct upgrade_ops ops;
+    int drain_ms;
+};
+
+/* recv_handoff - read the handoff header and the sockets passed with it */
+static int recv_handoff(int sock) {
+    char cbuf[CMSG_SPACE(MAX_HANDOFF * sizeof(int))];
+    struct iovec iov = { &inherited, sizeof(inherited) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+            sizeof(inherited) || (msg.msg_flags & MSG_CTRUNC))
+        return -1;
+    if (inherited.nfds < 0 || inherited.nfds > MAX_HANDOFF)
+        return -1;
+    if (inherited.nfds == 0)
+        return 0;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(inherited.nfds * sizeof(int)))
+        return -1;
+    memcpy(inherited_fds, CMSG_DATA(cmsg), inherited.nfds * sizeof(int));
+    return 0;
+}
+
+/* send_handoff - send the header and this tiny's listening sockets */
+static int send_handoff(int sock) {
+    char cbuf[CMSG_SPACE(MAX_HANDOFF * sizeof(int))];
+    struct handoff h;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&h, 0, sizeof(h));
+    memset(cbuf, 0, sizeof(cbuf));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    pthread_mutex_lock(&fds_lock);
+    h.nfds = nfds;
+    memcpy(h.roles, roles, nfds * sizeof(int));
+    if (nfds > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    pthread_mutex_unlock(&fds_lock);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(h) ? 0 : -1;
+}
+
+int upgrade_inherit(char *path) {
+    struct sockaddr_un addr;
+    char buf[MAXLINE];
+    rio_t rio;
+    size_t len;
+    int cap = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("upgrade socket path too long");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    if (connect(ctlfd, (SA *)&addr, sizeof(addr)) < 0) {
+        /* No tiny to take over from: a cold start */
+        Close(ctlfd);
+        ctlfd = -1;
+        return 0;
+    }
+    if (recv_handoff(ctlfd) < 0) {
+        fprintf(stderr, "upgrade: bad handoff from %s\n", path);
+        exit(1);
+    }
+    /* The names follow, one per line, up to an empty line */
+    rio_readinitb(&rio, ctlfd);
+    while (1) {
+        if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+            fprintf(stderr, "upgrade: handoff from %s cut short\n", path);
+            exit(1);
+        }
+        if (!strcmp(buf, "\n"))
+            break;
+        if ((len = strlen(buf)) > 0 && buf[len - 1] == '\n')
+            buf[len - 1] = '\0';
+        if (nfunctions == cap) {
+            cap = cap ? 2 * cap : 16;
+            functions = Realloc(functions, cap * sizeof(char *));
+        }
+        functions[nfunctions++] = strdup(buf);
+    }
+    printf("upgrade: took over %d sockets and %d cached functions\n",
+            inherited.nfds, nfunctions);
+    return 1;
+}
+
+/* bound_to - whether listening socket fd is bound to port or path */
+static int bound_to(int fd, int port, char *path) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(fd, (SA *)&addr, &len) < 0)
+        return 0;
+    if (addr.ss_family == AF_UNIX)
+        return path != NULL &&
+            !strcmp(((struct sockaddr_un *)&addr)->sun_path, path);
+    if (path != NULL)
+        return 0;
+    if (addr.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port) == port;
+    if (addr.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port) == port;
+    return 0;
+}
+
+int upgrade_take(int role, int port, char *path) {
+    int i, fd;
+
+    for (i = 0; i < inherited.nfds; i++) {
+        if ((fd = inherited_fds[i]) < 0 || inherited.roles[i] != role ||
+                !bound_to(fd, port, path))
+            continue;
+        inherited_fds[i] = -1;
+        return fd;
+    }
+    return -1;
+}
+
+char **upgrade_functions(int *n) {
+    *n = nfunctions;
+    return functions;
+}
+
+void upgrade_listener(int fd, int role) {
+    pthread_mutex_lock(&fds_lock);
+    if (nfds < MAX_HANDOFF) {
+        fds[nfds] = fd;
+        roles[nfds++] = role;
+    }
+    else
+        fprintf(stderr, "upgrade: too many sockets, %d will not be handed "
+                "over\n", fd);
+    pthread_mutex_unlock(&fds_lock);
+}
+
+int upgrade_draining(void) {
+    return draining;
+}
+
+void upgrade_accepting(void) {
+    int i = __sync_fetch_and_add(&nacceptors, 1);
+
+    if (i < MAX_ACCEPTORS)
+        acceptors[i] = pthread_self();
+}
+
+/* A handover's signal only has to interrupt accept */
+static void wake(int sig) {
+    (void)sig;
+}
+
+/*
+ * hand_over - send a successor the listening sockets and the cached
+ *     function names, then wait for it to say it is serving. Returns -1
+ *     if it went away first; this tiny then goes on as before.
+ */
+static int hand_over(struct server *srv, int sock) {
+    char *names, go;
+    int rc;
+
+    if (send_handoff(sock) < 0)
+        return -1;
+    names = srv->ops.functions();
+    rc = rio_writen(sock, names, strlen(names)) < 0 ||
+        rio_writen(sock, "\n", 1) < 0;
+    Free(names);
+    if (rc)
+        return -1;
+    return read(sock, &go, 1) == 1 ? 0 : -1;
+}
+
+/*
+ * drain - stop accepting and exit once the connections still open are
+ *     gone, or after the drain timeout. Acceptors are woken again on
+ *     every check, in case one was between its check and accept when
+ *     the first signal came.
+ */
+static void drain(struct server *srv) {
+    long deadline = clock_ms() + srv->drain_ms;
+    int i, n;
+
+    draining = 1;
+    srv->ops.stop_accepting();
+    printf("upgrade: handed over, draining %ld connections\n", conn_active);
+    fflush(stdout);
+    while (conn_active > 0 && clock_ms() < deadline) {
+        n = nacceptors < MAX_ACCEPTORS ? nacceptors : MAX_ACCEPTORS;
+        for (i = 0; i < n; i++)
+            pthread_kill(acceptors[i], SIGUSR2);
+        usleep(DRAIN_CHECK_MS * 1000);
+    }
+    if (conn_active > 0)
+        printf("upgrade: drain timed out, dropping %ld connections\n",
+                conn_active);
+    else
+        printf("upgrade: drained, exiting\n");
+    fflush(stdout);
+    exit(0);
+}
+
+static void *upgrade_thread(void *arg) {
+    struct server *srv = arg;
+    int sock;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        if ((sock = accept(srv->listenfd, NULL, NULL)) < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "upgrade accept error: %s\n", strerror(errno));
+            continue;
+        }
+        if (hand_over(srv, sock) == 0)
+            break;
+        fprintf(stderr, "upgrade: successor went away, serving on\n");
+        Close(sock);
+    }
+    /* path belongs to the successor now, so it is not unlinked */
+    Close(srv->listenfd);
+    Close(sock);
+    drain(srv);
+    return NULL;
+}
+
+void upgrade_serve(char *path, struct upgrade_ops *ops, int drain_ms) {
+    struct server *srv = Malloc(sizeof(struct server));
+    struct sigaction action;
+    pthread_t tid;
+    int i;
+
+    /* No SA_RESTART, so the signal interrupts a blocked accept */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR2, &action, NULL) < 0)
+        unix_error("sigaction error");
+
+    /* Sockets the new configuration has no use for */
+    for (i = 0; i < inherited.nfds; i++)
+        if (inherited_fds[i] >= 0)
+            Close(inherited_fds[i]);
+    if (ctlfd >= 0) {
+        if (write(ctlfd, "", 1) != 1)
+            fprintf(stderr, "upgrade: the old tiny is gone\n");
+        Close(ctlfd);
+        ctlfd = -1;
+    }
+
+    srv->listenfd = Open_unix_listenfd(path);
+    srv->ops = *ops;
+    srv->drain_ms = drain_ms;
+    Pthread_create(&tid, NULL, upgrade_thread, srv);
+}
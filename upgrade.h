@@ -0,0 +1,69 @@
+/*
+ * upgrade.h - handing a running tiny's sockets to a new binary (-U)
+ *
+ * A tiny started with -U path listens for its successor on an AF_UNIX
+ * socket at path. A new tiny started with the same -U connects there
+ * first. If an older tiny answers, it sends every listening socket it
+ * has over SCM_RIGHTS, each tagged with its role, and then the names of
+ * the functions in its caches. The new tiny adopts the sockets instead
+ * of binding new ones, so connections keep queueing on the same ports
+ * throughout, and loads the functions before serving, so no request pays
+ * a cold dlopen. Once it is ready it tells the old tiny to go and takes
+ * path over for the next upgrade.
+ *
+ * The old tiny then stops accepting on the handed-over sockets, answers
+ * the requests it already has with Connection: close, and exits once its
+ * last connection is gone or the drain timeout passes. Callers attached
+ * through shared-memory rings (-r) lose their rings when it exits and
+ * must attach again, which reaches the new tiny.
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "csapp.h"
+
+/* What a handed-over listening socket is for */
+enum { UPGRADE_TCP, UPGRADE_TLS, UPGRADE_UNIX, UPGRADE_RING };
+
+/* Callbacks the old tiny uses while handing over */
+struct upgrade_ops {
+    char *(*functions)(void);       /* Malloc'd "name\n" list of cached functions */
+    void (*stop_accepting)(void);   /* leave the listening sockets alone */
+};
+
+/*
+ * Connects to path and, if an older tiny is there, receives its listening
+ * sockets and cached function names. Returns 1 if so, 0 if nobody is
+ * listening at path; exits if a handoff starts but fails.
+ */
+int upgrade_inherit(char *path);
+
+/*
+ * An inherited listening socket of role bound to port (TCP and TLS) or
+ * path (AF_UNIX), or -1 if there is none.
+ */
+int upgrade_take(int role, int port, char *path);
+
+/* The inherited function names; *n is set to their count */
+char **upgrade_functions(int *n);
+
+/* Records fd as a listening socket of role, to be handed over in turn */
+void upgrade_listener(int fd, int role);
+
+/*
+ * Closes inherited sockets nobody took, tells the old tiny to drain, and
+ * waits at path for a successor. After handing over, this tiny drains
+ * for at most drain_ms and exits.
+ */
+void upgrade_serve(char *path, struct upgrade_ops *ops, int drain_ms);
+
+/* Has this tiny handed its sockets over? */
+int upgrade_draining(void);
+
+/*
+ * Called by a thread that blocks in accept on a listening socket, so a
+ * handover can interrupt it; its accept then fails with EINTR.
+ */
+void upgrade_accepting(void);
+
+#endif /* __UPGRADE_H__ */
@@ -0,0 +1,290 @@
+/*
+ * uring.c - io_uring serving mode for tiny
+ */
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define RING_ENTRIES 256
+#define MAX_IOV 64
+
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_READ };
+
+struct uconn;
+
+/* What a completion refers to; found through the cqe's user data */
+struct uop {
+    int type;
+    int fd;             /* listening socket or file being read */
+    size_t len;         /* expected length of a file read */
+    struct uconn *uc;
+};
+
+struct uconn {
+    struct conn *c;
+    struct uop recv_op;
+    struct uop send_op;
+    struct msghdr msg;
+    struct iovec iov[MAX_IOV];
+    struct __kernel_timespec recv_ts;   /* timeout linked to the recv */
+    struct __kernel_timespec send_ts;   /* timeout linked to the sendmsg */
+    long header_due;    /* ms deadline of a partly received request, or 0 */
+    int inflight;       /* ops the kernel still owns */
+    int dead;           /* free once inflight drops to zero */
+};
+
+struct uring {
+    struct io_uring ring;
+    evloop_handler handler;
+    struct timeouts to;
+};
+
+/* get_sqe - next free submission entry, flushing the queue if it is full */
+static struct io_uring_sqe *get_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = io_uring_get_sqe(&u->ring)) == NULL)
+        io_uring_submit(&u->ring);
+    return sqe;
+}
+
+static void post_accept(struct uring *u, struct uop *op) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+
+    io_uring_prep_accept(sqe, op->fd, NULL, NULL, 0);
+    io_uring_sqe_set_data(sqe, op);
+}
+
+static void drop(struct uconn *uc) {
+    uc->dead = 1;
+    if (uc->inflight > 0)
+        return;
+    conn_free(uc->c);
+    Free(uc);
+}
+
+/* link_timeout - follow sqe with a timeout that cancels it after ms */
+static void link_timeout(struct uring *u, struct io_uring_sqe *sqe,
+        struct __kernel_timespec *ts, long ms) {
+    if (ms <= 0)
+        return;
+    /* An expired timeout cancels sqe, whose completion then drops uc */
+    sqe->flags |= IOSQE_IO_LINK;
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000L;
+    sqe = get_sqe(u);
+    io_uring_prep_link_timeout(sqe, ts, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+/*
+ * post_recv - read more request bytes. A partly received request must
+ *     complete by its header deadline; otherwise the connection waits
+ *     for a new request for up to the idle timeout.
+ */
+static void post_recv(struct uring *u, struct uconn *uc) {
+    struct conn *c = uc->c;
+    struct io_uring_sqe *sqe;
+    size_t room = conn_compact(c);
+    long ms;
+
+    if (room == 0) {    /* request header overflows the buffer */
+        drop(uc);
+        return;
+    }
+    sqe = get_sqe(u);
+    io_uring_prep_recv(sqe, c->fd, c->rio.rio_buf + c->rio.rio_cnt, room, 0);
+    io_uring_sqe_set_data(sqe, &uc->recv_op);
+    uc->inflight++;
+
+    if (uc->header_due > 0) {
+        ms = uc->header_due - clock_ms();
+        link_timeout(u, sqe, &uc->recv_ts, ms > 0 ? ms : 1);
+    }
+    else
+        link_timeout(u, sqe, &uc->recv_ts, u->to.idle_ms);
+}
+
+/*
+ * post_send - submit the queued response as one sendmsg. Each queued
+ *     file becomes a ring read into a fresh buffer, linked ahead of the
+ *     sendmsg so the kernel fills the buffer before sending from it.
+ */
+static void post_send(struct uring *u, struct uconn *uc) {
+    struct conn *c = uc->c;
+    struct io_uring_sqe *sqe;
+    struct seg *s;
+    struct uop *op;
+    int i, cnt;
+
+    for (i = c->head, cnt = 0; i < c->nsegs && cnt < MAX_IOV; i++, cnt++) {
+        s = &c->segs[i];
+        if (s->filefd >= 0) {
+            op = Malloc(sizeof(struct uop));
+            op->type = OP_READ;
+            op->fd = s->filefd;
+            op->len = s->len;
+            op->uc = uc;
+            s->owner = s->base = Malloc(s->len);
+            s->size = s->len;
+            s->filefd = -1;
+
+            sqe = get_sqe(u);
+            io_uring_prep_read(sqe, op->fd, s->base, s->len, s->off);
+            io_uring_sqe_set_data(sqe, op);
+            sqe->flags |= IOSQE_IO_LINK;
+            uc->inflight++;
+        }
+        uc->iov[cnt].iov_base = s->base;
+        uc->iov[cnt].iov_len = s->len;
+    }
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = cnt;
+
+    sqe = get_sqe(u);
+    io_uring_prep_sendmsg(sqe, c->fd, &uc->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, &uc->send_op);
+    uc->inflight++;
+    link_timeout(u, sqe, &uc->send_ts, u->to.body_ms);
+}
+
+/* serve - run every buffered request, then send or read more */
+static void serve(struct uring *u, struct uconn *uc) {
+    struct conn *c = uc->c;
+    int served = 0;
+
+    while (!c->closing && conn_has_request(c)) {
+        if (u->handler(c) < 0) {
+            drop(uc);
+            return;
+        }
+        served = 1;
+        if (!c->keepalive)
+            c->closing = 1;
+    }
+    /* Leftover bytes start the next request and its header deadline */
+    if (served)
+        uc->header_due = c->rio.rio_cnt > 0 && u->to.header_ms > 0 ?
+            clock_ms() + u->to.header_ms : 0;
+    if (c->pending > 0)
+        post_send(u, uc);
+    else if (c->closing)
+        drop(uc);
+    else
+        post_recv(u, uc);
+}
+
+static void on_accept(struct uring *u, struct uop *op, int res) {
+    struct uconn *uc;
+
+    post_accept(u, op);
+    if (res < 0) {
+        fprintf(stderr, "accept error: %s\n", strerror(-res));
+        return;
+    }
+    uc = Calloc(1, sizeof(struct uconn));
+    uc->c = conn_accept(res);
+    uc->recv_op.type = OP_RECV;
+    uc->recv_op.uc = uc;
+    uc->send_op.type = OP_SEND;
+    uc->send_op.uc = uc;
+    if (u->to.header_ms > 0)
+        uc->header_due = clock_ms() + u->to.header_ms;
+    post_recv(u, uc);
+}
+
+static void on_complete(struct uring *u, struct uop *op, int res) {
+    struct uconn *uc = op->uc;
+    struct io_uring_sqe *sqe;
+
+    if (op->type == OP_ACCEPT) {
+        on_accept(u, op, res);
+        return;
+    }
+
+    uc->inflight--;
+    switch (op->type) {
+    case OP_READ:
+        /* The file is no longer needed; close it through the ring too */
+        sqe = get_sqe(u);
+        io_uring_prep_close(sqe, op->fd);
+        io_uring_sqe_set_data(sqe, NULL);
+        Free(op);
+        if (uc->dead)
+            drop(uc);
+        /* A short read cancels the linked sendmsg, which drops uc */
+        return;
+    case OP_RECV:
+        if (uc->dead || res <= 0) {
+            drop(uc);
+            return;
+        }
+        if (uc->header_due == 0 && u->to.header_ms > 0)
+            uc->header_due = clock_ms() + u->to.header_ms;
+        uc->c->rio.rio_cnt += res;
+        serve(u, uc);
+        return;
+    case OP_SEND:
+        if (uc->dead || res < 0) {
+            drop(uc);
+            return;
+        }
+        conn_consume(uc->c, res);
+        if (uc->c->pending > 0)
+            post_send(u, uc);
+        else
+            serve(u, uc);
+        return;
+    }
+}
+
+static void *ring_thread(void *arg) {
+    struct uring *u = arg;
+    struct io_uring_cqe *cqe;
+    struct uop *op;
+    int res;
+
+    while (1) {
+        io_uring_submit_and_wait(&u->ring, 1);
+        while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+            op = io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&u->ring, cqe);
+            if (op != NULL)
+                on_complete(u, op, res);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * uring_run - start nrings ring threads, each with an accept outstanding
+ *     on every listening socket. The calling thread becomes the last ring.
+ */
+void uring_run(int *listenfds, int nlisten, int nrings,
+        const struct timeouts *to, evloop_handler handler) {
+    struct uring *rings = Calloc(nrings, sizeof(struct uring));
+    struct uop *op;
+    pthread_t tid;
+    int i, j, rc;
+
+    for (i = 0; i < nrings; i++) {
+        if ((rc = io_uring_queue_init(RING_ENTRIES, &rings[i].ring, 0)) < 0)
+            posix_error(-rc, "io_uring_queue_init error");
+        rings[i].handler = handler;
+        rings[i].to = *to;
+        for (j = 0; j < nlisten; j++) {
+            op = Calloc(1, sizeof(struct uop));
+            op->type = OP_ACCEPT;
+            op->fd = listenfds[j];
+            post_accept(&rings[i], op);
+        }
+    }
+    for (i = 0; i < nrings - 1; i++)
+        Pthread_create(&tid, NULL, ring_thread, &rings[i]);
+    ring_thread(&rings[nrings - 1]);
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,29 @@
+/*
+ * uring.h - io_uring serving mode for tiny
+ *
+ * Each ring thread keeps an accept outstanding on the listening sockets
+ * and drives its connections entirely through ring submissions: a recv
+ * into the connection's Rio buffer, then, once the handler has queued a
+ * response, the reads of any queued files linked ahead of a single
+ * sendmsg covering the whole response. Completions are reaped in batches
+ * and everything they trigger goes back to the kernel in one
+ * io_uring_submit_and_wait, so a request costs a few ring round trips
+ * instead of a chain of blocking syscalls. The deadlines of evloop.h are
+ * kept by the kernel: each recv and sendmsg carries a linked timeout
+ * for whatever remains of the header, idle or body deadline.
+ *
+ * Only built when liburing is available (HAVE_LIBURING); otherwise
+ * uring.o is empty and tiny rejects -m uring.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "evloop.h"
+
+#ifdef HAVE_LIBURING
+/* Runs nrings ring threads on the listening sockets; never returns */
+void uring_run(int *listenfds, int nlisten, int nrings,
+        const struct timeouts *to, evloop_handler handler);
+#endif
+
+#endif /* __URING_H__ */